@@ -0,0 +1,151 @@
+#ifndef DPOOL_ADAPTIVE_LIMITS_H_
+#define DPOOL_ADAPTIVE_LIMITS_H_
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#include "pooled-object.h"
+#include "cache-line.h"
+
+namespace dpool {
+
+// AdaptiveLimits holds the effective maxActive and maxIdle of a shard. With
+// adaptive sizing off they are the configured ones. With it on, they follow
+// the demand observed over windows of kWindowMs: by Little's law, the mean
+// number of connections in use is the arrival rate times the mean hold time,
+// and the limits are set to that plus a margin of 3 standard deviations of
+// Poisson arrivals (square root staffing), within the configured bounds.
+//
+// - After a window with a borrow refused at maxActive, maxActive at least
+//   doubles, so that sustained waiting is absorbed within a few windows.
+// - Otherwise maxActive shrinks by a quarter per window at most, and maxIdle
+//   by an eighth, so that a short lull does not close the connections the
+//   next burst needs. put() evicts the idle connections above the limit.
+//
+// Limits start at the upper bounds and are only updated by the shard
+// operations, so a shard without traffic keeps its last limits.
+class AdaptiveLimits {
+  public:
+    static const int kWindowMs = 100;
+
+    explicit AdaptiveLimits(const PoolConfig& config)
+        : kEnabled_(config.adaptive), kMinIdle_(config.minIdle), kMaxIdle_(config.maxIdle),
+          kMinActive_(config.minActive), kMaxActive_(config.maxActive),
+          maxIdle_(config.maxIdle), maxActive_(config.maxActive), windowStartNs_(-1),
+          arrivals_(0), refusals_(0), holds_(0), holdSumUs_(0) {
+    }
+
+    bool enabled() const {
+        return kEnabled_;
+    }
+
+    // Maximum number of connections, zero for no limit
+    int32_t maxActive() const {
+        return maxActive_.load(std::memory_order_relaxed);
+    }
+
+    int32_t maxIdle() const {
+        return maxIdle_.load(std::memory_order_relaxed);
+    }
+
+    // A get() reached the shard.
+    void onArrival() {
+        if (kEnabled_) {
+            arrivals_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // The hooks below need the time, only call them when enabled().
+
+    // A get() was refused, or timed out, at maxActive.
+    void onRefusal(int64_t nowNs) {
+        refusals_.fetch_add(1, std::memory_order_relaxed);
+        tick(nowNs);
+    }
+
+    // A connection was returned after @holdUs.
+    void onHold(int64_t holdUs, int64_t nowNs) {
+        holds_.fetch_add(1, std::memory_order_relaxed);
+        holdSumUs_.fetch_add(holdUs, std::memory_order_relaxed);
+        tick(nowNs);
+    }
+
+  private:
+    // Update the limits if the current window is over, by one thread only.
+    void tick(int64_t nowNs) {
+        int64_t start = windowStartNs_.load(std::memory_order_relaxed);
+        if (start < 0) {
+            windowStartNs_.compare_exchange_strong(start, nowNs, std::memory_order_relaxed);
+            return;
+        }
+        int64_t elapsedNs = nowNs - start;
+        if (elapsedNs < kWindowMs * 1000000LL
+                || !windowStartNs_.compare_exchange_strong(start, nowNs, std::memory_order_relaxed)) {
+            return;
+        }
+
+        uint64_t arrivals = arrivals_.exchange(0, std::memory_order_relaxed);
+        uint64_t refusals = refusals_.exchange(0, std::memory_order_relaxed);
+        uint64_t holds = holds_.exchange(0, std::memory_order_relaxed);
+        uint64_t holdSumUs = holdSumUs_.exchange(0, std::memory_order_relaxed);
+        if (holds == 0) {
+            // Nothing came back, the demand is unknown: only grow if refused.
+            if (refusals > 0 && kMaxActive_ > 0) {
+                maxActive_.store(clamp(maxActive() * 2, kMinActive_, kMaxActive_), std::memory_order_relaxed);
+            }
+            return;
+        }
+
+        // Little's law: L = lambda * W
+        double inUse = arrivals * 1e9 / elapsedNs * (holdSumUs / 1e6 / holds);
+        int32_t target = static_cast<int32_t>(std::ceil(inUse + 3 * std::sqrt(inUse))) + 1;
+
+        if (kMaxActive_ > 0) {
+            int32_t active = maxActive();
+            if (refusals > 0) {
+                active = target > active * 2 ? target : active * 2;
+            } else if (target > active) {
+                active = target;
+            } else {
+                active = shrink(active, target, 4);
+            }
+            maxActive_.store(clamp(active, kMinActive_, kMaxActive_), std::memory_order_relaxed);
+        }
+
+        int32_t idle = maxIdle();
+        idle = target > idle ? target : shrink(idle, target, 8);
+        maxIdle_.store(clamp(idle, kMinIdle_, kMaxIdle_), std::memory_order_relaxed);
+    }
+
+    // @value lowered toward @target by 1 / @divisor of itself, at least 1.
+    static int32_t shrink(int32_t value, int32_t target, int32_t divisor) {
+        int32_t step = value / divisor > 1 ? value / divisor : 1;
+        return value - step > target ? value - step : target;
+    }
+
+    static int32_t clamp(int32_t value, int32_t lo, int32_t hi) {
+        return value < lo ? lo : (value > hi ? hi : value);
+    }
+
+    const bool kEnabled_;
+    const int32_t kMinIdle_;
+    const int32_t kMaxIdle_;
+    const int32_t kMinActive_;
+    const int32_t kMaxActive_;
+
+    // Effective limits, read by every get() and put()
+    std::atomic<int32_t> maxIdle_;
+    std::atomic<int32_t> maxActive_;
+
+    // Demand of the current window, on a line of its own
+    DPOOL_CACHE_ALIGNED std::atomic<int64_t> windowStartNs_;
+    std::atomic<uint64_t> arrivals_;
+    std::atomic<uint64_t> refusals_;
+    std::atomic<uint64_t> holds_;
+    std::atomic<uint64_t> holdSumUs_;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_ADAPTIVE_LIMITS_H_
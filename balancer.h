@@ -0,0 +1,129 @@
+#ifndef DPOOL_BALANCER_H_
+#define DPOOL_BALANCER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+namespace dpool {
+
+// Balancer policies pick the shards DPool::get() tries. A policy provides:
+//
+//   unsigned start()  - position of the first shard to try; the next tries
+//                       go on with the following shards, modulo their count
+//   void skip()       - the shard at the current position could not lend a
+//                       connection
+//   kWindow           - DPool takes the least loaded of the next kWindow
+//                       available shards; above 1, it counts the borrowed
+//                       connections of every shard for that
+
+// The default balancer: round robin over one shared index.
+class RoundRobinBalancer {
+  public:
+    static const int kWindow = 1;
+
+    RoundRobinBalancer() : index_(0) {}
+
+    unsigned start() {
+        return index_.fetch_add(1);
+    }
+
+    void skip() {
+        index_.fetch_add(1);
+    }
+
+  private:
+    // @atomic index to pick the next shard
+    std::atomic<unsigned> index_;
+};
+
+// Round robin, then the least loaded of @Window consecutive available shards.
+template <int Window = 2>
+class LeastLoadedBalancer : public RoundRobinBalancer {
+  public:
+    static const int kWindow = Window;
+};
+
+// Cheap per thread pseudo random numbers (xorshift64*), seeded from the
+// thread id and the time the thread first asks.
+inline uint64_t threadRandom() {
+    static thread_local uint64_t state = 0;
+    if (state == 0) {
+        uint64_t seed = std::hash<std::thread::id>()(std::this_thread::get_id())
+                      ^ std::chrono::steady_clock::now().time_since_epoch().count();
+        // splitmix64 finalizer, so that close seeds diverge
+        seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+        state = (seed ^ (seed >> 31)) | 1;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dULL;
+}
+
+// Round robin over a cursor of the calling thread, starting at a random
+// offset: get() writes no shared memory, and threads spread evenly. Every
+// pool has cursors of its own, kept by the thread in a small table indexed
+// by the id of the pool: past kSlots pools, those sharing a slot start over
+// at a random offset when they take turns.
+class ThreadLocalBalancer {
+  public:
+    static const int kWindow = 1;
+
+    ThreadLocalBalancer() : id_(nextId()) {}
+
+    unsigned start() {
+        return cursor()++;
+    }
+
+    void skip() {
+        cursor()++;
+    }
+
+  private:
+    static const size_t kSlots = 64;
+
+    struct Slot {
+        uint64_t id;
+        unsigned cursor;
+    };
+
+    unsigned& cursor() {
+        // Zero initialized, ids start at 1.
+        static thread_local Slot slots[kSlots];
+        Slot& slot = slots[id_ % kSlots];
+        if (slot.id != id_) {
+            slot.id = id_;
+            slot.cursor = static_cast<unsigned>(threadRandom() >> 32);
+        }
+        return slot.cursor;
+    }
+
+    static uint64_t nextId() {
+        static std::atomic<uint64_t> next(1);
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    const uint64_t id_;
+};
+
+// A random first shard for every get(), then the least loaded of @Window
+// consecutive available shards, e.g. 2 for the power of two choices.
+template <int Window = 1>
+class RandomBalancer {
+  public:
+    static const int kWindow = Window;
+
+    unsigned start() {
+        return static_cast<unsigned>(threadRandom() >> 32);
+    }
+
+    void skip() {}
+};
+
+} // namespace dpool
+
+#endif // DPOOL_BALANCER_H_
@@ -0,0 +1,418 @@
+#ifndef DPOOL_BROKER_H_
+#define DPOOL_BROKER_H_
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "dpool.h"
+
+namespace dpool {
+
+// Requests of a client to the broker, one byte per message.
+static const char kBrokerBorrow = 'B';
+static const char kBrokerReturn = 'R';
+static const char kBrokerReturnBroken = 'X';
+
+// Reply to kBrokerBorrow, with the socket of the connection attached if
+// status is kGetOk.
+struct BrokerReply {
+    int32_t status;
+    // host:port of the server the socket is connected to
+    char server[64];
+};
+
+// Unix socket address of @path, false if it is too long.
+static inline bool brokerAddress(const std::string& path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    memcpy(addr->sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// Send @len bytes of @buf in one message, with @fd attached if not -1.
+static inline bool brokerSend(int sock, const void* buf, size_t len, int fd) {
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(buf);
+    iov.iov_len = len;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t)len;
+}
+
+// Receive a message of @len bytes into @buf, and the fd attached to it, if
+// any, into @fd, else -1.
+static inline bool brokerRecv(int sock, void* buf, size_t len, int* fd) {
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    do {
+        n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    *fd = -1;
+    for (struct cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : nullptr; cmsg != nullptr;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (n != (ssize_t)len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+        return false;
+    }
+    return true;
+}
+
+// ConnectionBroker lends the connections of a pool to the processes of the
+// host, e.g. short-lived CLI or worker processes that would otherwise dial
+// and authenticate on startup: a client connects to the Unix socket of the
+// broker and gets the socket of a warm connection by SCM_RIGHTS, in one
+// round trip, see BrokeredConnection. The connection stays borrowed from the
+// pool until the client gives it back, or goes away, in which case it is
+// put back as broken.
+//
+// T must return its socket from PooledObject::getFd(). A client must give a
+// connection back as it got it, with no reply pending, or as broken.
+//
+// serve() runs on one thread: a borrow that dials holds up the others.
+template <typename T, typename Pool = DPool<T>>
+class ConnectionBroker {
+  public:
+    // Listen on @path, replacing what is there, with the permissions @mode.
+    // @pool must outlive the broker.
+    ConnectionBroker(Pool& pool, const std::string& path, mode_t mode = 0600)
+        : pool_(pool), path_(path), listenFd_(-1), numLent_(0) {
+        stopPipe_[0] = stopPipe_[1] = -1;
+        struct sockaddr_un addr;
+        if (!brokerAddress(path, &addr)) {
+            DPOOL_THROW("broker socket path too long: " + path);
+        }
+        if (::pipe2(stopPipe_, O_CLOEXEC | O_NONBLOCK) != 0) {
+            DPOOL_THROW("failed to create the stop pipe of the broker");
+        }
+        listenFd_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        ::unlink(path.c_str());
+        if (listenFd_ < 0 || ::bind(listenFd_, (struct sockaddr*)&addr, sizeof(addr)) != 0
+                || ::chmod(path.c_str(), mode) != 0 || ::listen(listenFd_, SOMAXCONN) != 0) {
+            closeAll();
+            DPOOL_THROW("failed to listen on " + path);
+        }
+    }
+
+    ConnectionBroker(const ConnectionBroker&) = delete;
+    ConnectionBroker& operator=(const ConnectionBroker&) = delete;    // noncopyable
+
+    // The connections still lent are put back as broken.
+    ~ConnectionBroker() {
+        while (!clients_.empty()) {
+            drop(clients_.size() - 1);
+        }
+        closeAll();
+        ::unlink(path_.c_str());
+    }
+
+    // Serve the clients until stop().
+    void serve() {
+        while (true) {
+            fds_.clear();
+            addFd(stopPipe_[0]);
+            addFd(listenFd_);
+            for (auto it = clients_.begin(); it != clients_.end(); it++) {
+                addFd(it->sock);
+            }
+            if (::poll(fds_.data(), fds_.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                DPOOL_THROW("broker poll failed");
+            }
+            if (fds_[0].revents != 0) {
+                char c;
+                while (::read(stopPipe_[0], &c, 1) == 1) {}
+                return;
+            }
+            // From the last, so that drop() only moves clients already served
+            for (size_t i = clients_.size(); i-- > 0; ) {
+                if (fds_[i + 2].revents != 0 && !serveClient(clients_[i])) {
+                    drop(i);
+                }
+            }
+            if (fds_[1].revents != 0) {
+                int sock;
+                while ((sock = ::accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+                    clients_.push_back(Client(sock));
+                }
+            }
+        }
+    }
+
+    // Make serve() return, from any thread or a signal handler.
+    void stop() {
+        char c = 0;
+        ssize_t n = ::write(stopPipe_[1], &c, 1);
+        (void)n;
+    }
+
+    // Connections lent to clients at the moment
+    int32_t numLent() const {
+        return numLent_.load(std::memory_order_relaxed);
+    }
+
+    const std::string& path() const {
+        return path_;
+    }
+
+  private:
+    struct Client {
+        explicit Client(int sock) : sock(sock) {}
+
+        int sock;
+        // Connection lent to the client, if any
+        std::shared_ptr<T> pc;
+    };
+
+    void addFd(int fd) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        fds_.push_back(pfd);
+    }
+
+    // @return - false if the client is gone, or broke the protocol
+    bool serveClient(Client& client) {
+        char req;
+        ssize_t n = ::recv(client.sock, &req, 1, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return true;
+        }
+        if (n != 1) {
+            return false;
+        }
+        switch (req) {
+        case kBrokerBorrow:
+            return client.pc == nullptr && lend(client);
+        case kBrokerReturn:
+        case kBrokerReturnBroken:
+            if (client.pc == nullptr) {
+                return false;
+            }
+            pool_.put(client.pc, req == kBrokerReturnBroken);
+            client.pc.reset();
+            numLent_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    bool lend(Client& client) {
+        BrokerReply reply;
+        memset(&reply, 0, sizeof(reply));
+        std::shared_ptr<T> pc;
+        GetStatus status = pool_.tryGet(pc);
+        int fd = -1;
+        if (status == kGetOk) {
+            fd = pc->getFd();
+            if (fd < 0) {
+                pool_.put(pc, true);
+                pc.reset();
+                status = kGetUnavailable;
+            } else {
+                strncpy(reply.server, pc->getServerAddr().to_string().c_str(), sizeof(reply.server) - 1);
+            }
+        }
+        reply.status = status;
+        // Counted before the client has it, and may give it back.
+        if (pc != nullptr) {
+            numLent_.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (!brokerSend(client.sock, &reply, sizeof(reply), fd)) {
+            // The client did not get the socket.
+            if (pc != nullptr) {
+                pool_.put(pc);
+                numLent_.fetch_sub(1, std::memory_order_relaxed);
+            }
+            return false;
+        }
+        client.pc = pc;
+        return true;
+    }
+
+    void drop(size_t i) {
+        Client& client = clients_[i];
+        if (client.pc != nullptr) {
+            pool_.put(client.pc, true);
+            numLent_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        ::close(client.sock);
+        clients_[i] = clients_.back();
+        clients_.pop_back();
+    }
+
+    void closeAll() {
+        if (listenFd_ >= 0) {
+            ::close(listenFd_);
+            listenFd_ = -1;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (stopPipe_[i] >= 0) {
+                ::close(stopPipe_[i]);
+            }
+        }
+    }
+
+  private:
+    Pool& pool_;
+    const std::string path_;
+    int listenFd_;
+    int stopPipe_[2];
+    std::vector<Client> clients_;
+    // Scratch of serve()
+    std::vector<struct pollfd> fds_;
+    std::atomic<int32_t> numLent_;
+};
+
+// BrokeredConnection borrows a connection from the ConnectionBroker
+// listening on the Unix socket at serverAddr_.host, rather than dialing the
+// server: open() gets its socket, getFd(), and release() or the destructor
+// gives it back. Wrap the socket with the client library, e.g. with
+// redisConnectFd() of hiredis, without closing it, and call markBroken()
+// after an error or with a reply pending. A DPool of BrokeredConnection
+// keeps them borrowed while idle.
+class BrokeredConnection : public PooledObject {
+  public:
+    BrokeredConnection(const InetSocketAddress& addr, const int connTimeout, const int dataTimeout)
+        : PooledObject(addr, connTimeout, dataTimeout), sock_(-1), fd_(-1), broken_(false) {
+    }
+
+    virtual ~BrokeredConnection() {
+        release();
+    }
+
+    virtual void open() throw (DPoolException) override {
+        struct sockaddr_un addr;
+        if (!brokerAddress(serverAddr_.host, &addr)) {
+            failOpen("broker socket path too long: " + serverAddr_.host, __FILE__, __LINE__);
+            return;
+        }
+        sock_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (sock_ < 0) {
+            failOpen("can't create a socket to the broker", __FILE__, __LINE__);
+            return;
+        }
+        // The borrow is bounded by the connect timeout, like a dial.
+        struct timeval tv;
+        tv.tv_sec = connTimeout_ / 1000; tv.tv_usec = 1000 * (connTimeout_ % 1000);
+        ::setsockopt(sock_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ::setsockopt(sock_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        BrokerReply reply;
+        int fd = -1;
+        std::string errmsg;
+        if (::connect(sock_, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            errmsg = "can't connect to the broker at " + serverAddr_.host;
+        } else if (!brokerSend(sock_, &kBrokerBorrow, 1, -1)
+                || !brokerRecv(sock_, &reply, sizeof(reply), &fd)) {
+            errmsg = "no reply from the broker at " + serverAddr_.host;
+        } else if (reply.status != kGetOk || fd < 0) {
+            errmsg = std::string("the broker has no connection to lend: ")
+                   + getStatusName(static_cast<GetStatus>(reply.status));
+        }
+        if (!errmsg.empty()) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            ::close(sock_);
+            sock_ = -1;
+            failOpen(errmsg, __FILE__, __LINE__);
+            return;
+        }
+        fd_ = fd;
+        server_.assign(reply.server, strnlen(reply.server, sizeof(reply.server)));
+    }
+
+    // Socket of the connection lent by the broker, -1 if none
+    virtual int getFd() const override {
+        return fd_;
+    }
+
+    // host:port of the server the connection is to
+    const std::string& getServer() const {
+        return server_;
+    }
+
+    // Have the broker drop the connection rather than lend it again.
+    void markBroken() {
+        broken_ = true;
+    }
+
+    // Give the connection back to the broker, closing the socket.
+    void release() {
+        if (sock_ < 0) {
+            return;
+        }
+        // Closed first, the next client must be the only one using it.
+        ::close(fd_);
+        fd_ = -1;
+        char req = broken_ ? kBrokerReturnBroken : kBrokerReturn;
+        // If it fails, the broker sees the client go away instead.
+        brokerSend(sock_, &req, 1, -1);
+        ::close(sock_);
+        sock_ = -1;
+    }
+
+  private:
+    // Unix socket to the broker
+    int sock_;
+    int fd_;
+    bool broken_;
+    std::string server_;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_BROKER_H_
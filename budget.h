@@ -0,0 +1,152 @@
+#ifndef DPOOL_BUDGET_H_
+#define DPOOL_BUDGET_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "cache-line.h"
+
+namespace dpool {
+
+// ConnectionBudget caps the connections open at a time across the pools
+// attached to it, e.g. every pool of a process under its fd limit, on top of
+// the maxActive of their shards. A dial takes a unit of the budget, and the
+// close of the connection gives it back. When the budget is spent, the
+// dialing pool reclaims an idle connection of another pool, those holding
+// the most connections first, so that the pools under load get the
+// connections the others keep idle. A dial fails if no pool has any.
+class ConnectionBudget {
+  public:
+    // A pool attached to the budget, see DPool.
+    class Member {
+      public:
+        Member() : budget_(nullptr), open_(0) {}
+
+        virtual ~Member() {}
+
+        // Take a unit of the budget for a dial.
+        // @return - false if the budget is spent, and nothing was reclaimed
+        bool acquire() {
+            return budget_->acquire(this);
+        }
+
+        // Give back the unit of a closed connection.
+        void release() {
+            open_.fetch_sub(1, std::memory_order_relaxed);
+            budget_->open_.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        // Connections of the member open at the moment
+        int32_t open() const {
+            return open_.load(std::memory_order_relaxed);
+        }
+
+        // Close one idle connection of the member, called by other members
+        // short of budget. Must not take the budget lock.
+        // @return - false if there was none
+        virtual bool reclaimIdle() = 0;
+
+      private:
+        friend class ConnectionBudget;
+
+        ConnectionBudget* budget_;
+        std::atomic<int32_t> open_;
+    };
+
+    explicit ConnectionBudget(int32_t maxOpen)
+        : kMaxOpen_(maxOpen), open_(0), numReclaimed_(0), numRefused_(0) {}
+
+    ConnectionBudget(const ConnectionBudget&) = delete;
+    ConnectionBudget& operator=(const ConnectionBudget&) = delete;    // noncopyable
+
+    // @member is detached by its destructor, and must be before the budget
+    // is destroyed.
+    void attach(Member* member) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        member->budget_ = this;
+        members_.push_back(member);
+    }
+
+    void detach(Member* member) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        members_.erase(std::remove(members_.begin(), members_.end(), member), members_.end());
+    }
+
+    int32_t maxOpen() const {
+        return kMaxOpen_;
+    }
+
+    // Connections open at the moment, across members
+    int32_t open() const {
+        return open_.load(std::memory_order_relaxed);
+    }
+
+    // Idle connections closed for another member
+    uint64_t numReclaimed() const {
+        return numReclaimed_.load(std::memory_order_relaxed);
+    }
+
+    // Dials refused for lack of budget
+    uint64_t numRefused() const {
+        return numRefused_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    static const int kMaxReclaims = 3;
+
+    bool acquire(Member* member) {
+        for (int reclaims = 0; ; reclaims++) {
+            int32_t open = open_.load(std::memory_order_relaxed);
+            while (open < kMaxOpen_) {
+                if (open_.compare_exchange_weak(open, open + 1, std::memory_order_relaxed)) {
+                    member->open_.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            // Another dial may take the reclaimed unit first.
+            if (reclaims == kMaxReclaims || !reclaim(member)) {
+                numRefused_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+    }
+
+    // Close an idle connection of another member than @member, the one with
+    // the most connections open first. A pool is one member, so that it
+    // never evicts the idle connections of its own shards or bulkheads.
+    bool reclaim(Member* member) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        victims_.assign(members_.begin(), members_.end());
+        victims_.erase(std::remove(victims_.begin(), victims_.end(), member), victims_.end());
+        std::sort(victims_.begin(), victims_.end(), [](const Member* a, const Member* b) {
+            return a->open() > b->open();
+        });
+        for (auto it = victims_.begin(); it != victims_.end(); it++) {
+            if ((*it)->reclaimIdle()) {
+                numReclaimed_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const int32_t kMaxOpen_;
+
+    // Hot: taken and given back by every dial and close
+    DPOOL_CACHE_ALIGNED std::atomic<int32_t> open_;
+    std::atomic<uint64_t> numReclaimed_;
+    std::atomic<uint64_t> numRefused_;
+
+    DPOOL_CACHE_ALIGNED std::mutex mtx_;
+    // Guarded by mtx_
+    std::vector<Member*> members_;
+    // Scratch of reclaim()
+    std::vector<Member*> victims_;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_BUDGET_H_
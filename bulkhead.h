@@ -0,0 +1,41 @@
+#ifndef DPOOL_BULKHEAD_H_
+#define DPOOL_BULKHEAD_H_
+
+#include <string>
+
+#include "pooled-object.h"
+
+namespace dpool {
+
+// A named partition of a DPool, e.g. "user-facing" or "batch", with a budget
+// of its own on every server: maxIdle, maxActive and the other limits of
+// @config apply to the shards of the bulkhead only, and so does the
+// concurrency limiter of every shard. The bulkheads of a pool share its
+// server list, health checker and statistics, so that isolating traffic
+// classes no longer takes one pool, and one health check, per class.
+struct BulkheadConfig {
+    BulkheadConfig(const std::string& name, const PoolConfig& config) : name(name), config(config) {}
+
+    std::string name;
+    PoolConfig config;
+};
+
+// Handle of a bulkhead, as returned by DPool::bulkhead(). The default one is
+// the first bulkhead of the pool.
+class Bulkhead {
+  public:
+    Bulkhead() : id_(0) {}
+
+    explicit Bulkhead(unsigned id) : id_(id) {}
+
+    unsigned id() const {
+        return id_;
+    }
+
+  private:
+    unsigned id_;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_BULKHEAD_H_
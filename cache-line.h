@@ -0,0 +1,121 @@
+#ifndef DPOOL_CACHE_LINE_H_
+#define DPOOL_CACHE_LINE_H_
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+#include "dpool-exception.h"
+
+namespace dpool {
+
+// Size of the cache lines hot state is aligned on, to avoid false sharing.
+static const size_t kCacheLineSize = 64;
+
+#define DPOOL_CACHE_ALIGNED alignas(::dpool::kCacheLineSize)
+
+// @size bytes aligned on @align, a cache line at least, to free().
+inline void* alignedAlloc(size_t size, size_t align) {
+    void* p = nullptr;
+    if (posix_memalign(&p, align > kCacheLineSize ? align : kCacheLineSize, size) != 0) {
+        raiseBadAlloc();
+    }
+    return p;
+}
+
+// Class specific operator new and delete for the classes with cache aligned
+// members: unlike the global ones before C++17, they honor the alignas() of
+// @Class.
+#define DPOOL_ALIGNED_NEW(Class)                                    \
+    static void* operator new(size_t size) {                        \
+        return ::dpool::alignedAlloc(size, alignof(Class));         \
+    }                                                               \
+    static void operator delete(void* p) {                          \
+        free(p);                                                    \
+    }
+
+// Fixed capacity array of objects constructed in place, in one block aligned
+// on a cache line: unlike new[] before C++17, it honors the alignas() of U.
+// Objects need not be copyable nor movable.
+template <typename U>
+class AlignedArray {
+  public:
+    AlignedArray() : data_(nullptr), size_(0), capacity_(0) {}
+
+    explicit AlignedArray(size_t capacity) : data_(nullptr), size_(0), capacity_(0) {
+        reserve(capacity);
+    }
+
+    AlignedArray(const AlignedArray&) = delete;
+    AlignedArray& operator=(const AlignedArray&) = delete;    // noncopyable
+
+    ~AlignedArray() {
+        clear();
+        free(data_);
+    }
+
+    // Allocate room for @capacity objects, only once.
+    void reserve(size_t capacity) {
+        if (data_ != nullptr || capacity == 0) {
+            return;
+        }
+        data_ = static_cast<U*>(alignedAlloc(capacity * sizeof(U), alignof(U)));
+        capacity_ = capacity;
+    }
+
+    // Construct the next object from @args, past the capacity is an error.
+    template <typename... Args>
+    U& emplace_back(Args&&... args) {
+        if (size_ >= capacity_) {
+            raiseBadAlloc();
+        }
+        U* u = new (data_ + size_) U(std::forward<Args>(args)...);
+        size_++;
+        return *u;
+    }
+
+    // Destroy the objects, last first.
+    void clear() {
+        while (size_ > 0) {
+            data_[--size_].~U();
+        }
+    }
+
+    U& operator[](size_t i) {
+        return data_[i];
+    }
+
+    const U& operator[](size_t i) const {
+        return data_[i];
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    U* begin() {
+        return data_;
+    }
+
+    U* end() {
+        return data_ + size_;
+    }
+
+    const U* begin() const {
+        return data_;
+    }
+
+    const U* end() const {
+        return data_ + size_;
+    }
+
+  private:
+    U* data_;
+    size_t size_;
+    size_t capacity_;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_CACHE_LINE_H_
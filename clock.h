@@ -0,0 +1,113 @@
+#ifndef DPOOL_CLOCK_H_
+#define DPOOL_CLOCK_H_
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace dpool {
+
+// A clock policy abstracts the passage of time for DPool & PoolShard. It provides:
+//
+//   time_point, duration            - std::chrono types used for deadlines
+//   static time_point now()
+//   static void sleepFor(duration)
+//   static void sleepUntil(time_point)
+//   static std::cv_status waitUntil(cv, lck, time_point)
+//   static const bool kRealTime     - true if time passes on its own, so that
+//                                     background threads (health checker) can
+//                                     be driven by it.
+
+// SystemClock is the default clock policy, backed by the monotonic clock.
+struct SystemClock {
+    typedef std::chrono::steady_clock::time_point time_point;
+    typedef std::chrono::steady_clock::duration duration;
+
+    static const bool kRealTime = true;
+
+    static time_point now() {
+        return std::chrono::steady_clock::now();
+    }
+
+    static void sleepFor(duration d) {
+        std::this_thread::sleep_for(d);
+    }
+
+    static void sleepUntil(time_point abs_time) {
+        std::this_thread::sleep_until(abs_time);
+    }
+
+    static std::cv_status waitUntil(std::condition_variable& cv,
+                                    std::unique_lock<std::mutex>& lck, time_point abs_time) {
+        return cv.wait_until(lck, abs_time);
+    }
+};
+
+// SimClock is a virtual clock for deterministic, single threaded simulation.
+// Time only moves when the simulation advances it, or when the pool itself
+// sleeps or waits: since there is no other thread that could wake a waiter up,
+// a wait simply jumps to its deadline and times out. A pool running on SimClock
+// does not spawn the health checker thread; the driver calls
+// DPool::runHealthCheck() at the simulated interval instead.
+class SimClock {
+  public:
+    typedef std::chrono::steady_clock::time_point time_point;
+    typedef std::chrono::steady_clock::duration duration;
+
+    static const bool kRealTime = false;
+
+    static time_point now() {
+        return time_point(duration(ticks().load(std::memory_order_relaxed)));
+    }
+
+    static void sleepFor(duration d) {
+        advance(d);
+    }
+
+    static void sleepUntil(time_point abs_time) {
+        advanceTo(abs_time);
+    }
+
+    static std::cv_status waitUntil(std::condition_variable&, std::unique_lock<std::mutex>&,
+                                    time_point abs_time) {
+        advanceTo(abs_time);
+        return std::cv_status::timeout;
+    }
+
+    static void advance(duration d) {
+        if (d.count() > 0) {
+            ticks().fetch_add(d.count(), std::memory_order_relaxed);
+        }
+    }
+
+    // Move the clock forward to @abs_time, never backward.
+    static void advanceTo(time_point abs_time) {
+        duration::rep target = abs_time.time_since_epoch().count();
+        duration::rep cur = ticks().load(std::memory_order_relaxed);
+        while (cur < target && !ticks().compare_exchange_weak(cur, target, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Set the clock to @abs_time, backward or forward. A simulation driver
+    // uses it to charge the time spent in a blocking call to the caller only.
+    static void set(time_point abs_time) {
+        ticks().store(abs_time.time_since_epoch().count(), std::memory_order_relaxed);
+    }
+
+    // Rewind the clock to epoch, e.g. between two simulation runs.
+    static void reset() {
+        ticks().store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    static std::atomic<duration::rep>& ticks() {
+        static std::atomic<duration::rep> ticks(0);
+        return ticks;
+    }
+};
+
+} // namespace dpool
+
+#endif // DPOOL_CLOCK_H_
@@ -0,0 +1,351 @@
+#ifndef DPOOL_CLUSTER_H_
+#define DPOOL_CLUSTER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "dpool.h"
+
+namespace dpool {
+
+static const int kClusterSlots = 16384;
+
+// CRC16-CCITT (XMODEM) of the Redis Cluster key hashing.
+inline uint16_t crc16(const char* buf, size_t len) {
+    static const struct Table {
+        Table() {
+            for (int i = 0; i < 256; i++) {
+                uint16_t crc = i << 8;
+                for (int b = 0; b < 8; b++) {
+                    crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+                }
+                v[i] = crc;
+            }
+        }
+
+        uint16_t v[256];
+    } table;
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc << 8) ^ table.v[((crc >> 8) ^ (uint8_t)buf[i]) & 0xff];
+    }
+    return crc;
+}
+
+// Slot of @key: only the hash tag is hashed, the part between the first {
+// and the next }, if not empty.
+inline int keyHashSlot(const char* key, size_t len) {
+    size_t open = 0;
+    while (open < len && key[open] != '{') {
+        open++;
+    }
+    if (open < len) {
+        size_t close = open + 1;
+        while (close < len && key[close] != '}') {
+            close++;
+        }
+        if (close < len && close != open + 1) {
+            return crc16(key + open + 1, close - open - 1) & (kClusterSlots - 1);
+        }
+    }
+    return crc16(key, len) & (kClusterSlots - 1);
+}
+
+inline int keyHashSlot(const std::string& key) {
+    return keyHashSlot(key.data(), key.size());
+}
+
+// Slots @first to @last served by the primary @node, as listed by CLUSTER
+// SLOTS.
+struct ClusterSlotRange {
+    ClusterSlotRange(int first, int last, const InetSocketAddress& node) : first(first), last(last), node(node) {}
+
+    int first;
+    int last;
+    InetSocketAddress node;
+};
+
+// A MOVED or ASK error reply, e.g. "MOVED 3999 127.0.0.1:6381".
+struct ClusterRedirect {
+    ClusterRedirect() : ask(false), slot(-1), port(0) {}
+
+    // Parse @error into the redirection.
+    // @return - false if @error is not a redirection
+    bool parse(const std::string& error) {
+        size_t pos;
+        if (error.compare(0, 6, "MOVED ") == 0) {
+            ask = false;
+            pos = 6;
+        } else if (error.compare(0, 4, "ASK ") == 0) {
+            ask = true;
+            pos = 4;
+        } else {
+            return false;
+        }
+        char* end = nullptr;
+        long n = strtol(error.c_str() + pos, &end, 10);
+        size_t colon = error.rfind(':');
+        if (end == error.c_str() + pos || *end != ' ' || n < 0 || n >= kClusterSlots
+                || colon == std::string::npos || colon <= (size_t)(end - error.c_str()) + 1) {
+            return false;
+        }
+        slot = n;
+        host = error.substr(end - error.c_str() + 1, colon - (end - error.c_str()) - 1);
+        port = atoi(error.c_str() + colon + 1);
+        return port > 0;
+    }
+
+    // ASK: the node serves the slot for the next command only, to be sent
+    // after ASKING. MOVED: the node serves the slot from now on.
+    bool ask;
+    int slot;
+    std::string host;
+    uint16_t port;
+};
+
+// ClusterPool routes the borrows of keys to the primary serving their slot in
+// a Redis Cluster, with a DPool per node, e.g. of PooledRedisContext. The
+// slot map is a flat array of node indexes, so that routing a key costs its
+// hash and two loads.
+//
+// The map comes from CLUSTER SLOTS, run by the caller through its client
+// library and applied by updateSlots(), which also adds the pools of new
+// nodes and retires those of the nodes left without slots. A MOVED reply
+// updates the slot at once, see tryGetRedirected(), and marks the map stale
+// until the next updateSlots(). Slots not mapped yet go to the first node,
+// which redirects.
+//
+// Retired pools are shut down, which closes their idle connections and those
+// put back later. Their node index goes to the next new node once nothing is
+// borrowed from them, but the pools themselves are kept until the
+// ClusterPool is destroyed, for the get() that may still hold one.
+template <typename T, typename Pool = DPool<T>>
+class ClusterPool {
+  public:
+    typedef typename Pool::Clock Clock;
+
+    // Pools of the @seeds nodes, configured with @config as every node to
+    // come. No more than @maxNodes pools are in service or lending
+    // connections at a time.
+    ClusterPool(const std::vector<InetSocketAddress>& seeds, PoolConfig config, size_t maxNodes = 1024)
+        : config_(config), kMaxNodes_(maxNodes < kNoNode ? maxNodes : kNoNode),
+          slots_(new std::atomic<uint16_t>[kClusterSlots]), pools_(new std::atomic<Pool*>[kMaxNodes_]),
+          fallback_(kNoNode), stale_(true), numMoved_(0), numAsk_(0) {
+        for (int i = 0; i < kClusterSlots; i++) {
+            slots_[i].store(kNoNode, std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < kMaxNodes_; i++) {
+            pools_[i].store(nullptr, std::memory_order_relaxed);
+        }
+        std::lock_guard<std::mutex> lck(mtx_);
+        for (auto it = seeds.begin(); it != seeds.end(); it++) {
+            uint16_t node = addNode(*it);
+            if (fallback_.load(std::memory_order_relaxed) == kNoNode) {
+                fallback_.store(node, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    ClusterPool(const ClusterPool&) = delete;
+    ClusterPool& operator=(const ClusterPool&) = delete;    // noncopyable
+
+    // Borrow a connection to the node serving @key.
+    std::shared_ptr<T> get(const std::string& key, Priority priority = kPriorityNormal) throw (DPoolException) {
+        std::shared_ptr<T> pc;
+        if (tryGet(pc, key, priority) != kGetOk) {
+            DPOOL_THROW("failed to get connection for slot " + std::to_string(keyHashSlot(key)));
+        }
+        return pc;
+    }
+
+    // The get() above, failing with a status, see DPool::tryGet().
+    GetStatus tryGet(std::shared_ptr<T>& pc, const std::string& key, Priority priority = kPriorityNormal) {
+        return tryGetSlot(pc, keyHashSlot(key), priority);
+    }
+
+    GetStatus tryGetSlot(std::shared_ptr<T>& pc, int slot, Priority priority = kPriorityNormal) {
+        uint16_t node = slots_[slot].load(std::memory_order_relaxed);
+        if (node == kNoNode) {
+            node = fallback_.load(std::memory_order_relaxed);
+        }
+        return tryGetNode(pc, node, priority);
+    }
+
+    // Follow the MOVED or ASK reply @error: borrow a connection to the node
+    // it names, adding its pool if new. @asking is set for ASK, after which
+    // the caller sends ASKING before the command.
+    // @return - kGetUnavailable if @error is no redirection
+    GetStatus tryGetRedirected(std::shared_ptr<T>& pc, const std::string& error, bool* asking,
+                               Priority priority = kPriorityNormal) {
+        ClusterRedirect redirect;
+        pc.reset();
+        if (!redirect.parse(error)) {
+            return kGetUnavailable;
+        }
+        *asking = redirect.ask;
+        uint16_t node;
+        {
+            std::lock_guard<std::mutex> lck(mtx_);
+            node = addNode(InetSocketAddress(redirect.host, redirect.port));
+            if (!redirect.ask && node != kNoNode) {
+                slots_[redirect.slot].store(node, std::memory_order_relaxed);
+                stale_.store(true, std::memory_order_relaxed);
+            }
+        }
+        (redirect.ask ? numAsk_ : numMoved_).fetch_add(1, std::memory_order_relaxed);
+        return tryGetNode(pc, node, priority);
+    }
+
+    void put(std::shared_ptr<T> pc, bool broken = false) {
+        static_cast<Pool*>(pc->getPool())->put(pc, broken);
+    }
+
+    // Apply the slot map listed by CLUSTER SLOTS: the slots of @ranges go to
+    // their nodes, the others are unmapped, and the nodes left without slots
+    // are retired.
+    void updateSlots(const std::vector<ClusterSlotRange>& ranges) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        std::vector<uint16_t> slots(kClusterSlots, kNoNode);
+        for (auto it = ranges.begin(); it != ranges.end(); it++) {
+            uint16_t node = addNode(it->node);
+            for (int slot = it->first; slot <= it->last && slot < kClusterSlots; slot++) {
+                slots[slot] = node;
+            }
+        }
+        std::vector<bool> serving(nodes_.size(), false);
+        for (int slot = 0; slot < kClusterSlots; slot++) {
+            slots_[slot].store(slots[slot], std::memory_order_relaxed);
+            if (slots[slot] != kNoNode) {
+                serving[slots[slot]] = true;
+            }
+        }
+        fallback_.store(ranges.empty() ? kNoNode : addNode(ranges[0].node), std::memory_order_relaxed);
+        for (size_t i = 0; i < nodes_.size(); i++) {
+            if (!serving[i] && pools_[i].load(std::memory_order_relaxed) != nullptr) {
+                pools_[i].store(nullptr, std::memory_order_release);
+                nodes_[i].pool->shutdown();
+            }
+        }
+        stale_.store(false, std::memory_order_relaxed);
+    }
+
+    // Whether the slot map should be fetched again with CLUSTER SLOTS: true
+    // before the first updateSlots(), and after a MOVED.
+    bool isStale() const {
+        return stale_.load(std::memory_order_relaxed);
+    }
+
+    // host:port of the node serving @slot, "" if unmapped
+    std::string nodeOf(int slot) const {
+        std::lock_guard<std::mutex> lck(mtx_);
+        uint16_t node = slots_[slot].load(std::memory_order_relaxed);
+        return node != kNoNode ? nodes_[node].addr : "";
+    }
+
+    // Nodes with a pool in service
+    size_t numNodes() const {
+        std::lock_guard<std::mutex> lck(mtx_);
+        size_t n = 0;
+        for (size_t i = 0; i < nodes_.size(); i++) {
+            n += pools_[i].load(std::memory_order_relaxed) != nullptr;
+        }
+        return n;
+    }
+
+    uint64_t numMoved() const {
+        return numMoved_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t numAsk() const {
+        return numAsk_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    static const uint16_t kNoNode = 0xffff;
+
+    struct Node {
+        std::string addr;
+        std::unique_ptr<Pool> pool;
+    };
+
+    GetStatus tryGetNode(std::shared_ptr<T>& pc, uint16_t node, Priority priority) {
+        Pool* pool = node != kNoNode ? pools_[node].load(std::memory_order_acquire) : nullptr;
+        if (pool == nullptr) {
+            pc.reset();
+            return kGetUnavailable;
+        }
+        return pool->tryGet(pc, priority);
+    }
+
+    // Index of the node in service at @addr, a new one if none: that of a
+    // drained retired node, or past the others, kNoNode past kMaxNodes_.
+    // Called with mtx_ held.
+    uint16_t addNode(const InetSocketAddress& addr) {
+        std::string name = addr.to_string();
+        for (size_t i = 0; i < nodes_.size(); i++) {
+            if (nodes_[i].addr == name && pools_[i].load(std::memory_order_relaxed) != nullptr) {
+                return i;
+            }
+        }
+        size_t node = nodes_.size();
+        for (size_t i = 0; i < nodes_.size(); i++) {
+            if (pools_[i].load(std::memory_order_relaxed) == nullptr && isDrained(*nodes_[i].pool)) {
+                node = i;
+                break;
+            }
+        }
+        if (node == nodes_.size()) {
+            if (nodes_.size() >= kMaxNodes_) {
+                return kNoNode;
+            }
+            nodes_.push_back(Node());
+        } else {
+            retired_.push_back(std::move(nodes_[node].pool));
+        }
+        nodes_[node].addr = name;
+        nodes_[node].pool.reset(new Pool(std::vector<InetSocketAddress>(1, addr), config_));
+        pools_[node].store(nodes_[node].pool.get(), std::memory_order_release);
+        return node;
+    }
+
+    // Whether no connection of the retired @pool is borrowed any more.
+    static bool isDrained(const Pool& pool) {
+        std::vector<ShardSnapshot> snapshots;
+        pool.getSnapshots(snapshots);
+        for (auto it = snapshots.begin(); it != snapshots.end(); it++) {
+            if (it->numActive != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const PoolConfig config_;
+    const size_t kMaxNodes_;
+
+    // Read by every get(): node index of every slot, and pool of every
+    // node, nullptr once retired
+    std::unique_ptr<std::atomic<uint16_t>[]> slots_;
+    std::unique_ptr<std::atomic<Pool*>[]> pools_;
+    std::atomic<uint16_t> fallback_;
+
+    std::atomic<bool> stale_;
+    std::atomic<uint64_t> numMoved_;
+    std::atomic<uint64_t> numAsk_;
+
+    // Serializes the updates of the map
+    mutable std::mutex mtx_;
+    // Every node in service or retired, guarded by mtx_
+    std::vector<Node> nodes_;
+    // Pools of the retired nodes whose index was taken over
+    std::vector<std::unique_ptr<Pool>> retired_;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_CLUSTER_H_
@@ -0,0 +1,22 @@
+#ifndef DPOOL_DIAL_GATE_H_
+#define DPOOL_DIAL_GATE_H_
+
+namespace dpool {
+
+// DialGate admits the dials of a shard against limits shared beyond it, e.g.
+// a ConnectionBudget or the quota of a ShmCoordinator. The shard calls
+// acquire() before dialing, and release() once the dial failed or the
+// connection is closed. Only dials and closes go through it.
+class DialGate {
+  public:
+    virtual ~DialGate() {}
+
+    // @return - false if the dial may not happen
+    virtual bool acquire() = 0;
+
+    virtual void release() = 0;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_DIAL_GATE_H_
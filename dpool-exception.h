@@ -1,9 +1,26 @@
 #ifndef DPOOL_DPOOL_EXCEPTION_H_
 #define DPOOL_DPOOL_EXCEPTION_H_
 
+#include <cstdlib>
 #include <exception>
+#include <iostream>
+#include <new>
 #include <sstream>
 
+// Whether the library is built with exceptions. Without them, e.g. with
+// -fno-exceptions, the errors that would throw print the exception and
+// abort: use DPool::tryGet() to borrow, and PooledObject::failOpen() to
+// fail a dial.
+#ifndef DPOOL_EXCEPTIONS
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+#define DPOOL_EXCEPTIONS 1
+#else
+#define DPOOL_EXCEPTIONS 0
+#endif
+#endif
+
+#define DPOOL_THROW(errmsg) ::dpool::raise(::dpool::DPoolException(errmsg, __FILE__, __LINE__))
+
 namespace dpool {
 
 class DPoolException: public std::exception {
@@ -38,7 +55,52 @@ class DPoolException: public std::exception {
     const int line_;
 };
 
+// Throw @ex, or print it and abort when built without exceptions.
+[[noreturn]] inline void raise(const DPoolException& ex) {
+#if DPOOL_EXCEPTIONS
+    throw ex;
+#else
+    std::cerr << ex.str() << std::endl;
+    std::abort();
+#endif
+}
+
+[[noreturn]] inline void raiseBadAlloc() {
+#if DPOOL_EXCEPTIONS
+    throw std::bad_alloc();
+#else
+    std::cerr << "dpool: out of memory" << std::endl;
+    std::abort();
+#endif
+}
+
+// Outcome of DPool::tryGet(), and of the shard get() it went through last.
+enum GetStatus {
+    kGetOk = 0,
+    // Every shard tried was at maxActive, or at its concurrency limit
+    kGetExhausted,
+    // The deadline passed
+    kGetTimedOut,
+    // Every shard is unavailable
+    kGetUnavailable,
+    kGetClosed,
+    // Opening a new connection failed
+    kGetDialFailed,
+};
+
+inline const char* getStatusName(GetStatus status) {
+    switch (status) {
+      case kGetOk:          return "ok";
+      case kGetExhausted:   return "exhausted";
+      case kGetTimedOut:    return "timed-out";
+      case kGetUnavailable: return "unavailable";
+      case kGetClosed:      return "closed";
+      case kGetDialFailed:  return "dial-failed";
+      default:              return "unknown";
+    }
 }
 
+} // namespace dpool
+
 #endif // DPOOL_DPOOL_EXCEPTION_H_
 
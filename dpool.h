@@ -14,104 +14,657 @@
 
 #include "dpool-exception.h"
 #include "pooled-object.h"
+#include "policies.h"
 #include "pool-shard.h"
+#include "lockfree-shard.h"
+#include "numa-shard.h"
+#include "cache-line.h"
+#include "shard-set.h"
+#include "bulkhead.h"
+#include "budget.h"
+#include "shm-coordinator.h"
+#include "trace.h"
+#include "flight-recorder.h"
+#include "logger.h"
+#include "probes.h"
+#include "exporter.h"
 
 namespace dpool {
 
-template <typename T>
+// See policies.h for the policies a pool is configured with.
+template <typename T,
+          typename ShardPolicy = LockedShard,
+          typename BalancerPolicy = RoundRobinBalancer,
+          typename StatsPolicy = CountingStats,
+          typename ClockPolicy = SystemClock,
+          typename LoggerPolicy = RuntimeLogger,
+          typename ListenerPolicy = NoListener,
+          typename LimiterPolicy = NoLimiter>
 class DPool {
   public:
-    DPool(const std::vector<InetSocketAddress>& servers, PoolConfig config)
-        : poolConfig_(config), closed_(false) {
+    typedef ClockPolicy Clock;
+    typedef Clock clock_type;
+    typedef ShardTraits<ClockPolicy, StatsPolicy, LoggerPolicy, ListenerPolicy> Traits;
+    typedef typename ShardPolicy::template type<T, Traits> Shard;
+    typedef typename LimiterPolicy::Shard Limiter;
+
+    // A pool allocated with new, e.g. by ClusterPool, keeps its hot members
+    // on cache lines of their own.
+    DPOOL_ALIGNED_NEW(DPool)
+
+    // @budget, if any, caps the connections of the pool together with the
+    // other pools attached to it, see budget.h. @coordinator, if any, shares
+    // connection quotas and health checks with the pools of other processes,
+    // see shm-coordinator.h. Both must outlive the pool.
+    DPool(const std::vector<InetSocketAddress>& servers, PoolConfig config,
+          ConnectionBudget* budget = nullptr, ShmCoordinator* coordinator = nullptr)
+        : DPool(servers, std::vector<BulkheadConfig>(1, BulkheadConfig("", config)), budget, coordinator) {
+    }
+
+    // A pool partitioned into @bulkheads, each with shards of its own on
+    // every server, see bulkhead.h. The first one is the default bulkhead.
+    DPool(const std::vector<InetSocketAddress>& servers, const std::vector<BulkheadConfig>& bulkheads,
+          ConnectionBudget* budget = nullptr, ShmCoordinator* coordinator = nullptr)
+        : servers_(servers), poolShards_(servers.size() * bulkheads.size()), shardSet_(servers.size()),
+          limiters_(servers.size() * bulkheads.size()), spillovers_(servers.size() * bulkheads.size()),
+          poolConfig_(bulkheads.at(0).config), zoned_(!poolConfig_.localZone.empty()), tracer_(nullptr),
+          publisher_(nullptr), budget_(budget), budgetMember_(this), reclaimCursor_(0),
+          coordinator_(coordinator), gates_(servers.size()), closed_(false) {
         assert(!servers.empty());
         numAvailable_ = servers.size();
-        for (auto it = servers.begin(); it != servers.end(); it++) {
-            servers_.push_back(*it);
-            PoolShard<T>* shard = new PoolShard<T>(*it, poolConfig_);
-            poolShards_.push_back(shard);
+        // Shards of the first bulkhead, then of the second... all of them
+        // indexed by their server, which they share the state of.
+        for (auto b = bulkheads.begin(); b != bulkheads.end(); b++) {
+            bulkheads_.push_back(b->name);
+            for (size_t i = 0; i < servers.size(); i++) {
+                poolShards_.emplace_back(servers[i], b->config, i, &listener_);
+            }
+        }
+        for (size_t i = 0; i < servers.size(); i++) {
+            if (zoned_ && servers[i].zone == poolConfig_.localZone) {
+                shardSet_.setLocal(i);
+                localServers_.push_back(i);
+            }
+        }
+        // Every shard has a limiter of its own, so that a bulkhead at its
+        // limit does not hold back the others on the server.
+        for (size_t i = 0; i < poolShards_.size(); i++) {
+            limiters_.emplace_back();
+            spillovers_.emplace_back(0);
+        }
+        if (budget_ != nullptr) {
+            budget_->attach(&budgetMember_);
+        }
+        // The shards of every bulkhead on a server share its gate.
+        for (size_t i = 0; i < servers.size(); i++) {
+            int slot = coordinator_ != nullptr ? coordinator_->server(servers[i]) : -1;
+            gates_.emplace_back(budget_ != nullptr ? &budgetMember_ : nullptr, coordinator_, slot);
+        }
+        if (budget_ != nullptr || coordinator_ != nullptr) {
+            for (size_t i = 0; i < poolShards_.size(); i++) {
+                poolShards_[i].setDialGate(&gates_[i % servers.size()]);
+            }
         }
 
-        healthCheckThread_ = std::thread(&DPool<T>::healthCheck, this);
+        // A virtual clock does not move by itself, the simulation drives the
+        // health check through runHealthCheck() instead.
+        if (Clock::kRealTime) {
+            healthCheckThread_ = std::thread(&DPool::healthCheck, this);
+        }
     }
 
     virtual ~DPool() {
         if (!closed_.load(std::memory_order_relaxed)) {
             shutdown();
         }
-        for (int i = 0; i < poolShards_.size(); ++i) {
-            delete poolShards_[i];
+        // No more reclaims, before the shards go.
+        if (budget_ != nullptr) {
+            budget_->detach(&budgetMember_);
         }
+        poolShards_.clear();
     }
 
     DPool(const DPool&) = delete;
     DPool& operator=(const DPool&) = delete;    // noncopyable
 
-    std::shared_ptr<T> get() throw (DPoolException) {
-        unsigned localIndex = index_.fetch_add(1);
+    // Borrow a connection at @priority, see PoolConfig::withReserve().
+    std::shared_ptr<T> get(Priority priority = kPriorityNormal) throw (DPoolException) {
+        return get(Bulkhead(), priority);
+    }
+
+    // Borrow a connection from the shards of @bulkhead.
+    std::shared_ptr<T> get(Bulkhead bulkhead, Priority priority = kPriorityNormal) throw (DPoolException) {
+        return get(bulkhead, Clock::time_point::max(), priority);
+    }
 
-        for (unsigned tries=0; tries < 5; ++tries) {
-            int idx = ((localIndex + tries) % servers_.size());
+    // Borrow a connection before @deadline: the retries, waits and dials of
+    // get() all stop at the deadline, and the read/write timeout of the
+    // connection is bounded by the time left, see
+    // PooledObject::limitDataTimeout().
+    std::shared_ptr<T> get(typename Clock::time_point deadline, Priority priority = kPriorityNormal)
+            throw (DPoolException) {
+        return get(Bulkhead(), deadline, priority);
+    }
 
-            if (!poolShards_[idx]->isAvailable()) {
-                index_.fetch_add(1);
-                continue;
+    std::shared_ptr<T> get(Bulkhead bulkhead, typename Clock::time_point deadline,
+                           Priority priority = kPriorityNormal) throw (DPoolException) {
+        std::shared_ptr<T> pc;
+        GetStatus status = tryGet(pc, bulkhead, deadline, priority);
+        if (status == kGetTimedOut) {
+            DPOOL_THROW("deadline exceeded before getting a connection");
+        } else if (status != kGetOk) {
+            DPOOL_THROW("failed to get connection from any available shard");
+        }
+        return pc;
+    }
+
+    // The get() above, but failing with a status instead of an exception, so
+    // that a failed borrow costs no allocation and no unwinding: @pc is set
+    // to the borrowed connection, and left empty unless kGetOk is returned.
+    // The only get() of a library built without exceptions.
+    GetStatus tryGet(std::shared_ptr<T>& pc, Priority priority = kPriorityNormal) {
+        return tryGet(pc, Bulkhead(), Clock::time_point::max(), priority);
+    }
+
+    GetStatus tryGet(std::shared_ptr<T>& pc, Bulkhead bulkhead, Priority priority = kPriorityNormal) {
+        return tryGet(pc, bulkhead, Clock::time_point::max(), priority);
+    }
+
+    GetStatus tryGet(std::shared_ptr<T>& pc, typename Clock::time_point deadline,
+                     Priority priority = kPriorityNormal) {
+        return tryGet(pc, Bulkhead(), deadline, priority);
+    }
+
+    GetStatus tryGet(std::shared_ptr<T>& pc, Bulkhead bulkhead, typename Clock::time_point deadline,
+                     Priority priority = kPriorityNormal) {
+        assert(bulkhead.id() < bulkheads_.size());
+        pc.reset();
+        if (closed_.load(std::memory_order_relaxed)) {
+            return kGetClosed;
+        }
+        bool bounded = deadline != Clock::time_point::max();
+        TraceRecorder* tracer = tracer_.load(std::memory_order_relaxed);
+        typename Clock::time_point start;
+        if (tracer != nullptr) {
+            start = Clock::now();
+        }
+
+        // Only available shards are tried, found through the bitmap of
+        // shardSet_: unavailable ones cost neither a try nor a cache miss,
+        // and the round robin goes over the available shards only. With a
+        // local zone, its shards are tried first, then the others, unless
+        // the zone is short of shards or headroom, see
+        // PoolConfig::withLocalZone(). Every available shard of a zone gets a
+        // try, including those whose failures the health check has not seen
+        // yet, before spilling over or failing.
+        unsigned rr = balancer_.start();
+        ShardSet::Zone zone = zoned_ && preferLocal() ? ShardSet::kLocalZone : ShardSet::kAnyZone;
+        size_t numAvailable = shardSet_.numAvailable(zone);
+        int first = numAvailable > 0 ? shardSet_.nthAvailable(rr % numAvailable, zone) : ShardSet::kNone;
+        size_t pos = first != ShardSet::kNone ? first : 0;
+        // Why the last try failed
+        GetStatus status = kGetUnavailable;
+        // Tries in the current zone, and in all
+        unsigned tries = 0;
+        unsigned numTries = 0;
+        while (true) {
+            if (bounded && Clock::now() >= deadline) {
+                status = kGetTimedOut;
+                break;
+            }
+            int idx = tries < numAvailable ? nextShard(pos, zone) : ShardSet::kNone;
+            if (idx == ShardSet::kNone && zone == ShardSet::kLocalZone) {
+                // Every local shard failed: spill over.
+                zone = ShardSet::kRemoteZone;
+                tries = 0;
+                numAvailable = shardSet_.numAvailable(zone);
+                first = numAvailable > 0 ? shardSet_.nthAvailable(rr % numAvailable, zone) : ShardSet::kNone;
+                idx = first != ShardSet::kNone ? nextShard(first, zone) : ShardSet::kNone;
+            }
+            if (idx == ShardSet::kNone) {
+                break;
             }
+            pos = (idx + 1) % servers_.size();
+            tries++;
+            numTries++;
 
-            std::shared_ptr<T> pc = poolShards_[idx]->get();
-            if (pc == nullptr) {
-                index_.fetch_add(1);
+            status = borrow(pc, idx, bulkhead, deadline, priority);
+            if (status != kGetOk) {
+                balancer_.skip();
                 continue;
             }
-            return pc;
+            if (tracer != nullptr) {
+                traceGet(tracer, start, idx, pc.get());
+            }
+            DPOOL_PROBE2(pool__get__return, idx, numTries);
+            return kGetOk;
+        }
+
+        if (tracer != nullptr) {
+            traceGet(tracer, start, TraceRecord::kNoShard, nullptr);
+        }
+        DPOOL_PROBE2(pool__get__return, -1, numTries);
+        return status;
+    }
+
+    // Borrow a connection to server @server only, the @server-th of the
+    // list the pool was created with, in one try: no retry on another
+    // server, for the callers routing by server, e.g. ReplicatedPool.
+    GetStatus tryGetFrom(std::shared_ptr<T>& pc, size_t server, Bulkhead bulkhead = Bulkhead(),
+                         typename Clock::time_point deadline = Clock::time_point::max(),
+                         Priority priority = kPriorityNormal) {
+        assert(server < servers_.size() && bulkhead.id() < bulkheads_.size());
+        pc.reset();
+        if (closed_.load(std::memory_order_relaxed)) {
+            return kGetClosed;
+        }
+        if (deadline != Clock::time_point::max() && Clock::now() >= deadline) {
+            return kGetTimedOut;
+        }
+        if (!shardSet_.isAvailable(server)) {
+            return kGetUnavailable;
         }
+        TraceRecorder* tracer = tracer_.load(std::memory_order_relaxed);
+        typename Clock::time_point start;
+        if (tracer != nullptr) {
+            start = Clock::now();
+        }
+        GetStatus status = borrow(pc, server, bulkhead, deadline, priority);
+        if (tracer != nullptr) {
+            traceGet(tracer, start, status == kGetOk ? (int)server : TraceRecord::kNoShard, pc.get());
+        }
+        DPOOL_PROBE2(pool__get__return, status == kGetOk ? (int)server : -1, 1);
+        return status;
+    }
+
+    // Whether server @server is considered healthy by the health checker.
+    bool isAvailable(size_t server) const {
+        return shardSet_.isAvailable(server);
+    }
 
-        throw DPoolException("failed to get connection after max retries", __FILE__, __LINE__);
+    // Whether the recent dials or returns of server @server failed, until a
+    // health check finds it healthy. Unlike isAvailable(), it is not held
+    // back by the 1/3 of the servers at most marked unavailable.
+    bool isSuspect(size_t server) const {
+        return shardSet_.isSuspect(server);
     }
 
     void put(std::shared_ptr<T> pc, bool broken = false) {
         assert(pc != nullptr && "cannot return nullptr");
-        PoolShard<T>* shard = (PoolShard<T>*)(pc->getDataSource());
+        Shard* shard = (Shard*)(pc->getDataSource());
         assert(shard != nullptr && "shard should not be null");
-        return shard->put(pc, broken);
+
+        TraceRecorder* tracer = tracer_.load(std::memory_order_relaxed);
+        if (tracer != nullptr) {
+            int64_t now = toNanos(Clock::now());
+            int64_t holdNs = pc->getBorrowTime() >= 0 ? now - pc->getBorrowTime() : 0;
+            tracer->record(now, TraceRecord::kPut, shard->getIndex(), holdNs / 1000,
+                           broken ? TraceRecord::kBroken : 0, pc.get());
+        }
+        if ((BalancerPolicy::kWindow > 1 || zoned_) && pc->isBorrowed()) {
+            shardSet_.onReturn(shard->getIndex());
+        }
+        if (LimiterPolicy::kEnabled && pc->isBorrowed()) {
+            int64_t borrowTime = pc->getBorrowTime();
+            int64_t rttUs = borrowTime >= 0 ? (toNanos(Clock::now()) - borrowTime) / 1000 : -1;
+            limiters_[shard - &poolShards_[0]].release(rttUs, broken);
+        }
+        shard->put(pc, broken);
+        if (broken && shard->isSuspectable()) {
+            shardSet_.setSuspect(shard->getIndex(), true);
+        }
+    }
+
+    // Send the messages of the pool and its shards to @logger, nullptr for
+    // silence. The default is an AsyncLogger to stderr, see defaultLogger().
+    // Ignored by the NullLogger policy.
+    void setLogger(Logger* logger) {
+        logger_.set(logger);
+        for (auto it = poolShards_.begin(); it != poolShards_.end(); it++) {
+            it->setLogger(logger);
+        }
+    }
+
+    // Publish the statistics into @publisher after every health check round,
+    // nullptr to stop. The publisher must outlive the pool, or be detached.
+    void setStatsPublisher(ShmStatsPublisher* publisher) {
+        publisher_.store(publisher, std::memory_order_relaxed);
+    }
+
+    // The bulkhead named @name, see bulkhead.h.
+    Bulkhead bulkhead(const std::string& name) const throw (DPoolException) {
+        for (size_t b = 0; b < bulkheads_.size(); b++) {
+            if (bulkheads_[b] == name) {
+                return Bulkhead(b);
+            }
+        }
+        DPOOL_THROW("no such bulkhead " + name);
+    }
+
+    // The listener notified of the events of the pool, see listener.h.
+    ListenerPolicy& listener() {
+        return listener_;
+    }
+
+    // Record every get/put into @tracer, or stop recording if nullptr. The
+    // recorder must outlive the pool, or be detached before it is destroyed.
+    void setTraceRecorder(TraceRecorder* tracer) {
+        tracer_.store(tracer, std::memory_order_relaxed);
     }
 
     void shutdown() {
         bool expected = false;
         if (!(closed_.compare_exchange_strong(expected, true))) {
-            std::cerr << "dpool: pool already closed" << std::endl;
+            DPOOL_LOG(logger(), kLogAlreadyClosed, "pool already closed");
             return;
         }
-        healthCheckThread_.join();
-        // TODO
+        {
+            std::lock_guard<std::mutex> lck(healthCheckMtx_);
+        }
+        healthCheckCv_.notify_all();
+        if (healthCheckThread_.joinable()) {
+            healthCheckThread_.join();
+        }
+        // Close the idle connections, and those put back from now on.
+        for (size_t i = 0; i < poolShards_.size(); i++) {
+            poolShards_[i].close();
+        }
     }
 
-    // Pool statistics for monitor
+    // Cumulative, non destructive statistics of every shard, see exporter.h.
+    // The shards of every bulkhead follow those of the previous one.
+    void getSnapshots(std::vector<ShardSnapshot>& snapshots) const {
+        snapshots.resize(poolShards_.size());
+        for (size_t i = 0; i < poolShards_.size(); i++) {
+            poolShards_[i].getSnapshot(snapshots[i]);
+            snapshots[i].bulkhead = bulkheads_[i / servers_.size()];
+            snapshots[i].concurrencyLimit = limiters_[i].limit();
+            snapshots[i].zone = servers_[i % servers_.size()].zone;
+            snapshots[i].numSpillover = spillovers_[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    // Statistics of every shard broken down per NUMA node, only available
+    // with the NumaShard policy.
+    void getNodeSnapshots(std::vector<ShardSnapshot>& snapshots) const {
+        snapshots.clear();
+        std::vector<ShardSnapshot> nodes;
+        for (size_t i = 0; i < poolShards_.size(); i++) {
+            poolShards_[i].getNodeSnapshots(nodes);
+            for (auto it = nodes.begin(); it != nodes.end(); it++) {
+                it->bulkhead = bulkheads_[i / servers_.size()];
+            }
+            snapshots.insert(snapshots.end(), nodes.begin(), nodes.end());
+        }
+    }
+
+    // Pool statistics for monitor, since the previous call
     void getPoolStats(std::vector<PoolStats>& statsList) {
         statsList.clear();
         for (auto it = poolShards_.begin(); it != poolShards_.end(); it++) {
-            PoolStats st((*it)->getServerAddr());
-            (*it)->getShardStats(st);
+            PoolStats st(it->getServerAddr());
+            it->getShardStats(st);
             statsList.push_back(st);
         }
     }
 
+    // Run one round of health check: probe the suspectable or unavailable
+    // shards, and mark them available or not accordingly. Called periodically
+    // by the health checker thread, or directly by a simulation driver.
+    // Only the shards flagged in shardSet_ are visited. With a coordinator,
+    // only its leader probes, see runSharedHealthCheck().
+    void runHealthCheck() {
+        if (coordinator_ != nullptr) {
+            runSharedHealthCheck();
+            return;
+        }
+        for (int i = shardSet_.nextToCheck(0); i != ShardSet::kNone; i = shardSet_.nextToCheck(i + 1)) {
+            Shard* shard = &poolShards_[i];
+            // Stay flagged while suspectable, like when every shard was polled.
+            bool suspectable = isSuspectable(i);
+            shardSet_.setSuspect(i, suspectable);
+            if (!suspectable && shard->isAvailable()) {
+                continue;
+            }
+
+            bool ok = checkServer(shard->getServerAddr());
+            DPOOL_PROBE2(pool__health__check, shard->getIndex(), ok);
+            markAvailable(shard, ok);
+        }
+    }
+
   private:
-    void markAvailable(PoolShard<T>* shard, bool b) {
+    // One try of get() on the shard of server @idx in @bulkhead.
+    // @return - kGetOk if @pc was borrowed, else why not
+    GetStatus borrow(std::shared_ptr<T>& pc, size_t idx, Bulkhead bulkhead,
+                     typename Clock::time_point deadline, Priority priority) {
+        size_t i = bulkhead.id() * servers_.size() + idx;
+        // A shard at its concurrency limit is passed over, see limiter.h.
+        if (!limiters_[i].tryAcquire()) {
+            return kGetExhausted;
+        }
+        GetStatus status = kGetOk;
+        Shard& shard = poolShards_[i];
+        pc = shard.get(priority, deadline, &status);
+        if (pc == nullptr) {
+            limiters_[i].release(-1, false);
+            if (shard.isSuspectable()) {
+                shardSet_.setSuspect(idx, true);
+            }
+            return status;
+        }
+        pc->setPool(this);
+        if (BalancerPolicy::kWindow > 1 || zoned_) {
+            shardSet_.onBorrow(idx);
+        }
+        if (zoned_ && !shardSet_.isLocal(idx)) {
+            spillovers_[i].fetch_add(1, std::memory_order_relaxed);
+        }
+        if (LimiterPolicy::kEnabled && !Traits::kTimed) {
+            // The shard only times borrows for its stats and listener.
+            pc->setBorrowTime(toNanos(Clock::now()));
+        }
+        // Every borrow sets the timeout, to undo the one of a previous
+        // borrow with a deadline.
+        pc->limitDataTimeout(deadline != Clock::time_point::max() ? remainingMs(deadline) : -1);
+        return kGetOk;
+    }
+
+    // The next shard of @zone for get() to try, from @pos on.
+    int nextShard(size_t pos, ShardSet::Zone zone) const {
+        return BalancerPolicy::kWindow > 1 ? shardSet_.leastLoaded(pos, BalancerPolicy::kWindow, zone)
+                                           : shardSet_.nextAvailable(pos, zone);
+    }
+
+    // Whether get() keeps to the local zone: enough of its shards are
+    // available, and their borrowed connections leave enough headroom.
+    bool preferLocal() const {
+        size_t numLocal = shardSet_.numAvailable(ShardSet::kLocalZone);
+        if (numLocal == 0 || numLocal * 100 < poolConfig_.minLocalHealthyPercent * localServers_.size()) {
+            return false;
+        }
+        int64_t capacity = (int64_t)numLocal * poolConfig_.maxActive;
+        int64_t borrowed = 0;
+        for (auto it = localServers_.begin(); it != localServers_.end(); it++) {
+            if (shardSet_.isAvailable(*it)) {
+                borrowed += shardSet_.inflight(*it);
+            }
+        }
+        return (capacity - borrowed) * 100 >= poolConfig_.minLocalHeadroomPercent * capacity;
+    }
+
+    // The leader of the coordinator probes the servers suspected by any
+    // process or unavailable, and publishes the results. The other processes
+    // apply them, and report their suspects to the leader.
+    void runSharedHealthCheck() {
+        bool leader = coordinator_->lead();
+        if (leader) {
+            coordinator_->sweep();
+        }
+        for (size_t i = 0; i < servers_.size(); i++) {
+            Shard* shard = &poolShards_[i];
+            int slot = gates_[i].slot();
+            bool suspectable = isSuspectable(i);
+            shardSet_.setSuspect(i, suspectable);
+            if (slot < 0 || leader) {
+                // No slot left in the segment: on our own.
+                if (!suspectable && shard->isAvailable()
+                        && (slot < 0 || (!coordinator_->isSuspect(slot) && coordinator_->isAvailable(slot)))) {
+                    continue;
+                }
+                bool ok = checkServer(shard->getServerAddr());
+                DPOOL_PROBE2(pool__health__check, shard->getIndex(), ok);
+                if (slot >= 0) {
+                    coordinator_->publish(slot, ok);
+                }
+                markAvailable(shard, ok);
+                continue;
+            }
+            if (suspectable) {
+                coordinator_->reportSuspect(slot);
+            }
+            bool ok = coordinator_->isAvailable(slot);
+            if (ok != shard->isAvailable()) {
+                markAvailable(shard, ok);
+            }
+        }
+    }
+
+    // Dials of the shards of a server, against the budget and the quota of
+    // the server in the coordinator.
+    class ServerGate : public DialGate {
+      public:
+        ServerGate(ConnectionBudget::Member* budget, ShmCoordinator* coordinator, int slot)
+            : budget_(budget), coordinator_(slot >= 0 ? coordinator : nullptr), slot_(slot) {}
+
+        virtual bool acquire() override {
+            if (budget_ != nullptr && !budget_->acquire()) {
+                return false;
+            }
+            if (coordinator_ != nullptr && !coordinator_->acquire(slot_)) {
+                if (budget_ != nullptr) {
+                    budget_->release();
+                }
+                return false;
+            }
+            return true;
+        }
+
+        virtual void release() override {
+            if (coordinator_ != nullptr) {
+                coordinator_->release(slot_);
+            }
+            if (budget_ != nullptr) {
+                budget_->release();
+            }
+        }
+
+        // Slot of the server in the coordinator, -1 if none
+        int slot() const {
+            return slot_;
+        }
+
+      private:
+        ConnectionBudget::Member* const budget_;
+        ShmCoordinator* const coordinator_;
+        const int slot_;
+    };
+
+    // Gives the idle connections of the pool to the other pools of its
+    // budget.
+    class BudgetMember : public ConnectionBudget::Member {
+      public:
+        explicit BudgetMember(DPool* pool) : pool_(pool) {}
+
+        virtual bool reclaimIdle() override {
+            return pool_->reclaimIdle();
+        }
+
+      private:
+        DPool* const pool_;
+    };
+
+    Logger* logger() const {
+        return logger_.get();
+    }
+
+    // Close an idle connection of any shard, starting from another shard
+    // every time, so that reclaims spread over the servers.
+    bool reclaimIdle() {
+        size_t first = reclaimCursor_.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < poolShards_.size(); i++) {
+            if (poolShards_[(first + i) % poolShards_.size()].closeIdle()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static int64_t toNanos(typename Clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    }
+
+    // Milliseconds left before @deadline, at least 1.
+    static int remainingMs(typename Clock::time_point deadline) {
+        int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+        return ms < 1 ? 1 : (ms > INT32_MAX ? INT32_MAX : static_cast<int>(ms));
+    }
+
+    void traceGet(TraceRecorder* tracer, typename Clock::time_point start, uint16_t shard, T* pc) {
+        int64_t now = toNanos(Clock::now());
+        int64_t waitNs = now - toNanos(start);
+        tracer->record(now, TraceRecord::kGet, shard, waitNs / 1000,
+                       pc == nullptr ? TraceRecord::kFailed : 0, pc);
+    }
+
+    // Whether the shard of any bulkhead on server @idx is suspectable.
+    bool isSuspectable(size_t idx) {
+        for (size_t i = idx; i < poolShards_.size(); i += servers_.size()) {
+            if (poolShards_[i].isSuspectable()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Mark the shards of every bulkhead on the server of @shard, a shard of
+    // the first bulkhead.
+    bool markShards(Shard* shard, bool b) {
+        for (size_t i = shard->getIndex() + servers_.size(); i < poolShards_.size(); i += servers_.size()) {
+            poolShards_[i].markAvailable(b);
+        }
+        return shard->markAvailable(b);
+    }
+
+    void markAvailable(Shard* shard, bool b) {
         if (b) {
-            if (shard->markAvailable(true)) {
+            // Healthy again: the failures of the shards are forgotten.
+            shardSet_.setSuspect(shard->getIndex(), false);
+            if (markShards(shard, true)) {
+                shardSet_.setAvailable(shard->getIndex(), true);
                 numAvailable_++;
-                std::cerr << "dpool: server recovered - " << shard->getServerAddr().to_string() << std::endl;
+                DPOOL_FLIGHT_EVENT(kFlightMarkAvailable, shard->getIndex(), numAvailable_);
+                DPOOL_PROBE3(pool__shard__state, shard->getIndex(), 1, numAvailable_);
+                listener_.onShardStateChange(shard->getIndex(), shard->getServerAddr(), true, numAvailable_);
+                DPOOL_LOG(logger(), kLogServerRecovered, "server recovered - %s:%u",
+                          shard->getServerAddr().host.c_str(), shard->getServerAddr().port);
             }
         } else {
             // Ensure that at most 1/3 servers can be marked as unavaialable
             if (numAvailable_*3 > servers_.size()*2) {
-                if (shard->markAvailable(false)) {
+                if (markShards(shard, false)) {
+                    shardSet_.setAvailable(shard->getIndex(), false);
                     numAvailable_--;
-                    std::cerr << "dpool: mark server unvailable: " << shard->getServerAddr().to_string() << std::endl;
+                    DPOOL_FLIGHT_EVENT(kFlightMarkUnavailable, shard->getIndex(), numAvailable_);
+                    DPOOL_PROBE3(pool__shard__state, shard->getIndex(), 0, numAvailable_);
+                    listener_.onShardStateChange(shard->getIndex(), shard->getServerAddr(), false, numAvailable_);
+                    DPOOL_LOG(logger(), kLogServerUnavailable, "mark server unvailable: %s:%u",
+                              shard->getServerAddr().host.c_str(), shard->getServerAddr().port);
                 }
             } else {
-                std::cerr << "dpool: server cannot be marked as unavailable due to too many failed shards, "
-                << "numAvailable: " << numAvailable_ << ", totalShards: " << servers_.size() << std::endl;
+                DPOOL_LOG(logger(), kLogTooManyUnavailable, "server cannot be marked as unavailable due to "
+                          "too many failed shards, numAvailable: %d, totalShards: %zu",
+                          numAvailable_, servers_.size());
                 //shard.server, dp.numAvailable, totalServers)
             }
         }
@@ -122,10 +675,10 @@ class DPool {
         for (int tries=0; tries < 2; tries++) {
             int connectTimeout = 100, readWriteTimeout = 100;
             std::shared_ptr<T> c = std::make_shared<T>(addr, connectTimeout, readWriteTimeout);
-            try {
-                c->open();
-            } catch (DPoolException& ex) {
-                std::cerr << "Connect server failed: " << addr.to_string() << std::endl;
+            const DPoolException* error = c->tryOpen();
+            if (error != nullptr) {
+                DPOOL_LOG(logger(), kLogCheckFailed, "connect server failed: %s:%u - %s",
+                          addr.host.c_str(), addr.port, error->what());
                 continue;
             }
             return true;
@@ -136,42 +689,101 @@ class DPool {
     // Health checker thread routine 
     void healthCheck() {
         while (!closed_.load(std::memory_order_relaxed)) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
-
-            for (auto it = poolShards_.begin(); it != poolShards_.end(); it++) {
-                auto shard = *it;
-                if (!shard->isSuspectable() && shard->isAvailable()) {
-                    continue;
+            {
+                // Wait for the check interval, or until shutdown() wakes us up.
+                std::unique_lock<std::mutex> lck(healthCheckMtx_);
+                auto abs_time = Clock::now() + std::chrono::milliseconds(kHealthCheckIntervalMs_);
+                while (!closed_.load(std::memory_order_relaxed)
+                        && Clock::waitUntil(healthCheckCv_, lck, abs_time) != std::cv_status::timeout) {
                 }
+            }
+            if (closed_.load(std::memory_order_relaxed)) {
+                break;
+            }
 
-                bool ok = checkServer(shard->getServerAddr());
-                markAvailable(shard, ok);
+            runHealthCheck();
+
+            ShmStatsPublisher* publisher = publisher_.load(std::memory_order_relaxed);
+            if (publisher != nullptr) {
+                std::vector<ShardSnapshot> snapshots;
+                getSnapshots(snapshots);
+                publisher->publish(snapshots);
             }
         }
-        std::cout << "stop health check thread, closed: " << closed_.load() << std::endl;
+        DPOOL_LOG(logger(), kLogHealthCheckStopped, "stop health check thread, closed: %d",
+                  (int)closed_.load());
     }
 
   private:
+    // Read mostly: set at construction or by the rare setters.
+
     // Server address list, e.t. {"127.0.0.1:8080", "127.0.0.1:8081"}
     std::vector<InetSocketAddress> servers_;
 
-    // Sharded pool by server address
-    std::vector<PoolShard<T>* > poolShards_;
+    // Bulkhead names, "" for a pool without bulkheads
+    std::vector<std::string> bulkheads_;
+
+    // Sharded pool by bulkhead and server address, contiguous
+    AlignedArray<Shard> poolShards_;
+
+    // Availability, suspect flags and load of the shards, densely packed
+    ShardSet shardSet_;
+
+    // Concurrency limit of every shard, contiguous
+    AlignedArray<Limiter> limiters_;
+
+    // Borrows of every shard out of the local zone, see preferLocal()
+    AlignedArray<std::atomic<uint64_t>> spillovers_;
 
     // Pool configuration, e.t. maxIdle, maxActive, ...
     const PoolConfig poolConfig_;
 
-    // @atomic index to pick the next shard
-    std::atomic<unsigned> index_;
-
-    // Current available servers
-    int numAvailable_;
+    // Whether get() prefers the servers of poolConfig_.localZone, and which
+    const bool zoned_;
+    std::vector<size_t> localServers_;
 
     int maxRetry_;
 
+    // Optional recorder of every get/put
+    std::atomic<TraceRecorder*> tracer_;
+
+    LoggerPolicy logger_;
+
+    // Optional shared memory exporter of the statistics
+    std::atomic<ShmStatsPublisher*> publisher_;
+
+    // Optional connection budget shared with other pools
+    ConnectionBudget* const budget_;
+    BudgetMember budgetMember_;
+    std::atomic<size_t> reclaimCursor_;
+
+    // Optional coordinator shared with other processes
+    ShmCoordinator* const coordinator_;
+
+    // Dial gate of every server
+    AlignedArray<ServerGate> gates_;
+
+    // Hot: picks the shards to try, updated by every get()
+    DPOOL_CACHE_ALIGNED BalancerPolicy balancer_;
+
+    // Written by whichever thread an event happens on
+    DPOOL_CACHE_ALIGNED ListenerPolicy listener_;
+
+    // Health checker state.
+
+    // Current available servers
+    DPOOL_CACHE_ALIGNED int numAvailable_;
+
     // Health check thread
     std::thread healthCheckThread_;
 
+    // Interval between two rounds of health check
+    const int kHealthCheckIntervalMs_ = 1000;
+
+    // Wake the health checker up on shutdown
+    std::mutex healthCheckMtx_;
+    std::condition_variable healthCheckCv_;
+
     std::atomic<bool> closed_;
 };
 
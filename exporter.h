@@ -0,0 +1,356 @@
+#ifndef DPOOL_EXPORTER_H_
+#define DPOOL_EXPORTER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dpool-exception.h"
+#include "stats.h"
+
+namespace dpool {
+
+namespace detail {
+
+// @value as a label value of the text exposition format: with \, " and line
+// feeds escaped.
+inline std::string escapeLabel(const std::string& value) {
+    std::string escaped;
+    escaped.reserve(value.size());
+    for (auto it = value.begin(); it != value.end(); it++) {
+        if (*it == '\\' || *it == '"') {
+            escaped += '\\';
+            escaped += *it;
+        } else if (*it == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += *it;
+        }
+    }
+    return escaped;
+}
+
+inline void renderHelp(std::ostream& out, const char* name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+inline void renderHistogram(std::ostream& out, const char* name, const std::string& labels,
+                            const HistogramSnapshot& h) {
+    char le[32];
+    uint64_t cumulative = 0;
+    for (int i = 0; i < HistogramSnapshot::kNumBuckets - 1; i++) {
+        cumulative += h.counts[i];
+        snprintf(le, sizeof(le), "%g", HistogramSnapshot::upperBoundUs(i) / 1e6);
+        out << name << "_bucket{" << labels << ",le=\"" << le << "\"} " << cumulative << "\n";
+    }
+    cumulative += h.counts[HistogramSnapshot::kNumBuckets - 1];
+    out << name << "_bucket{" << labels << ",le=\"+Inf\"} " << cumulative << "\n";
+    out << name << "_sum{" << labels << "} " << (h.sumUs / 1e6) << "\n";
+    out << name << "_count{" << labels << "} " << cumulative << "\n";
+}
+
+} // namespace detail
+
+// Render shard statistics, as returned by DPool::getSnapshots(), in the
+// Prometheus text exposition format. Every series is labelled with @pool and
+// the server address of the shard, and the bulkhead, the zone and the node of
+// the shard if any.
+inline void renderPrometheus(const std::vector<ShardSnapshot>& shards, std::ostream& out,
+                             const std::string& pool = "default") {
+    std::vector<std::string> labels;
+    for (auto it = shards.begin(); it != shards.end(); it++) {
+        std::string label = "pool=\"" + detail::escapeLabel(pool) + "\",server=\""
+                          + detail::escapeLabel(it->server) + "\"";
+        if (!it->bulkhead.empty()) {
+            label += ",bulkhead=\"" + detail::escapeLabel(it->bulkhead) + "\"";
+        }
+        if (!it->zone.empty()) {
+            label += ",zone=\"" + detail::escapeLabel(it->zone) + "\"";
+        }
+        if (it->node >= 0) {
+            label += ",node=\"" + std::to_string(it->node) + "\"";
+        }
+        labels.push_back(label);
+    }
+
+#define DPOOL_RENDER_METRIC(name, type, help, field) \
+    detail::renderHelp(out, name, type, help); \
+    for (size_t i = 0; i < shards.size(); i++) { \
+        out << name << "{" << labels[i] << "} " << shards[i].field << "\n"; \
+    }
+
+    DPOOL_RENDER_METRIC("dpool_get_total", "counter", "Borrow attempts.", numGet)
+    DPOOL_RENDER_METRIC("dpool_put_total", "counter", "Connections returned.", numPut)
+    DPOOL_RENDER_METRIC("dpool_broken_total", "counter", "Connections returned as broken.", numBroken)
+    DPOOL_RENDER_METRIC("dpool_dial_total", "counter", "Connections dialed.", numDial)
+    DPOOL_RENDER_METRIC("dpool_dial_fail_total", "counter", "Failed dials.", numDialFail)
+    DPOOL_RENDER_METRIC("dpool_evict_total", "counter", "Idle connections evicted.", numEvict)
+    DPOOL_RENDER_METRIC("dpool_close_total", "counter", "Connections closed.", numClose)
+    DPOOL_RENDER_METRIC("dpool_wait_timeout_total", "counter", "Borrows timed out waiting.", numWaitTimeout)
+    DPOOL_RENDER_METRIC("dpool_remote_borrow_total", "counter", "Borrows served by another NUMA node.",
+                        numRemoteBorrow)
+    DPOOL_RENDER_METRIC("dpool_spillover_total", "counter", "Borrows served out of the local zone.",
+                        numSpillover)
+    DPOOL_RENDER_METRIC("dpool_active", "gauge", "Open connections, borrowed or idle.", numActive)
+    DPOOL_RENDER_METRIC("dpool_idle", "gauge", "Idle connections.", numIdle)
+    DPOOL_RENDER_METRIC("dpool_waiters", "gauge", "Threads waiting for a connection.", numWaiters)
+    DPOOL_RENDER_METRIC("dpool_limit_active", "gauge", "Effective maximum of open connections.", limitActive)
+    DPOOL_RENDER_METRIC("dpool_limit_idle", "gauge", "Effective maximum of idle connections.", limitIdle)
+    DPOOL_RENDER_METRIC("dpool_concurrency_limit", "gauge", "Borrows admitted at a time, 0 for no limit.",
+                        concurrencyLimit)
+    DPOOL_RENDER_METRIC("dpool_available", "gauge", "1 if the server is considered healthy.", available)
+
+#undef DPOOL_RENDER_METRIC
+
+    detail::renderHelp(out, "dpool_borrow_wait_seconds", "histogram", "Time spent borrowing a connection.");
+    for (size_t i = 0; i < shards.size(); i++) {
+        detail::renderHistogram(out, "dpool_borrow_wait_seconds", labels[i], shards[i].borrowWait);
+    }
+    detail::renderHelp(out, "dpool_hold_seconds", "histogram", "Time a connection stays borrowed.");
+    for (size_t i = 0; i < shards.size(); i++) {
+        detail::renderHistogram(out, "dpool_hold_seconds", labels[i], shards[i].hold);
+    }
+}
+
+// Plain data copy of a ShardSnapshot, as laid out in shared memory.
+struct ShmShardStats {
+    char server[64];
+    char bulkhead[32];
+    char zone[32];
+    uint32_t index;
+    uint32_t available;
+    int32_t numActive;
+    int32_t numIdle;
+    int32_t numWaiters;
+    int32_t reserved;
+    uint64_t numGet;
+    uint64_t numPut;
+    uint64_t numBroken;
+    uint64_t numDial;
+    uint64_t numDialFail;
+    uint64_t numEvict;
+    uint64_t numClose;
+    uint64_t numWaitTimeout;
+    uint64_t numSpillover;
+    HistogramSnapshot borrowWait;
+    HistogramSnapshot hold;
+};
+
+// Header of the shared memory segment, followed by @maxShards ShmShardStats.
+// The data is protected by a seqlock: @seq is odd while the publisher writes.
+struct ShmStatsHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t maxShards;
+    std::atomic<uint64_t> seq;
+    uint32_t numShards;
+    uint32_t reserved;
+    // Wall clock time of the last publication, in milliseconds since epoch
+    uint64_t publishTimeMs;
+};
+
+static const char kShmStatsMagic[8] = {'D', 'P', 'S', 'T', 'A', 'T', 'S', '1'};
+// Bumped whenever ShmShardStats changes, readers skip the other versions.
+static const uint32_t kShmStatsVersion = 3;
+
+// ShmStatsPublisher copies the pool statistics into a POSIX shared memory
+// segment, so that a sidecar can scrape them with ShmStatsReader without
+// calling into the process. Attach it with DPool::setStatsPublisher(), the
+// health checker then publishes once per round.
+class ShmStatsPublisher {
+  public:
+    ShmStatsPublisher(const std::string& name, uint32_t maxShards)
+        : name_(name), header_(nullptr), shards_(nullptr), maxShards_(maxShards) {
+        size_ = sizeof(ShmStatsHeader) + maxShards * sizeof(ShmShardStats);
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            DPOOL_THROW("failed to create shared memory " + name);
+        }
+        void* addr = ::ftruncate(fd, size_) == 0
+                ? ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            ::shm_unlink(name.c_str());
+            DPOOL_THROW("failed to map shared memory " + name);
+        }
+
+        header_ = static_cast<ShmStatsHeader*>(addr);
+        header_->version = kShmStatsVersion;
+        header_->maxShards = maxShards;
+        header_->seq.store(0, std::memory_order_relaxed);
+        header_->numShards = 0;
+        header_->publishTimeMs = 0;
+        shards_ = reinterpret_cast<ShmShardStats*>(header_ + 1);
+        // The magic goes last, readers ignore the segment until then.
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header_->magic, kShmStatsMagic, sizeof(kShmStatsMagic));
+    }
+
+    ShmStatsPublisher(const ShmStatsPublisher&) = delete;
+    ShmStatsPublisher& operator=(const ShmStatsPublisher&) = delete;    // noncopyable
+
+    ~ShmStatsPublisher() {
+        ::munmap(header_, size_);
+        ::shm_unlink(name_.c_str());
+    }
+
+    // Only one thread may publish at a time.
+    void publish(const std::vector<ShardSnapshot>& snapshots) {
+        uint64_t seq = header_->seq.load(std::memory_order_relaxed);
+        header_->seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        uint32_t n = snapshots.size() < maxShards_ ? snapshots.size() : maxShards_;
+        for (uint32_t i = 0; i < n; i++) {
+            toShm(snapshots[i], shards_[i]);
+        }
+        header_->numShards = n;
+        header_->publishTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+
+        header_->seq.store(seq + 2, std::memory_order_release);
+    }
+
+  private:
+    static void toShm(const ShardSnapshot& s, ShmShardStats& d) {
+        memset(d.server, 0, sizeof(d.server));
+        strncpy(d.server, s.server.c_str(), sizeof(d.server) - 1);
+        memset(d.bulkhead, 0, sizeof(d.bulkhead));
+        strncpy(d.bulkhead, s.bulkhead.c_str(), sizeof(d.bulkhead) - 1);
+        memset(d.zone, 0, sizeof(d.zone));
+        strncpy(d.zone, s.zone.c_str(), sizeof(d.zone) - 1);
+        d.index = s.index;
+        d.available = s.available;
+        d.numActive = s.numActive;
+        d.numIdle = s.numIdle;
+        d.numWaiters = s.numWaiters;
+        d.reserved = 0;
+        d.numGet = s.numGet;
+        d.numPut = s.numPut;
+        d.numBroken = s.numBroken;
+        d.numDial = s.numDial;
+        d.numDialFail = s.numDialFail;
+        d.numEvict = s.numEvict;
+        d.numClose = s.numClose;
+        d.numWaitTimeout = s.numWaitTimeout;
+        d.numSpillover = s.numSpillover;
+        d.borrowWait = s.borrowWait;
+        d.hold = s.hold;
+    }
+
+    const std::string name_;
+    size_t size_;
+    ShmStatsHeader* header_;
+    ShmShardStats* shards_;
+    const uint32_t maxShards_;
+};
+
+// Reads the statistics published by a ShmStatsPublisher, possibly of another
+// process.
+class ShmStatsReader {
+  public:
+    explicit ShmStatsReader(const std::string& name) : header_(nullptr), size_(0) {
+        int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+        struct stat st;
+        if (fd < 0 || ::fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ShmStatsHeader)) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            DPOOL_THROW("failed to open shared memory " + name);
+        }
+        size_ = st.st_size;
+        void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            DPOOL_THROW("failed to map shared memory " + name);
+        }
+        header_ = static_cast<const ShmStatsHeader*>(addr);
+    }
+
+    ShmStatsReader(const ShmStatsReader&) = delete;
+    ShmStatsReader& operator=(const ShmStatsReader&) = delete;    // noncopyable
+
+    ~ShmStatsReader() {
+        ::munmap(const_cast<ShmStatsHeader*>(header_), size_);
+    }
+
+    // @return - false if no consistent copy could be taken in @maxTries
+    bool read(std::vector<ShardSnapshot>& snapshots, uint64_t* publishTimeMs = nullptr, int maxTries = 100) {
+        if (memcmp(header_->magic, kShmStatsMagic, sizeof(kShmStatsMagic)) != 0
+                || header_->version != kShmStatsVersion) {
+            return false;
+        }
+        const ShmShardStats* shards = reinterpret_cast<const ShmShardStats*>(header_ + 1);
+        uint32_t maxShards = (size_ - sizeof(ShmStatsHeader)) / sizeof(ShmShardStats);
+        std::vector<ShmShardStats> copy;
+
+        for (int tries = 0; tries < maxTries; tries++) {
+            uint64_t seq = header_->seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            uint32_t n = header_->numShards;
+            if (n > maxShards) {
+                continue;
+            }
+            copy.assign(shards, shards + n);
+            uint64_t publishTime = header_->publishTimeMs;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (header_->seq.load(std::memory_order_relaxed) != seq) {
+                continue;
+            }
+
+            snapshots.resize(n);
+            for (uint32_t i = 0; i < n; i++) {
+                fromShm(copy[i], snapshots[i]);
+            }
+            if (publishTimeMs != nullptr) {
+                *publishTimeMs = publishTime;
+            }
+            return true;
+        }
+        return false;
+    }
+
+  private:
+    static void fromShm(const ShmShardStats& s, ShardSnapshot& d) {
+        d.server.assign(s.server, strnlen(s.server, sizeof(s.server)));
+        d.bulkhead.assign(s.bulkhead, strnlen(s.bulkhead, sizeof(s.bulkhead)));
+        d.zone.assign(s.zone, strnlen(s.zone, sizeof(s.zone)));
+        d.index = s.index;
+        d.available = s.available != 0;
+        d.numActive = s.numActive;
+        d.numIdle = s.numIdle;
+        d.numWaiters = s.numWaiters;
+        d.numGet = s.numGet;
+        d.numPut = s.numPut;
+        d.numBroken = s.numBroken;
+        d.numDial = s.numDial;
+        d.numDialFail = s.numDialFail;
+        d.numEvict = s.numEvict;
+        d.numClose = s.numClose;
+        d.numWaitTimeout = s.numWaitTimeout;
+        d.numSpillover = s.numSpillover;
+        d.borrowWait = s.borrowWait;
+        d.hold = s.hold;
+    }
+
+    const ShmStatsHeader* header_;
+    size_t size_;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_EXPORTER_H_
@@ -0,0 +1,221 @@
+#ifndef DPOOL_FLIGHT_RECORDER_H_
+#define DPOOL_FLIGHT_RECORDER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+#include <signal.h>
+#include <unistd.h>
+
+namespace dpool {
+
+// The flight recorder keeps the most recent pool events of every thread in a
+// fixed size ring buffer, for post-mortem inspection of a misbehaving pool.
+// Recording an event is a handful of plain stores into memory owned by the
+// calling thread plus one release store, so it stays enabled on the get()/put()
+// path. Define DPOOL_NO_FLIGHT_RECORDER to compile it out entirely.
+
+enum FlightEventType : uint8_t {
+    kFlightDialStart = 1,
+    kFlightDialFail,
+    kFlightEvict,
+    kFlightMarkUnavailable,
+    kFlightMarkAvailable,
+    kFlightWaitTimeout,
+    kFlightBrokenPut,
+};
+
+inline const char* flightEventName(uint8_t type) {
+    switch (type) {
+      case kFlightDialStart:       return "dial-start";
+      case kFlightDialFail:        return "dial-fail";
+      case kFlightEvict:           return "evict";
+      case kFlightMarkUnavailable: return "mark-unavailable";
+      case kFlightMarkAvailable:   return "mark-available";
+      case kFlightWaitTimeout:     return "wait-timeout";
+      case kFlightBrokenPut:       return "broken-put";
+      default:                     return "unknown";
+    }
+}
+
+struct FlightEvent {
+    // Monotonic time, in nanoseconds
+    uint64_t timestampNs;
+    // Event specific argument, e.g. active connections of the shard
+    uint32_t arg;
+    // Index of the shard in the server list of its pool
+    uint16_t shard;
+    uint8_t type;
+    uint8_t reserved;
+};
+
+class FlightRecorder {
+  public:
+    // Events kept per thread, must be a power of 2
+    static const uint32_t kRingSize = 256;
+
+    // Threads that can record at the same time; events of more are dropped.
+    static const uint32_t kMaxThreads = 256;
+
+    static void record(FlightEventType type, uint16_t shard, uint32_t arg) {
+        Ring* ring = threadRing();
+        if (ring == nullptr) {
+            return;
+        }
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        FlightEvent& ev = ring->events[head & (kRingSize - 1)];
+        ev.timestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        ev.arg = arg;
+        ev.shard = shard;
+        ev.type = type;
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+
+    // Write the recorded events of every thread into @fd, oldest first per
+    // thread. Only uses async-signal-safe calls, so it can run from a signal
+    // handler; events being written concurrently are skipped.
+    static void dump(int fd) {
+        char line[128];
+        writeAll(fd, "dpool flight recorder:\n");
+        for (uint32_t i = 0; i < kMaxThreads; i++) {
+            Ring* ring = rings()[i].load(std::memory_order_acquire);
+            if (ring == nullptr) {
+                continue;
+            }
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t first = head > kRingSize ? head - kRingSize : 0;
+            for (uint64_t seq = first; seq < head; seq++) {
+                FlightEvent ev = ring->events[seq & (kRingSize - 1)];
+                // Drop the slot if the owner thread wrapped around onto it meanwhile.
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (ring->head.load(std::memory_order_relaxed) - seq >= kRingSize) {
+                    continue;
+                }
+                char* p = line;
+                p = append(p, "  ring ");
+                p = appendNum(p, i);
+                p = append(p, " t=");
+                p = appendNum(p, ev.timestampNs);
+                p = append(p, " shard=");
+                p = appendNum(p, ev.shard);
+                p = append(p, " ");
+                p = append(p, flightEventName(ev.type));
+                p = append(p, " arg=");
+                p = appendNum(p, ev.arg);
+                p = append(p, "\n");
+                writeAll(fd, line, p - line);
+            }
+        }
+    }
+
+    // Dump the flight recorder to stderr whenever @signo is received.
+    static bool installSignalHandler(int signo = SIGUSR2) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = [](int) { FlightRecorder::dump(STDERR_FILENO); };
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        return sigaction(signo, &sa, nullptr) == 0;
+    }
+
+  private:
+    struct Ring {
+        Ring() : head(0), owned(true) {}
+
+        std::atomic<uint64_t> head;
+        std::atomic<bool> owned;
+        FlightEvent events[kRingSize];
+    };
+
+    // Releases the ring of a thread on exit, so that another thread reuses it.
+    struct RingOwner {
+        RingOwner() : ring(acquire()) {}
+
+        ~RingOwner() {
+            if (ring != nullptr) {
+                ring->owned.store(false, std::memory_order_release);
+            }
+        }
+
+        Ring* ring;
+    };
+
+    static std::atomic<Ring*>* rings() {
+        static std::atomic<Ring*> rings[kMaxThreads];
+        return rings;
+    }
+
+    static Ring* threadRing() {
+        static thread_local RingOwner owner;
+        return owner.ring;
+    }
+
+    // Reuse the ring of an exited thread, or register a new one. Rings are
+    // never freed, so that dump() can always read them.
+    static Ring* acquire() {
+        for (uint32_t i = 0; i < kMaxThreads; i++) {
+            Ring* ring = rings()[i].load(std::memory_order_acquire);
+            bool expected = false;
+            if (ring != nullptr && ring->owned.compare_exchange_strong(expected, true)) {
+                return ring;
+            }
+        }
+        Ring* ring = new Ring();
+        for (uint32_t i = 0; i < kMaxThreads; i++) {
+            Ring* expected = nullptr;
+            if (rings()[i].compare_exchange_strong(expected, ring)) {
+                return ring;
+            }
+        }
+        delete ring;
+        return nullptr;
+    }
+
+    static void writeAll(int fd, const char* s, size_t len) {
+        while (len > 0) {
+            ssize_t n = ::write(fd, s, len);
+            if (n <= 0) {
+                return;
+            }
+            s += n;
+            len -= n;
+        }
+    }
+
+    static void writeAll(int fd, const char* s) {
+        writeAll(fd, s, strlen(s));
+    }
+
+    static char* append(char* p, const char* s) {
+        while (*s != '\0') {
+            *p++ = *s++;
+        }
+        return p;
+    }
+
+    static char* appendNum(char* p, uint64_t v) {
+        char digits[20];
+        int n = 0;
+        do {
+            digits[n++] = '0' + (v % 10);
+            v /= 10;
+        } while (v != 0);
+        while (n > 0) {
+            *p++ = digits[--n];
+        }
+        return p;
+    }
+};
+
+} // namespace dpool
+
+#ifdef DPOOL_NO_FLIGHT_RECORDER
+#define DPOOL_FLIGHT_EVENT(type, shard, arg) do {} while (0)
+#else
+#define DPOOL_FLIGHT_EVENT(type, shard, arg) ::dpool::FlightRecorder::record((type), (shard), (arg))
+#endif
+
+#endif // DPOOL_FLIGHT_RECORDER_H_
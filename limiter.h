@@ -0,0 +1,165 @@
+#ifndef DPOOL_LIMITER_H_
+#define DPOOL_LIMITER_H_
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#include "cache-line.h"
+
+namespace dpool {
+
+// Limiter policies admit the borrows of DPool::get(): every shard has a limit
+// of connections borrowed at a time, adapted to the borrow-to-return latency
+// put() observes. A shard at its limit is passed over for the next one, and
+// get() fails fast when every shard tried is at its limit, so that a slow
+// server sheds load instead of piling up connections. A policy provides
+// Shard, the per shard state:
+//
+//   bool tryAcquire()                         - admit one borrow
+//   void release(int64_t rttUs, bool dropped) - end it, after @rttUs, -1 if
+//                                               the borrow did not happen
+//   int32_t limit() const                     - zero for no limit
+//
+// With the default NoLimiter every borrow is admitted and the calls compile
+// away.
+struct NoLimiter {
+    static const bool kEnabled = false;
+
+    class Shard {
+      public:
+        bool tryAcquire() {
+            return true;
+        }
+
+        void release(int64_t, bool) {}
+
+        int32_t limit() const {
+            return 0;
+        }
+    };
+};
+
+namespace detail {
+
+// In flight count and limit of a shard, shared by the limiters.
+class DPOOL_CACHE_ALIGNED LimiterShard {
+  public:
+    explicit LimiterShard(int32_t limit) : limit_(limit), inflight_(0) {}
+
+    bool tryAcquire() {
+        if (inflight_.fetch_add(1, std::memory_order_relaxed) >= limit_.load(std::memory_order_relaxed)) {
+            inflight_.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    int32_t limit() const {
+        return limit_.load(std::memory_order_relaxed);
+    }
+
+  protected:
+    // @return - the number of borrows in flight before this one ended.
+    int32_t leave() {
+        return inflight_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    std::atomic<int32_t> limit_;
+    std::atomic<int32_t> inflight_;
+};
+
+} // namespace detail
+
+// Additive increase, multiplicative decrease: the limit grows by one on every
+// return while at least half of it is in use, and loses a tenth on a return
+// broken or slower than @TimeoutMs.
+template <int TimeoutMs = 100, int InitialLimit = 20, int MaxLimit = 200>
+struct AimdLimiter {
+    static const bool kEnabled = true;
+
+    class Shard : public detail::LimiterShard {
+      public:
+        Shard() : LimiterShard(InitialLimit) {}
+
+        void release(int64_t rttUs, bool dropped) {
+            int32_t inflight = leave();
+            if (rttUs < 0) {
+                return;
+            }
+            int32_t limit = limit_.load(std::memory_order_relaxed);
+            int32_t next = limit;
+            if (dropped || rttUs > TimeoutMs * 1000LL) {
+                next = limit * 9 / 10;
+            } else if (inflight * 2 >= limit) {
+                next = limit + 1;
+            }
+            next = next < 1 ? 1 : (next > MaxLimit ? MaxLimit : next);
+            if (next != limit) {
+                // A concurrent update wins, this sample is dropped.
+                limit_.compare_exchange_strong(limit, next, std::memory_order_relaxed);
+            }
+        }
+    };
+};
+
+// Latency gradient, after Netflix's Gradient2Limit: the limit follows the
+// ratio of the long term average latency to the latest one, so it shrinks as
+// soon as a server gets slower than it used to be, whatever its usual
+// latency. The long term average drifts toward the new latency, and the limit
+// keeps a queue of sqrt(limit) on top, so that a server that stays slow is
+// probed again. Samples that arrive while another return updates the limit
+// are dropped rather than waited for.
+template <int InitialLimit = 20, int MaxLimit = 200>
+struct GradientLimiter {
+    static const bool kEnabled = true;
+
+    class Shard : public detail::LimiterShard {
+      public:
+        Shard() : LimiterShard(InitialLimit), estimate_(InitialLimit), longRttUs_(0) {
+            updating_.clear();
+        }
+
+        void release(int64_t rttUs, bool dropped) {
+            int32_t inflight = leave();
+            if (rttUs < 0 || updating_.test_and_set(std::memory_order_acquire)) {
+                return;
+            }
+            update(rttUs > 0 ? rttUs : 1, inflight, dropped);
+            updating_.clear(std::memory_order_release);
+        }
+
+      private:
+        void update(double rttUs, int32_t inflight, bool dropped) {
+            const double kLongWindow = 600;
+            const double kTolerance = 1.5;
+            const double kSmoothing = 0.2;
+
+            longRttUs_ = longRttUs_ == 0 ? rttUs : longRttUs_ + (rttUs - longRttUs_) / kLongWindow;
+            if (longRttUs_ > rttUs * 2) {
+                // Recovering from a slow period, forget it faster.
+                longRttUs_ *= 0.95;
+            }
+            // Only a limit in use says something about the server.
+            if (!dropped && inflight * 2 < estimate_) {
+                return;
+            }
+
+            double gradient = dropped ? 0.5 : kTolerance * longRttUs_ / rttUs;
+            gradient = gradient < 0.5 ? 0.5 : (gradient > 1.0 ? 1.0 : gradient);
+            double next = estimate_ * gradient + std::sqrt(estimate_);
+            estimate_ = estimate_ * (1 - kSmoothing) + next * kSmoothing;
+            estimate_ = estimate_ < 1 ? 1 : (estimate_ > MaxLimit ? MaxLimit : estimate_);
+            limit_.store(static_cast<int32_t>(estimate_), std::memory_order_relaxed);
+        }
+
+        std::atomic_flag updating_;
+        // Guarded by updating_
+        double estimate_;
+        double longRttUs_;
+    };
+};
+
+} // namespace dpool
+
+#endif // DPOOL_LIMITER_H_
@@ -0,0 +1,60 @@
+#ifndef DPOOL_LISTENER_H_
+#define DPOOL_LISTENER_H_
+
+#include <cstdint>
+
+#include "dpool-exception.h"
+#include "pooled-object.h"
+
+namespace dpool {
+
+// Listener policies get notified of pool events, e.g. to feed custom metrics
+// or annotate the span of the current request. The pool owns one listener
+// instance, see DPool::listener(), and calls it synchronously from the thread
+// that caused the event, outside of any shard lock.
+//
+// A listener derives from NoListener, sets kEnabled and hides the hooks it
+// cares about:
+//
+//   struct SpanListener : public dpool::NoListener {
+//       static const bool kEnabled = true;
+//       void onBorrow(uint16_t shard, dpool::PooledObject* c, int64_t waitUs) {
+//           currentSpan().annotate("dpool.borrow_wait_us", waitUs);
+//       }
+//   };
+//
+// kEnabled tells the shards to time borrows and returns even without stats.
+// With the default NoListener every hook is an empty inline function and the
+// calls compile away.
+struct NoListener {
+    static const bool kEnabled = false;
+
+    // A shard opened a connection to its server.
+    void onDial(uint16_t, const InetSocketAddress&, PooledObject*) {}
+
+    // A shard failed to open a connection to its server.
+    void onDialFail(uint16_t, const InetSocketAddress&, const DPoolException&) {}
+
+    // A shard lent a connection out, after the given wait in get(), in us.
+    void onBorrow(uint16_t, PooledObject*, int64_t) {}
+
+    // A connection came back to its shard, broken or not, after being
+    // borrowed for the given time, in us.
+    void onReturn(uint16_t, PooledObject*, bool, int64_t) {}
+
+    // A connection was closed because its shard already had maxIdle idle
+    // connections.
+    void onEvict(uint16_t, PooledObject*) {}
+
+    // The health checker marked the server of a shard available or not,
+    // leaving the given number of servers available.
+    void onShardStateChange(uint16_t, const InetSocketAddress&, bool, int) {}
+
+    // get() gave up waiting for a connection of a shard at maxActive, with
+    // the given number of connections active.
+    void onWaitTimeout(uint16_t, const InetSocketAddress&, int32_t) {}
+};
+
+} // namespace dpool
+
+#endif // DPOOL_LISTENER_H_
@@ -0,0 +1,466 @@
+#ifndef DPOOL_LOCKFREE_SHARD_H_
+#define DPOOL_LOCKFREE_SHARD_H_
+
+#include <atomic>
+#include <limits>
+#include <memory>
+
+#include "pooled-object.h"
+#include "policies.h"
+#include "flight-recorder.h"
+#include "probes.h"
+#include "cache-line.h"
+#include "adaptive-limits.h"
+#include "dial-gate.h"
+
+namespace dpool {
+
+// LockFreePoolShard keeps its idle connections in a fixed array of maxIdle
+// slots, each guarded by its own atomic state, and bounds the active count
+// with a CAS loop: get() and put() never take a lock nor wait. When the shard
+// has no idle connection and maxActive is reached, get() fails right away and
+// DPool moves on to the next shard. With adaptive limits, the slots past the
+// effective maxIdle stay unused. Reserves for priorities apply like in
+// PoolShard, but there are no waiters to order.
+template <typename T, typename Traits = DefaultShardTraits>
+class LockFreePoolShard {
+  public:
+    typedef typename Traits::Clock Clock;
+    typedef typename Traits::Stats Stats;
+    typedef typename Traits::Listener Listener;
+
+    // @listener, if any, must outlive the shard.
+    LockFreePoolShard(const InetSocketAddress server, const PoolConfig& config, uint16_t index = 0,
+                      Listener* listener = nullptr)
+        : server_(server), index_(index), listener_(listener), gate_(nullptr),
+          kMaxIdle_(config.maxIdle > 0 ? config.maxIdle : 0), kMaxFails_(config.maxFails),
+          connTimeoutMs_(config.connTimeoutMs), dataTimeoutMs_(config.dataTimeoutMs),
+          slots_(new Slot[kMaxIdle_]), available_(true), closed_(false), fails_(0),
+          active_(0), numIdle_(0), limits_(config) {
+        reserve_[kPriorityCritical] = 0;
+        reserve_[kPriorityNormal] = config.reserveCritical;
+        reserve_[kPriorityBulk] = config.reserveCritical + config.reserveNormal;
+    }
+
+    LockFreePoolShard(const LockFreePoolShard&) = delete;
+    LockFreePoolShard& operator=(const LockFreePoolShard&) = delete;    // noncopyable
+
+    virtual ~LockFreePoolShard() {
+        // Already closed by the shutdown of the pool, if any.
+        if (!closed_.load(std::memory_order_relaxed)) {
+            close();
+        }
+    }
+
+    void close() {
+        bool expected = false;
+        if (!(closed_.compare_exchange_strong(expected, true))) {
+            DPOOL_LOG(logger(), kLogAlreadyClosed, "shard already closed - %s:%u",
+                      server_.host.c_str(), server_.port);
+            return;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        empty();
+    }
+
+    // Borrow a connection, a dial timing out at @deadline at the latest.
+    // @status - if not nullptr, set to why nullptr was returned
+    std::shared_ptr<T> get(Priority priority = kPriorityNormal,
+                           typename Clock::time_point deadline = Clock::time_point::max(),
+                           GetStatus* status = nullptr) {
+        bool bounded = deadline != Clock::time_point::max();
+        typename Clock::time_point start;
+        if (Traits::kTimed || limits_.enabled() || bounded) {
+            start = Clock::now();
+        }
+
+        DPOOL_PROBE1(shard__get__start, index_);
+        stats_.onGet();
+        limits_.onArrival();
+
+        int32_t maxActive = limits_.maxActive();
+        int32_t cap = maxActive == 0 ? std::numeric_limits<int32_t>::max() : maxActive - reserve_[priority];
+        std::shared_ptr<T> c;
+        if (reserve_[priority] == 0
+                || active_.load(std::memory_order_relaxed) - numIdle_.load(std::memory_order_relaxed) < cap) {
+            c = takeIdle();
+        }
+        if (c != nullptr) {
+            c->setBorrowed(true);
+            onBorrow(c.get(), start);
+            DPOOL_PROBE2(shard__get__return, index_, 0);
+            return c;
+        }
+
+        if (closed_.load(std::memory_order_relaxed)) {
+            DPOOL_LOG(logger(), kLogGetOnClosed, "get on closed pool shard %s:%u",
+                      server_.host.c_str(), server_.port);
+            DPOOL_PROBE2(shard__get__return, index_, -1);
+            return refuse(status, kGetClosed);
+        }
+
+        int connTimeoutMs = connTimeoutMs_;
+        if (bounded) {
+            int64_t leftMs = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - start).count();
+            if (leftMs <= 0) {
+                DPOOL_PROBE2(shard__get__return, index_, -1);
+                return refuse(status, kGetTimedOut);
+            }
+            connTimeoutMs = leftMs < connTimeoutMs ? leftMs : connTimeoutMs;
+        }
+
+        int32_t active = active_.load(std::memory_order_relaxed);
+        do {
+            if (active >= cap) {
+                if (limits_.enabled()) {
+                    limits_.onRefusal(toNanos(Clock::now()));
+                }
+                DPOOL_LOG(logger(), kLogMaxActive, "failed to dial connection to server: %s:%u, active: %d",
+                          server_.host.c_str(), server_.port, active);
+                DPOOL_PROBE2(shard__get__return, index_, -1);
+                return refuse(status, kGetExhausted);
+            }
+        } while (!active_.compare_exchange_weak(active, active + 1, std::memory_order_relaxed));
+        if (gate_ != nullptr && !gate_->acquire()) {
+            active_.fetch_sub(1, std::memory_order_relaxed);
+            DPOOL_LOG(logger(), kLogMaxActive, "dial refused by shared limits, server: %s:%u",
+                      server_.host.c_str(), server_.port);
+            DPOOL_PROBE2(shard__get__return, index_, -1);
+            return refuse(status, kGetExhausted);
+        }
+
+        stats_.onDial();
+        DPOOL_FLIGHT_EVENT(kFlightDialStart, index_, active + 1);
+        DPOOL_PROBE2(shard__dial__start, index_, active + 1);
+
+        c = std::make_shared<T>(server_, connTimeoutMs, dataTimeoutMs_);
+        const DPoolException* error = c->tryOpen();
+        if (error != nullptr) {
+            unsigned fails = fails_.fetch_add(1, std::memory_order_relaxed) + 1;
+            active_.fetch_sub(1, std::memory_order_relaxed);
+            releaseGate();
+            stats_.onDialFail();
+            DPOOL_FLIGHT_EVENT(kFlightDialFail, index_, fails);
+            DPOOL_LOG(logger(), kLogDialFailed, "failed to create connection on pool shard %s:%u - %s",
+                      server_.host.c_str(), server_.port, error->what());
+            if (listener_ != nullptr) {
+                listener_->onDialFail(index_, server_, *error);
+            }
+            DPOOL_PROBE2(shard__dial__done, index_, 0);
+            DPOOL_PROBE2(shard__get__return, index_, -1);
+            return refuse(status, kGetDialFailed);
+        }
+        resetFails();
+        c->setDataSource(this);
+        c->setBorrowed(true);
+        if (listener_ != nullptr) {
+            listener_->onDial(index_, server_, c.get());
+        }
+        onBorrow(c.get(), start);
+        DPOOL_PROBE2(shard__dial__done, index_, 1);
+        DPOOL_PROBE2(shard__get__return, index_, 1);
+        return c;
+    }
+
+    void put(std::shared_ptr<T> pc, bool broken) {
+        DPOOL_PROBE2(shard__put, index_, broken);
+        stats_.onPut();
+
+        // The borrower owns the object until it is handed back, so the flag
+        // needs no synchronization.
+        if (!pc->isBorrowed()) {
+            return;
+        }
+        pc->setBorrowed(false);
+        int64_t borrowTime = pc->getBorrowTime();
+
+        if (broken) {
+            unsigned fails = fails_.fetch_add(1, std::memory_order_relaxed) + 1;
+            stats_.onBroken();
+            DPOOL_FLIGHT_EVENT(kFlightBrokenPut, index_, fails);
+        } else {
+            resetFails();
+        }
+
+        if (!closed_.load(std::memory_order_relaxed) && !broken) {
+            if ((!limits_.enabled() || numIdle_.load(std::memory_order_relaxed) < limits_.maxIdle())
+                    && giveIdle(pc)) {
+                // A close() since the check above may have emptied the slots
+                // before pc got parked: empty them again. The fences pair
+                // with close() so that one of the two sees the other.
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (closed_.load(std::memory_order_relaxed)) {
+                    empty();
+                }
+                onReturn(pc.get(), broken, borrowTime);
+                return;
+            }
+            stats_.onEvict();
+            DPOOL_FLIGHT_EVENT(kFlightEvict, index_, active_.load(std::memory_order_relaxed));
+            DPOOL_PROBE2(shard__evict, index_, numIdle_.load(std::memory_order_relaxed));
+            if (listener_ != nullptr) {
+                listener_->onEvict(index_, pc.get());
+            }
+        }
+
+        active_.fetch_sub(1, std::memory_order_relaxed);
+        stats_.onClose();
+        releaseGate();
+        onReturn(pc.get(), broken, borrowTime);
+    }
+
+    bool isAvailable() {
+        return available_.load(std::memory_order_relaxed);
+    }
+
+    bool isSuspectable() {
+        return (fails_.load(std::memory_order_relaxed) >= kMaxFails_);
+    }
+
+    // A server marked available starts over with no failures.
+    // @return - true if the underlying atomic value was changed, false otherwise.
+    bool markAvailable(const bool avail) {
+        if (avail) {
+            resetFails();
+        }
+        bool expected = !avail;
+        return available_.compare_exchange_strong(expected, avail);
+    }
+
+    const InetSocketAddress& getServerAddr() const {
+        return server_;
+    }
+
+    // Send the messages of this shard to @logger, nullptr for silence.
+    void setLogger(Logger* logger) {
+        logger_.set(logger);
+    }
+
+    // See PoolShard.
+    void setDialGate(DialGate* gate) {
+        gate_ = gate;
+    }
+
+    bool closeIdle() {
+        std::shared_ptr<T> c = takeIdle();
+        if (c == nullptr) {
+            return false;
+        }
+        stats_.onEvict();
+        DPOOL_FLIGHT_EVENT(kFlightEvict, index_, active_.load(std::memory_order_relaxed));
+        if (listener_ != nullptr) {
+            listener_->onEvict(index_, c.get());
+        }
+        active_.fetch_sub(1, std::memory_order_relaxed);
+        stats_.onClose();
+        releaseGate();
+        return true;
+    }
+
+    // Position of the shard in the server list of its pool
+    uint16_t getIndex() const {
+        return index_;
+    }
+
+    // Statistics since the previous call, for the legacy monitor.
+    void getShardStats(PoolStats& st) {
+        ShardSnapshot now;
+        getSnapshot(now);
+
+        std::lock_guard<std::mutex> lck(reportedMtx_);
+        st.available = now.available;
+        st.numActive = now.numActive;
+        st.numGet = now.numGet - reported_.numGet;
+        st.numPut = now.numPut - reported_.numPut;
+        st.numDial = now.numDial - reported_.numDial;
+        st.numDialFail = now.numDialFail - reported_.numDialFail;
+        st.numBroken = now.numBroken - reported_.numBroken;
+        st.numEvict = now.numEvict - reported_.numEvict;
+        st.numClose = now.numClose - reported_.numClose;
+        reported_ = now;
+    }
+
+    // Cumulative statistics, read lock free like everything else.
+    void getSnapshot(ShardSnapshot& st) const {
+        st.server = server_.to_string();
+        st.index = index_;
+        st.available = available_.load(std::memory_order_relaxed);
+        st.numActive = active_.load(std::memory_order_relaxed);
+        st.limitActive = limits_.maxActive();
+        st.limitIdle = limits_.maxIdle();
+        stats_.snapshot(st);
+    }
+
+  private:
+    // An idle slot is empty or full; busy while a thread moves a connection
+    // in or out of it.
+    enum SlotState : uint8_t {
+        kSlotEmpty = 0,
+        kSlotBusy,
+        kSlotFull,
+    };
+
+    struct Slot {
+        Slot() : state(kSlotEmpty) {}
+
+        std::atomic<uint8_t> state;
+        std::shared_ptr<T> conn;
+    };
+
+    Logger* logger() const {
+        return logger_.get();
+    }
+
+    static int64_t toNanos(typename Clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    }
+
+    // Account a successful get() that started at @start.
+    void onBorrow(T* c, typename Clock::time_point start) {
+        if (Traits::kTimed || limits_.enabled()) {
+            auto now = Clock::now();
+            int64_t waitUs = std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+            stats_.observeBorrowWait(waitUs);
+            c->setBorrowTime(toNanos(now));
+            if (listener_ != nullptr) {
+                listener_->onBorrow(index_, c, waitUs);
+            }
+        }
+    }
+
+    // Account the return of @c, borrowed at @borrowTimeNs.
+    void onReturn(T* c, bool broken, int64_t borrowTimeNs) {
+        if ((Traits::kTimed || limits_.enabled()) && borrowTimeNs >= 0) {
+            int64_t now = toNanos(Clock::now());
+            int64_t holdUs = (now - borrowTimeNs) / 1000;
+            stats_.observeHold(holdUs);
+            if (listener_ != nullptr) {
+                listener_->onReturn(index_, c, broken, holdUs);
+            }
+            if (limits_.enabled()) {
+                limits_.onHold(holdUs, now);
+            }
+        }
+    }
+
+    // A failed get() for @why, see get().
+    static std::shared_ptr<T> refuse(GetStatus* status, GetStatus why) {
+        if (status != nullptr) {
+            *status = why;
+        }
+        return nullptr;
+    }
+
+    void releaseGate() {
+        if (gate_ != nullptr) {
+            gate_->release();
+        }
+    }
+
+    // Leave the line of fails_ alone unless there were failures.
+    void resetFails() {
+        if (fails_.load(std::memory_order_relaxed) != 0) {
+            fails_.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Take a connection out of the first full slot, nullptr if none. Slots are
+    // scanned from the front, so the same few connections stay warm.
+    std::shared_ptr<T> takeIdle() {
+        for (int i = 0; i < kMaxIdle_; i++) {
+            Slot& slot = slots_[i];
+            uint8_t expected = kSlotFull;
+            if (slot.state.load(std::memory_order_relaxed) != kSlotFull
+                    || !slot.state.compare_exchange_strong(expected, kSlotBusy, std::memory_order_acquire)) {
+                continue;
+            }
+            std::shared_ptr<T> c = std::move(slot.conn);
+            slot.state.store(kSlotEmpty, std::memory_order_release);
+            stats_.setIdle(numIdle_.fetch_sub(1, std::memory_order_relaxed) - 1);
+            return c;
+        }
+        return nullptr;
+    }
+
+    // Park @c into the first empty slot, false if all are full.
+    bool giveIdle(const std::shared_ptr<T>& c) {
+        for (int i = 0; i < kMaxIdle_; i++) {
+            Slot& slot = slots_[i];
+            uint8_t expected = kSlotEmpty;
+            if (slot.state.load(std::memory_order_relaxed) != kSlotEmpty
+                    || !slot.state.compare_exchange_strong(expected, kSlotBusy, std::memory_order_acquire)) {
+                continue;
+            }
+            slot.conn = c;
+            slot.state.store(kSlotFull, std::memory_order_release);
+            stats_.setIdle(numIdle_.fetch_add(1, std::memory_order_relaxed) + 1);
+            return true;
+        }
+        return false;
+    }
+
+    void empty() {
+        std::shared_ptr<T> c;
+        while ((c = takeIdle()) != nullptr) {
+            active_.fetch_sub(1, std::memory_order_relaxed);
+            stats_.onClose();
+            releaseGate();
+        }
+    }
+
+  private:
+    // Read mostly, laid out like PoolShard.
+
+    // Server address, e.g. "127.0.0.1:8080"
+    const InetSocketAddress server_;
+
+    const uint16_t index_;
+
+    // Owned by the pool, nullptr if none
+    Listener* const listener_;
+
+    // Limits shared with other pools, nullptr if none
+    DialGate* gate_;
+
+    // Number of idle slots
+    const int kMaxIdle_;
+
+    // Connections of maxActive off limits to every priority
+    int32_t reserve_[kNumPriorities];
+
+    const uint32_t kMaxFails_;
+
+    const int connTimeoutMs_;
+
+    const int dataTimeoutMs_;
+
+    std::unique_ptr<Slot[]> slots_;
+
+    typename Traits::Logger logger_;
+
+    // Rarely written, see PoolShard
+    DPOOL_CACHE_ALIGNED std::atomic<bool> available_;
+
+    std::atomic<bool> closed_;
+
+    std::atomic<unsigned> fails_;
+
+    // Hot: current number of active connections and of full slots
+    DPOOL_CACHE_ALIGNED std::atomic<int32_t> active_;
+
+    std::atomic<int32_t> numIdle_;
+
+    // Effective maxActive, zero for no limit, and maxIdle
+    AdaptiveLimits limits_;
+
+    // Cumulative statistics, written concurrently
+    DPOOL_CACHE_ALIGNED typename Stats::template Shard<false> stats_;
+
+    // Counters at the previous getShardStats(), to report deltas
+    DPOOL_CACHE_ALIGNED std::mutex reportedMtx_;
+    ShardSnapshot reported_;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_LOCKFREE_SHARD_H_
@@ -0,0 +1,315 @@
+#ifndef DPOOL_LOGGER_H_
+#define DPOOL_LOGGER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include <unistd.h>
+
+namespace dpool {
+
+// Kinds of messages logged by the pool. Rate limiting and enabling are per type.
+enum LogType {
+    // Hot path: emitted by borrowing threads, silenced by default
+    kLogDialFailed = 0,
+    kLogMaxActive,
+    kLogWaitTimeout,
+    kLogGetOnClosed,
+    // Cold path: lifecycle & health checker
+    kLogAlreadyClosed,
+    kLogServerRecovered,
+    kLogServerUnavailable,
+    kLogTooManyUnavailable,
+    kLogCheckFailed,
+    kLogHealthCheckStopped,
+    kNumLogTypes
+};
+
+inline const char* logTypeName(int type) {
+    static const char* names[kNumLogTypes] = {
+        "dial-failed", "max-active", "wait-timeout", "get-on-closed", "already-closed",
+        "server-recovered", "server-unavailable", "too-many-unavailable", "check-failed",
+        "health-check-stopped",
+    };
+    return type >= 0 && type < kNumLogTypes ? names[type] : "unknown";
+}
+
+// Logger is the pluggable sink of pool messages. Callers check enabled() before
+// doing any formatting; logf() then applies the per type rate limit, formats
+// into a stack buffer and hands the message to write(). Messages dropped by the
+// rate limiter are counted, and the count is reported with the next message of
+// the same type that gets through.
+class Logger {
+  public:
+    static const int kMaxMessage = 256;
+
+    Logger() : enabledMask_(0) {
+        for (int i = 0; i < kNumLogTypes; i++) {
+            limits_[i].store(0, std::memory_order_relaxed);
+            windows_[i].store(0, std::memory_order_relaxed);
+            counts_[i].store(0, std::memory_order_relaxed);
+            suppressed_[i].store(0, std::memory_order_relaxed);
+        }
+        // Only the cold path talks by default, at most 10 messages/s per type.
+        for (int i = kLogAlreadyClosed; i < kNumLogTypes; i++) {
+            enable(static_cast<LogType>(i), 10);
+        }
+    }
+
+    virtual ~Logger() {}
+
+    // Let @type through, at most @perSecond messages per second (0: unlimited).
+    void enable(LogType type, uint32_t perSecond = 0) {
+        limits_[type].store(perSecond, std::memory_order_relaxed);
+        enabledMask_.fetch_or(1u << type, std::memory_order_relaxed);
+    }
+
+    void disable(LogType type) {
+        enabledMask_.fetch_and(~(1u << type), std::memory_order_relaxed);
+    }
+
+    bool enabled(LogType type) const {
+        return (enabledMask_.load(std::memory_order_relaxed) & (1u << type)) != 0;
+    }
+
+    // Number of messages of @type dropped by the rate limiter and not reported yet
+    uint64_t suppressed(LogType type) const {
+        return suppressed_[type].load(std::memory_order_relaxed);
+    }
+
+    void logf(LogType type, const char* fmt, ...) __attribute__((format(printf, 3, 4))) {
+        if (!admit(type)) {
+            return;
+        }
+
+        char buf[kMaxMessage];
+        int n = snprintf(buf, sizeof(buf), "dpool: ");
+        va_list ap;
+        va_start(ap, fmt);
+        n += vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
+        va_end(ap);
+
+        uint64_t dropped = suppressed_[type].exchange(0, std::memory_order_relaxed);
+        if (dropped > 0 && n < (int)sizeof(buf)) {
+            n += snprintf(buf + n, sizeof(buf) - n, " (%llu similar messages suppressed)",
+                          (unsigned long long)dropped);
+        }
+        if (n >= (int)sizeof(buf)) {
+            n = sizeof(buf) - 1;
+        }
+        write(type, buf, n);
+    }
+
+  protected:
+    // Emit one formatted message, without trailing newline.
+    virtual void write(LogType type, const char* msg, size_t len) = 0;
+
+  private:
+    // Fixed one second window rate limiter, lock free.
+    bool admit(LogType type) {
+        uint32_t limit = limits_[type].load(std::memory_order_relaxed);
+        if (limit == 0) {
+            return true;
+        }
+        int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t window = windows_[type].load(std::memory_order_relaxed);
+        if (window != now && windows_[type].compare_exchange_strong(window, now, std::memory_order_relaxed)) {
+            counts_[type].store(0, std::memory_order_relaxed);
+        }
+        if (counts_[type].fetch_add(1, std::memory_order_relaxed) < limit) {
+            return true;
+        }
+        suppressed_[type].fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    std::atomic<uint32_t> enabledMask_;
+    std::atomic<uint32_t> limits_[kNumLogTypes];
+    std::atomic<int64_t> windows_[kNumLogTypes];
+    std::atomic<uint32_t> counts_[kNumLogTypes];
+    std::atomic<uint64_t> suppressed_[kNumLogTypes];
+};
+
+// Writes every message straight into a file descriptor, stderr by default.
+class FdLogger : public Logger {
+  public:
+    explicit FdLogger(int fd = STDERR_FILENO) : fd_(fd) {}
+
+  protected:
+    virtual void write(LogType, const char* msg, size_t len) override {
+        char line[kMaxMessage + 1];
+        memcpy(line, msg, len);
+        line[len] = '\n';
+        // A single write(2) per line keeps lines of concurrent threads apart.
+        ssize_t ignored = ::write(fd_, line, len + 1);
+        (void)ignored;
+    }
+
+  private:
+    const int fd_;
+};
+
+// AsyncLogger hands messages over to a background thread through a bounded
+// lock free queue, so that a logging thread never blocks on the output. When
+// the queue is full the message is dropped and counted. The background thread
+// is started with the first message.
+class AsyncLogger : public Logger {
+  public:
+    static const size_t kQueueSize = 1024;
+
+    explicit AsyncLogger(int fd = STDERR_FILENO)
+        : fd_(fd), enqueuePos_(0), dequeuePos_(0), dropped_(0), started_(false), closed_(false) {
+        for (size_t i = 0; i < kQueueSize; i++) {
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;    // noncopyable
+
+    virtual ~AsyncLogger() {
+        closed_.store(true, std::memory_order_release);
+        std::lock_guard<std::mutex> lck(startMtx_);
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    // Messages dropped because the queue was full
+    uint64_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+  protected:
+    virtual void write(LogType, const char* msg, size_t len) override {
+        if (!started_.load(std::memory_order_acquire)) {
+            start();
+        }
+
+        // Bounded MPMC queue of Dmitry Vyukov: a slot is ready for the
+        // producer of position pos when its sequence equals pos.
+        size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &slots_[pos % kQueueSize];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        memcpy(slot->msg, msg, len);
+        slot->msg[len] = '\n';
+        slot->len = len + 1;
+        slot->seq.store(pos + 1, std::memory_order_release);
+    }
+
+  private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        size_t len;
+        char msg[kMaxMessage + 1];
+    };
+
+    void start() {
+        std::lock_guard<std::mutex> lck(startMtx_);
+        if (!started_.load(std::memory_order_relaxed) && !closed_.load(std::memory_order_relaxed)) {
+            thread_ = std::thread(&AsyncLogger::drain, this);
+            started_.store(true, std::memory_order_release);
+        }
+    }
+
+    // Background thread routine: write out queued messages, poll when idle.
+    void drain() {
+        while (true) {
+            size_t pos = dequeuePos_;
+            Slot& slot = slots_[pos % kQueueSize];
+            if (slot.seq.load(std::memory_order_acquire) == pos + 1) {
+                ssize_t ignored = ::write(fd_, slot.msg, slot.len);
+                (void)ignored;
+                slot.seq.store(pos + kQueueSize, std::memory_order_release);
+                dequeuePos_ = pos + 1;
+                continue;
+            }
+            if (closed_.load(std::memory_order_acquire)) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    const int fd_;
+    Slot slots_[kQueueSize];
+    std::atomic<size_t> enqueuePos_;
+    // Only touched by the background thread
+    size_t dequeuePos_;
+    std::atomic<uint64_t> dropped_;
+
+    std::mutex startMtx_;
+    std::thread thread_;
+    std::atomic<bool> started_;
+    std::atomic<bool> closed_;
+};
+
+// The logger of pools that were not given one: asynchronous, to stderr, hot
+// path messages disabled.
+inline Logger* defaultLogger() {
+    static AsyncLogger logger;
+    return &logger;
+}
+
+// Logger policies, selecting how a pool and its shards log. A policy
+// provides get(), the Logger to use or nullptr, and set(Logger*).
+
+// The default logger policy: a Logger pluggable at runtime, see DPool::setLogger().
+class RuntimeLogger {
+  public:
+    RuntimeLogger() : logger_(defaultLogger()) {}
+
+    Logger* get() const {
+        return logger_.load(std::memory_order_relaxed);
+    }
+
+    void set(Logger* logger) {
+        logger_.store(logger, std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<Logger*> logger_;
+};
+
+// Never log: get() is a constant nullptr, so DPOOL_LOG compiles to nothing.
+struct NullLogger {
+    Logger* get() const {
+        return nullptr;
+    }
+
+    void set(Logger*) {}
+};
+
+} // namespace dpool
+
+// Log through @logger (may be nullptr), formatting only if @type is enabled.
+#define DPOOL_LOG(logger, type, ...) \
+    do { \
+        ::dpool::Logger* dpool_logger_ = (logger); \
+        if (dpool_logger_ != nullptr && dpool_logger_->enabled(type)) { \
+            dpool_logger_->logf((type), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#endif // DPOOL_LOGGER_H_
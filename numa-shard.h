@@ -0,0 +1,227 @@
+#ifndef DPOOL_NUMA_SHARD_H_
+#define DPOOL_NUMA_SHARD_H_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "pooled-object.h"
+#include "policies.h"
+#include "pool-shard.h"
+#include "numa-topology.h"
+#include "cache-line.h"
+
+namespace dpool {
+
+// NumaPoolShard keeps one PoolShard per NUMA node for its server, with
+// maxActive and maxIdle split evenly across nodes. Connection objects are
+// allocated on the memory of their node, and get() borrows from the sub-pool
+// of the calling thread's node, only going to the other nodes when it is
+// exhausted. Memory allocated by T::open() itself, e.g. hiredis buffers, is
+// placed by the kernel first touch policy, usually on the dialing thread's
+// node as well.
+template <typename T, typename Traits = DefaultShardTraits>
+class NumaPoolShard {
+  public:
+    typedef PoolShard<T, Traits> NodeShard;
+    typedef typename Traits::Listener Listener;
+
+    // @listener, if any, must outlive the shard.
+    NumaPoolShard(const InetSocketAddress server, const PoolConfig& config, uint16_t index = 0,
+                  Listener* listener = nullptr)
+        : server_(server), index_(index), available_(true),
+          numNodes_(NumaTopology::instance().numNodes()), nodes_(numNodes_),
+          remote_(new std::atomic<uint64_t>[numNodes_]), numGet_(0) {
+        PoolConfig nodeConfig = PoolConfig(config.connTimeoutMs, config.dataTimeoutMs, split(config.maxIdle),
+                                           split(config.maxActive), config.maxFails)
+                .withReserve(split(config.reserveCritical), split(config.reserveNormal))
+                .withMaxWait(config.maxWaitMs);
+        PoolConfig adaptiveConfig = nodeConfig.withAdaptiveLimits(split(config.minIdle),
+                                                                  split(config.minActive));
+        for (int i = 0; i < numNodes_; i++) {
+            // A single node needs no binding.
+            nodes_.emplace_back(server, config.adaptive ? adaptiveConfig : nodeConfig, index, listener,
+                                numNodes_ > 1 ? i : -1);
+            remote_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    NumaPoolShard(const NumaPoolShard&) = delete;
+    NumaPoolShard& operator=(const NumaPoolShard&) = delete;    // noncopyable
+
+    virtual ~NumaPoolShard() {}
+
+    void close() {
+        for (auto it = nodes_.begin(); it != nodes_.end(); it++) {
+            it->close();
+        }
+    }
+
+    // Borrow from the sub-pool of the calling node, or from those of the
+    // other nodes if it is exhausted only: a failed dial or an expired
+    // deadline would fail there as well, a connect timeout later.
+    // @status - if not nullptr, set to why nullptr was returned
+    std::shared_ptr<T> get(Priority priority = kPriorityNormal,
+                           typename Traits::Clock::time_point deadline = Traits::Clock::time_point::max(),
+                           GetStatus* status = nullptr) {
+        if (Traits::Stats::kEnabled) {
+            numGet_.fetch_add(1, std::memory_order_relaxed);
+        }
+        int home = NumaTopology::instance().currentNode();
+        GetStatus why = kGetExhausted;
+        for (int i = 0; i < numNodes_ && why == kGetExhausted; i++) {
+            int node = (home + i) % numNodes_;
+            std::shared_ptr<T> c = nodes_[node].get(priority, deadline, &why);
+            if (c == nullptr) {
+                continue;
+            }
+            if (i > 0 && Traits::Stats::kEnabled) {
+                remote_[node].fetch_add(1, std::memory_order_relaxed);
+            }
+            c->setDataSource(this);
+            return c;
+        }
+        if (status != nullptr) {
+            *status = why;
+        }
+        return nullptr;
+    }
+
+    void put(std::shared_ptr<T> pc, bool broken) {
+        int node = pc->getNode();
+        nodes_[node < 0 ? 0 : node].put(pc, broken);
+    }
+
+    bool isAvailable() {
+        return available_.load(std::memory_order_relaxed);
+    }
+
+    bool isSuspectable() {
+        for (auto it = nodes_.begin(); it != nodes_.end(); it++) {
+            if (it->isSuspectable()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // A server marked available starts over with no failures on any node.
+    // @return - true if the underlying atomic value was changed, false otherwise.
+    bool markAvailable(const bool avail) {
+        if (avail) {
+            for (auto it = nodes_.begin(); it != nodes_.end(); it++) {
+                it->markAvailable(true);
+            }
+        }
+        bool expected = !avail;
+        return available_.compare_exchange_strong(expected, avail);
+    }
+
+    const InetSocketAddress& getServerAddr() const {
+        return server_;
+    }
+
+    // Send the messages of this shard to @logger, nullptr for silence.
+    void setLogger(Logger* logger) {
+        for (auto it = nodes_.begin(); it != nodes_.end(); it++) {
+            it->setLogger(logger);
+        }
+    }
+
+    void setDialGate(DialGate* gate) {
+        for (auto it = nodes_.begin(); it != nodes_.end(); it++) {
+            it->setDialGate(gate);
+        }
+    }
+
+    // Close an idle connection of any node, see PoolShard.
+    bool closeIdle() {
+        for (auto it = nodes_.begin(); it != nodes_.end(); it++) {
+            if (it->closeIdle()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Position of the shard in the server list of its pool
+    uint16_t getIndex() const {
+        return index_;
+    }
+
+    // Statistics since the previous call, for the legacy monitor.
+    void getShardStats(PoolStats& st) {
+        ShardSnapshot now;
+        getSnapshot(now);
+
+        std::lock_guard<std::mutex> lck(reportedMtx_);
+        st.available = now.available;
+        st.numActive = now.numActive;
+        st.numGet = now.numGet - reported_.numGet;
+        st.numPut = now.numPut - reported_.numPut;
+        st.numDial = now.numDial - reported_.numDial;
+        st.numDialFail = now.numDialFail - reported_.numDialFail;
+        st.numBroken = now.numBroken - reported_.numBroken;
+        st.numEvict = now.numEvict - reported_.numEvict;
+        st.numClose = now.numClose - reported_.numClose;
+        reported_ = now;
+    }
+
+    // Cumulative statistics of the whole shard, summed over nodes. numGet
+    // counts the get() of the shard, not the attempts on each node.
+    void getSnapshot(ShardSnapshot& st) const {
+        std::vector<ShardSnapshot> nodes;
+        getNodeSnapshots(nodes);
+        st.server = server_.to_string();
+        st.index = index_;
+        st.available = available_.load(std::memory_order_relaxed);
+        for (auto it = nodes.begin(); it != nodes.end(); it++) {
+            st.merge(*it);
+        }
+        st.numGet = numGet_.load(std::memory_order_relaxed);
+    }
+
+    // Cumulative statistics of every node sub-pool.
+    void getNodeSnapshots(std::vector<ShardSnapshot>& snapshots) const {
+        snapshots.resize(nodes_.size());
+        for (size_t i = 0; i < nodes_.size(); i++) {
+            nodes_[i].getSnapshot(snapshots[i]);
+            snapshots[i].node = i;
+            snapshots[i].available = available_.load(std::memory_order_relaxed);
+            snapshots[i].numRemoteBorrow = remote_[i].load(std::memory_order_relaxed);
+        }
+    }
+
+  private:
+    // Share of a per shard limit for one node, zero meaning no limit.
+    int split(int limit) const {
+        return limit <= 0 ? limit : (limit + numNodes_ - 1) / numNodes_;
+    }
+
+    // Server address, e.g. "127.0.0.1:8080"
+    const InetSocketAddress server_;
+
+    const uint16_t index_;
+
+    // See PoolShard, the node sub-pools ignore their own
+    std::atomic<bool> available_;
+
+    const int numNodes_;
+
+    // Sub-pool of every node, contiguous
+    AlignedArray<NodeShard> nodes_;
+
+    // Borrows from the sub-pool of every node by threads of another node
+    std::unique_ptr<std::atomic<uint64_t>[]> remote_;
+
+    // Hot: counted by every get()
+    DPOOL_CACHE_ALIGNED std::atomic<uint64_t> numGet_;
+
+    // Counters at the previous getShardStats(), to report deltas
+    DPOOL_CACHE_ALIGNED std::mutex reportedMtx_;
+    ShardSnapshot reported_;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_NUMA_SHARD_H_
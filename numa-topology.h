@@ -0,0 +1,131 @@
+#ifndef DPOOL_NUMA_TOPOLOGY_H_
+#define DPOOL_NUMA_TOPOLOGY_H_
+
+#include <cstdio>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "dpool-exception.h"
+
+namespace dpool {
+
+// NUMA topology of the host, read once from sysfs. Uses plain syscalls, so
+// that no libnuma is needed; hosts without NUMA look like a single node.
+class NumaTopology {
+  public:
+    static const NumaTopology& instance() {
+        static NumaTopology topology;
+        return topology;
+    }
+
+    int numNodes() const {
+        return numNodes_;
+    }
+
+    // Node of the CPU the calling thread runs on
+    int currentNode() const {
+        if (numNodes_ == 1) {
+            return 0;
+        }
+        int cpu = sched_getcpu();
+        return cpu >= 0 && cpu < (int)cpuToNode_.size() ? cpuToNode_[cpu] : 0;
+    }
+
+  private:
+    NumaTopology() : numNodes_(1) {
+        int maxNode = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            int node = nodeOfCpu(cpu);
+            if (node == -2) {
+                break;
+            }
+            cpuToNode_.push_back(node < 0 ? 0 : node);
+            if (node > maxNode) {
+                maxNode = node;
+            }
+        }
+        numNodes_ = maxNode + 1;
+    }
+
+    // @return - the node of @cpu, -1 if unknown, -2 if there is no such cpu.
+    static int nodeOfCpu(int cpu) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+        if (access(path, F_OK) != 0) {
+            return -2;
+        }
+        for (int node = 0; node < kMaxNodes; node++) {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+            if (access(path, F_OK) == 0) {
+                return node;
+            }
+        }
+        return -1;
+    }
+
+    static const int kMaxNodes = 64;
+
+    int numNodes_;
+    std::vector<int> cpuToNode_;
+};
+
+// Allocates from pages bound to a NUMA node. Every allocation takes whole
+// pages of its own, so it is meant for a few long lived objects such as
+// connections, not for general use.
+template <typename U>
+class NumaAllocator {
+  public:
+    typedef U value_type;
+
+    explicit NumaAllocator(int node) : node_(node) {}
+
+    template <typename V>
+    NumaAllocator(const NumaAllocator<V>& other) : node_(other.node()) {}
+
+    U* allocate(size_t n) {
+        size_t len = n * sizeof(U);
+        void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            raiseBadAlloc();
+        }
+        if (node_ >= 0 && node_ < 64) {
+            // MPOL_PREFERRED: fall back on other nodes rather than failing.
+            unsigned long mask = 1UL << node_;
+            syscall(SYS_mbind, p, len, kMpolPreferred, &mask, sizeof(mask) * 8, 0);
+        }
+        return static_cast<U*>(p);
+    }
+
+    void deallocate(U* p, size_t n) {
+        munmap(p, n * sizeof(U));
+    }
+
+    int node() const {
+        return node_;
+    }
+
+  private:
+    static const int kMpolPreferred = 1;
+
+    int node_;
+};
+
+template <typename U, typename V>
+bool operator==(const NumaAllocator<U>& a, const NumaAllocator<V>& b) {
+    return a.node() == b.node();
+}
+
+template <typename U, typename V>
+bool operator!=(const NumaAllocator<U>& a, const NumaAllocator<V>& b) {
+    return !(a == b);
+}
+
+} // namespace dpool
+
+#endif // DPOOL_NUMA_TOPOLOGY_H_
@@ -0,0 +1,67 @@
+#ifndef DPOOL_POLICIES_H_
+#define DPOOL_POLICIES_H_
+
+#include "clock.h"
+#include "stats.h"
+#include "logger.h"
+#include "balancer.h"
+#include "listener.h"
+#include "limiter.h"
+
+namespace dpool {
+
+// DPool is configured at compile time by policies, the defaults matching the
+// classic behavior:
+//
+//   DPool<T, ShardPolicy = LockedShard, BalancerPolicy = RoundRobinBalancer,
+//         StatsPolicy = CountingStats, ClockPolicy = SystemClock,
+//         LoggerPolicy = RuntimeLogger, ListenerPolicy = NoListener,
+//         LimiterPolicy = NoLimiter>
+//
+// See balancer.h, stats.h, clock.h, logger.h, listener.h and limiter.h for
+// the other policies. A lean deployment may pick e.g. LockFreeShard, NoStats and
+// NullLogger, and the compiler drops the corresponding code from the inlined
+// get()/put() path.
+
+// The policies a shard is instantiated with.
+template <typename ClockPolicy, typename StatsPolicy, typename LoggerPolicy,
+          typename ListenerPolicy = NoListener>
+struct ShardTraits {
+    typedef ClockPolicy Clock;
+    typedef StatsPolicy Stats;
+    typedef LoggerPolicy Logger;
+    typedef ListenerPolicy Listener;
+
+    // Whether borrows and returns are timed
+    static const bool kTimed = StatsPolicy::kEnabled || ListenerPolicy::kEnabled;
+};
+
+typedef ShardTraits<SystemClock, CountingStats, RuntimeLogger> DefaultShardTraits;
+
+template <typename T, typename Traits> class PoolShard;
+template <typename T, typename Traits> class LockFreePoolShard;
+template <typename T, typename Traits> class NumaPoolShard;
+
+// Shard policies select the shard implementation.
+
+// The default shard: a mutex protected stack of idle connections.
+struct LockedShard {
+    template <typename T, typename Traits>
+    using type = PoolShard<T, Traits>;
+};
+
+// A shard whose get() and put() never block on a lock, see lockfree-shard.h.
+struct LockFreeShard {
+    template <typename T, typename Traits>
+    using type = LockFreePoolShard<T, Traits>;
+};
+
+// One sub-pool per NUMA node for every server, see numa-shard.h.
+struct NumaShard {
+    template <typename T, typename Traits>
+    using type = NumaPoolShard<T, Traits>;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_POLICIES_H_
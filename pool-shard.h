@@ -1,141 +1,283 @@
 #ifndef DPOOL_POOL_SHARD_H_
 #define DPOOL_POOL_SHARD_H_
 
+#include <limits>
+
+#include <sched.h>
+
 #include "pooled-object.h"
+#include "policies.h"
+#include "numa-topology.h"
+#include "adaptive-limits.h"
+#include "dial-gate.h"
+#include "cache-line.h"
+#include "flight-recorder.h"
+#include "probes.h"
 
 namespace dpool {
 
-template <typename T>
+// PoolShard splits its idle connections into per-core stripes, each with its
+// own lock: get() takes from the stripe of the calling core and only steals
+// from the others when it is empty, put() parks the connection back into the
+// stripe of its core, where it stays warm in caches. maxIdle and maxActive
+// are enforced across stripes by shared atomic counts, and may adapt to the
+// demand, see adaptive-limits.h. Part of maxActive may be reserved to the
+// borrows of higher priorities, see PoolConfig::withReserve().
+template <typename T, typename Traits = DefaultShardTraits>
 class PoolShard {
   public:
-    PoolShard(const InetSocketAddress server, const PoolConfig& config)
-        : server_(server), available_(true),
-         fails_(0), kMaxWait_(3), kMaxIdle_(config.maxIdle), stats_(server),
-         kMaxActive_(config.maxActive), kMaxFails_(config.maxFails), active_(0),
-         closed_(false), connTimeoutMs_(config.connTimeoutMs), dataTimeoutMs_(config.dataTimeoutMs)  {
+    typedef typename Traits::Clock Clock;
+    typedef typename Traits::Stats Stats;
+    typedef typename Traits::Listener Listener;
+
+    // @listener, if any, must outlive the shard. Connections are allocated on
+    // NUMA node @node, if not -1.
+    PoolShard(const InetSocketAddress server, const PoolConfig& config, uint16_t index = 0,
+              Listener* listener = nullptr, int node = -1)
+        : server_(server), index_(index), listener_(listener), gate_(nullptr), node_(node),
+         kMaxFails_(config.maxFails), kWait_(config.maxWaitMs > 0),
+         kMaxWait_(config.maxWaitMs > 0 ? config.maxWaitMs : 3),
+         connTimeoutMs_(config.connTimeoutMs), dataTimeoutMs_(config.dataTimeoutMs),
+         stripes_(defaultStripes()), available_(true), closed_(false), fails_(0),
+         active_(0), numIdle_(0), waiting_(0), limits_(config) {
+        for (unsigned i = 0; i < defaultStripes(); i++) {
+            stripes_.emplace_back();
+        }
+        reserve_[kPriorityCritical] = 0;
+        reserve_[kPriorityNormal] = config.reserveCritical;
+        reserve_[kPriorityBulk] = config.reserveCritical + config.reserveNormal;
+        for (int p = 0; p < kNumPriorities; p++) {
+            waiters_[p] = 0;
+        }
     }
 
     PoolShard(const PoolShard&) = delete;
     PoolShard& operator=(const PoolShard&) = delete;    // noncopyable
 
     virtual ~PoolShard() {
-        close();
+        // Already closed by the shutdown of the pool, if any.
+        if (!closed_.load(std::memory_order_relaxed)) {
+            close();
+        }
     }
 
     void close() {
         bool expected = false;
         if (!(closed_.compare_exchange_strong(expected, true))) {
-            std::cerr << "dpool: shard already closed" << std::endl;
+            DPOOL_LOG(logger(), kLogAlreadyClosed, "shard already closed - %s:%u",
+                      server_.host.c_str(), server_.port);
             return;
         }
         empty();
     }
 
-    std::shared_ptr<T> get() {
-        auto start = std::chrono::system_clock::now();
+    // Borrow a connection, giving up waiting and dialing at @deadline.
+    // @status - if not nullptr, set to why nullptr was returned
+    std::shared_ptr<T> get(Priority priority = kPriorityNormal,
+                           typename Clock::time_point deadline = Clock::time_point::max(),
+                           GetStatus* status = nullptr) {
+        bool bounded = deadline != Clock::time_point::max();
+        typename Clock::time_point start;
+        if (Traits::kTimed || kWait_ || limits_.enabled() || bounded) {
+            start = Clock::now();
+        }
         std::shared_ptr<T> c;
+        // Whether the get() is accounted yet: in the stripe it takes an idle
+        // connection from, or else in stats_.
+        bool counted = false;
 
-        std::unique_lock<std::mutex> lck(mtx_);
-
-        stats_.numGet++;
+        DPOOL_PROBE1(shard__get__start, index_);
+        limits_.onArrival();
 
         while (true) {
-            if (!idle_.empty()) {
-                c = idle_.front();
-                idle_.pop_front();
+            int32_t cap = capacity(priority);
+            c = reserve_[priority] == 0 || borrowed() < cap ? takeIdle(!counted) : nullptr;
+            if (c != nullptr) {
                 c->setBorrowed(true);
-                lck.unlock();
+                onBorrow(c.get(), start);
+                DPOOL_PROBE2(shard__get__return, index_, 0);
                 return c;
             }
+            if (!counted) {
+                stats_.onGet();
+                counted = true;
+            }
 
             if (closed_.load(std::memory_order_relaxed)) {
-                lck.unlock();
-                std::cerr << "dpool: get on closed pool shard " << server_.to_string() << std::endl;
-                return nullptr;
+                DPOOL_LOG(logger(), kLogGetOnClosed, "get on closed pool shard %s:%u",
+                          server_.host.c_str(), server_.port);
+                DPOOL_PROBE2(shard__get__return, index_, -1);
+                return refuse(status, kGetClosed);
             }
 
-            if (kMaxActive_ == 0 || active_ < kMaxActive_) {
-                active_++;
-                stats_.numDial++;
-                lck.unlock();
-
-                c = std::make_shared<T>(server_, connTimeoutMs_, dataTimeoutMs_);
-                try {
-                    c->open();
-                    fails_.store(0, std::memory_order_relaxed);
-                    c->setDataSource(this);
-                    c->setBorrowed(true);
-                    return c;
-                } catch (DPoolException& ex) {
-                    fails_.fetch_add(1, std::memory_order_relaxed);
-                    lck.lock();
-                    active_--;
-                    stats_.numDialFail++;
-                    lck.unlock();
-                    cv_.notify_one();
-                    std::cerr << "dpool: failed to create connection on pool shard "
-                            << ex.what() << std::endl;
-                    return nullptr;
+            // A dial times out at the deadline at the latest.
+            int connTimeoutMs = connTimeoutMs_;
+            if (bounded) {
+                int64_t leftMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - Clock::now()).count();
+                if (leftMs <= 0) {
+                    DPOOL_PROBE2(shard__get__return, index_, -1);
+                    return refuse(status, kGetTimedOut);
                 }
+                connTimeoutMs = leftMs < connTimeoutMs ? leftMs : connTimeoutMs;
             }
 
-            std::cerr << "dpool: failed to dial connection to server: " << (server_.to_string()) 
-                      << " , active: " << active_ << std::endl;
+            int32_t active = active_.load(std::memory_order_relaxed);
+            while (active < cap) {
+                if (!active_.compare_exchange_weak(active, active + 1, std::memory_order_relaxed)) {
+                    continue;
+                }
+                active++;
+                if (gate_ != nullptr && !gate_->acquire()) {
+                    active_.fetch_sub(1);
+                    notifyWaiter();
+                    DPOOL_LOG(logger(), kLogMaxActive, "dial refused by shared limits, server: %s:%u",
+                              server_.host.c_str(), server_.port);
+                    DPOOL_PROBE2(shard__get__return, index_, -1);
+                    return refuse(status, kGetExhausted);
+                }
+                stats_.onDial();
+                DPOOL_FLIGHT_EVENT(kFlightDialStart, index_, active);
+                DPOOL_PROBE2(shard__dial__start, index_, active);
+
+                c = newObject(connTimeoutMs);
+                const DPoolException* error = c->tryOpen();
+                if (error != nullptr) {
+                    unsigned fails = fails_.fetch_add(1, std::memory_order_relaxed) + 1;
+                    active_.fetch_sub(1);
+                    releaseGate();
+                    stats_.onDialFail();
+                    DPOOL_FLIGHT_EVENT(kFlightDialFail, index_, fails);
+                    notifyWaiter();
+                    DPOOL_LOG(logger(), kLogDialFailed, "failed to create connection on pool shard %s:%u - %s",
+                              server_.host.c_str(), server_.port, error->what());
+                    if (listener_ != nullptr) {
+                        listener_->onDialFail(index_, server_, *error);
+                    }
+                    DPOOL_PROBE2(shard__dial__done, index_, 0);
+                    DPOOL_PROBE2(shard__get__return, index_, -1);
+                    return refuse(status, kGetDialFailed);
+                }
+                resetFails();
+                c->setDataSource(this);
+                c->setBorrowed(true);
+                if (listener_ != nullptr) {
+                    listener_->onDial(index_, server_, c.get());
+                }
+                onBorrow(c.get(), start);
+                DPOOL_PROBE2(shard__dial__done, index_, 1);
+                DPOOL_PROBE2(shard__get__return, index_, 1);
+                return c;
+            }
 
+            if (limits_.enabled()) {
+                limits_.onRefusal(toNanos(Clock::now()));
+            }
             if (!kWait_) {
-                lck.unlock();
-                return nullptr;
+                DPOOL_LOG(logger(), kLogMaxActive, "failed to dial connection to server: %s:%u, active: %d",
+                          server_.host.c_str(), server_.port, active);
+                DPOOL_PROBE2(shard__get__return, index_, -1);
+                return refuse(status, kGetExhausted);
             }
 
+            // Sleep until put() parks a connection or frees some budget. The
+            // condition is checked again after announcing the waiter, so that
+            // notifyWaiter() cannot slip in between.
             auto abs_time = start + std::chrono::milliseconds(kMaxWait_);
-            if (cv_.wait_until(lck, abs_time) == std::cv_status::timeout) {
-                lck.unlock();
-                std::cerr << "dpool: timedout to wait idle connection on pool shard "
-                        << (server_.to_string()) << std::endl;
-                return nullptr;
+            if (abs_time > deadline) {
+                abs_time = deadline;
+            }
+            std::cv_status waited = std::cv_status::no_timeout;
+            {
+                std::unique_lock<std::mutex> lck(mtx_);
+                waiting_++;
+                waiters_[priority]++;
+                stats_.addWaiter(1);
+                if (!canBorrow(priority)) {
+                    waited = Clock::waitUntil(cv_[priority], lck, abs_time);
+                }
+                stats_.addWaiter(-1);
+                waiters_[priority]--;
+                waiting_--;
+            }
+            if (waited == std::cv_status::timeout) {
+                active = active_.load(std::memory_order_relaxed);
+                stats_.onWaitTimeout();
+                DPOOL_FLIGHT_EVENT(kFlightWaitTimeout, index_, active);
+                DPOOL_PROBE2(shard__wait__timeout, index_, active);
+                DPOOL_LOG(logger(), kLogWaitTimeout, "timedout to wait idle connection on pool shard %s:%u",
+                          server_.host.c_str(), server_.port);
+                if (listener_ != nullptr) {
+                    listener_->onWaitTimeout(index_, server_, active);
+                }
+                DPOOL_PROBE2(shard__get__return, index_, -1);
+                return refuse(status, abs_time == deadline ? kGetTimedOut : kGetExhausted);
             }
         }
     }
 
     void put(std::shared_ptr<T> pc, bool broken) {
-        std::unique_lock<std::mutex> lck(mtx_);
-
-        stats_.numPut++;
+        DPOOL_PROBE2(shard__put, index_, broken);
 
+        // The borrower owns the object until it is handed back, so the flag
+        // needs no lock.
         if (!pc->isBorrowed()) {
-            lck.unlock();
+            stats_.onPut();
             return;
-        } 
+        }
         pc->setBorrowed(false);
+        int64_t borrowTime = pc->getBorrowTime();
+        T* returned = pc.get();
+        bool evicted = false;
 
         if (broken) {
-            fails_.fetch_add(1, std::memory_order_relaxed);
-            stats_.numBroken++;
+            unsigned fails = fails_.fetch_add(1, std::memory_order_relaxed) + 1;
+            stats_.onPut();
+            stats_.onBroken();
+            DPOOL_FLIGHT_EVENT(kFlightBrokenPut, index_, fails);
         } else {
-            fails_.store(0, std::memory_order_relaxed);
+            resetFails();
         }
 
-        if (!closed_.load(std::memory_order_relaxed) && !broken) {
-            idle_.push_front(pc);
-            if (idle_.size() > kMaxIdle_) {
-                pc = idle_.back();
-                idle_.pop_back();
-				stats_.numEvict++;
-            } else {
-                pc = nullptr;
+        if (!broken) {
+            // Park the connection in the stripe of this core, where its
+            // buffers are likely still cached.
+            Stripe& stripe = stripes_[stripeIndex()];
+            std::unique_lock<std::mutex> lck(stripe.mtx);
+            stripe.stats.onPut();
+            if (!closed_.load(std::memory_order_relaxed)) {
+                stripe.idle.push_front(pc);
+                stripe.size.store(stripe.idle.size(), std::memory_order_relaxed);
+                int32_t idle = numIdle_.fetch_add(1) + 1;
+                if (idle > limits_.maxIdle()) {
+                    pc = stripe.idle.back();
+                    stripe.idle.pop_back();
+                    stripe.size.store(stripe.idle.size(), std::memory_order_relaxed);
+                    idle = numIdle_.fetch_sub(1) - 1;
+                    stripe.stats.onEvict();
+                    evicted = true;
+                    DPOOL_FLIGHT_EVENT(kFlightEvict, index_, active_.load(std::memory_order_relaxed));
+                    DPOOL_PROBE2(shard__evict, index_, idle);
+                } else {
+                    pc = nullptr;
+                }
             }
         }
 
         if (pc == nullptr) {
-            lck.unlock();
-            cv_.notify_one();
+            notifyWaiter();
+            onReturn(returned, broken, borrowTime);
             return;
         }
 
-        active_--;
-        stats_.numClose++;
-        lck.unlock();
-        cv_.notify_one();
+        active_.fetch_sub(1);
+        stats_.onClose();
+        releaseGate();
+        notifyWaiter();
+        onReturn(returned, broken, borrowTime);
+        if (evicted && listener_ != nullptr) {
+            listener_->onEvict(index_, pc.get());
+        }
         //connFactory_.close(pc);
         return;
     }
@@ -148,8 +290,12 @@ class PoolShard {
         return (fails_.load(std::memory_order_relaxed) >= kMaxFails_); 
     }
 
+    // A server marked available starts over with no failures.
     // @return - true if the underlying atomic value was changed, false otherwise.
     bool markAvailable(const bool avail) {
+        if (avail) {
+            resetFails();
+        }
         bool expected = !avail;
         return available_.compare_exchange_strong(expected, avail);
     }
@@ -158,49 +304,286 @@ class PoolShard {
         return server_;
     }
 
+    // Send the messages of this shard to @logger, nullptr for silence.
+    void setLogger(Logger* logger) {
+        logger_.set(logger);
+    }
+
+    // Pass every dial through @gate, nullptr for none, see dial-gate.h.
+    // Only set before the first get().
+    void setDialGate(DialGate* gate) {
+        gate_ = gate;
+    }
+
+    // Close an idle connection, to give its budget to another pool, see
+    // ConnectionBudget.
+    // @return - false if there was none
+    bool closeIdle() {
+        std::shared_ptr<T> c = takeIdle(false);
+        if (c == nullptr) {
+            return false;
+        }
+        stats_.onEvict();
+        DPOOL_FLIGHT_EVENT(kFlightEvict, index_, active_.load(std::memory_order_relaxed));
+        if (listener_ != nullptr) {
+            listener_->onEvict(index_, c.get());
+        }
+        active_.fetch_sub(1);
+        stats_.onClose();
+        releaseGate();
+        notifyWaiter();
+        return true;
+    }
+
+    // Position of the shard in the server list of its pool
+    uint16_t getIndex() const {
+        return index_;
+    }
+
+    // Statistics since the previous call, for the legacy monitor.
     void getShardStats(PoolStats& st) {
-        st.available = available_.load(std::memory_order_relaxed);
+        ShardSnapshot now;
+        getSnapshot(now);
+
+        std::lock_guard<std::mutex> lck(reportedMtx_);
+        st.available = now.available;
+        st.numActive = now.numActive;
+        st.numGet = now.numGet - reported_.numGet;
+        st.numPut = now.numPut - reported_.numPut;
+        st.numDial = now.numDial - reported_.numDial;
+        st.numDialFail = now.numDialFail - reported_.numDialFail;
+        st.numBroken = now.numBroken - reported_.numBroken;
+        st.numEvict = now.numEvict - reported_.numEvict;
+        st.numClose = now.numClose - reported_.numClose;
+        reported_ = now;
+    }
 
-        std::lock_guard<std::mutex> lck(mtx_);
-        st.numActive = active_;
-        st.numGet = stats_.numGet;
-        st.numPut = stats_.numPut;
-        st.numDial = stats_.numDial;
-        st.numDialFail = stats_.numDialFail;
-        st.numBroken = stats_.numBroken;
-        st.numEvict = stats_.numEvict;
-        st.numClose = stats_.numClose;
-        stats_.reset();
+    // Cumulative statistics, read without taking any shard lock, so that any
+    // number of consumers can poll them: those of the stripes are added to
+    // those of the shard.
+    void getSnapshot(ShardSnapshot& st) const {
+        stats_.snapshot(st);
+        for (size_t i = 0; i < stripes_.size(); i++) {
+            ShardSnapshot stripe;
+            stripes_[i].stats.snapshot(stripe);
+            st.merge(stripe);
+        }
+        st.server = server_.to_string();
+        st.index = index_;
+        st.available = available_.load(std::memory_order_relaxed);
+        st.numActive = active_.load(std::memory_order_relaxed);
+        st.numIdle = numIdle_.load(std::memory_order_relaxed);
+        st.limitActive = limits_.maxActive();
+        st.limitIdle = limits_.maxIdle();
     }
 
   private:
+    Logger* logger() const {
+        return logger_.get();
+    }
+
+    static int64_t toNanos(typename Clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    }
+
+    // Account a successful get() that started at @start.
+    void onBorrow(T* c, typename Clock::time_point start) {
+        if (Traits::kTimed || limits_.enabled()) {
+            auto now = Clock::now();
+            int64_t waitUs = std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+            stats_.observeBorrowWait(waitUs);
+            c->setBorrowTime(toNanos(now));
+            if (listener_ != nullptr) {
+                listener_->onBorrow(index_, c, waitUs);
+            }
+        }
+    }
+
+    // Account the return of @c, borrowed at @borrowTimeNs.
+    void onReturn(T* c, bool broken, int64_t borrowTimeNs) {
+        if ((Traits::kTimed || limits_.enabled()) && borrowTimeNs >= 0) {
+            int64_t now = toNanos(Clock::now());
+            int64_t holdUs = (now - borrowTimeNs) / 1000;
+            stats_.observeHold(holdUs);
+            if (listener_ != nullptr) {
+                listener_->onReturn(index_, c, broken, holdUs);
+            }
+            if (limits_.enabled()) {
+                limits_.onHold(holdUs, now);
+            }
+        }
+    }
+
+    // A failed get() for @why, see get().
+    static std::shared_ptr<T> refuse(GetStatus* status, GetStatus why) {
+        if (status != nullptr) {
+            *status = why;
+        }
+        return nullptr;
+    }
+
+    std::shared_ptr<T> newObject(int connTimeoutMs) {
+        if (node_ < 0) {
+            return std::make_shared<T>(server_, connTimeoutMs, dataTimeoutMs_);
+        }
+        std::shared_ptr<T> c = std::allocate_shared<T>(NumaAllocator<T>(node_), server_,
+                                                       connTimeoutMs, dataTimeoutMs_);
+        c->setNode(node_);
+        return c;
+    }
+
+    void releaseGate() {
+        if (gate_ != nullptr) {
+            gate_->release();
+        }
+    }
+
+    // Leave the line of fails_ alone unless there were failures.
+    void resetFails() {
+        if (fails_.load(std::memory_order_relaxed) != 0) {
+            fails_.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // One stripe per core, up to kMaxStripes.
+    static unsigned defaultStripes() {
+        unsigned n = std::thread::hardware_concurrency();
+        return n == 0 ? 1 : (n > kMaxStripes ? kMaxStripes : n);
+    }
+
+    // Stripe of the calling core
+    unsigned stripeIndex() const {
+        if (stripes_.size() == 1) {
+            return 0;
+        }
+#ifdef __linux__
+        int cpu = sched_getcpu();
+        if (cpu >= 0) {
+            return cpu % stripes_.size();
+        }
+#endif
+        return std::hash<std::thread::id>()(std::this_thread::get_id()) % stripes_.size();
+    }
+
+    // Take the most recently used connection of the local stripe, or steal
+    // one from the other stripes, nullptr if there is no idle connection.
+    // @get - account a get() in the stripe of the connection
+    std::shared_ptr<T> takeIdle(bool get) {
+        if (numIdle_.load(std::memory_order_relaxed) == 0) {
+            return nullptr;
+        }
+        unsigned home = stripeIndex();
+        for (unsigned i = 0; i < stripes_.size(); i++) {
+            Stripe& stripe = stripes_[(home + i) % stripes_.size()];
+            if (i > 0 && stripe.size.load(std::memory_order_relaxed) == 0) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lck(stripe.mtx);
+            DPOOL_PROBE1(shard__lock__acquired, index_);
+            if (stripe.idle.empty()) {
+                continue;
+            }
+            std::shared_ptr<T> c = stripe.idle.front();
+            stripe.idle.pop_front();
+            stripe.size.store(stripe.idle.size(), std::memory_order_relaxed);
+            numIdle_.fetch_sub(1);
+            if (get) {
+                stripe.stats.onGet();
+            }
+            return c;
+        }
+        return nullptr;
+    }
+
+    // Connections lent out
+    int32_t borrowed() const {
+        return active_.load(std::memory_order_relaxed) - numIdle_.load(std::memory_order_relaxed);
+    }
+
+    // Connections the borrows of @priority may hold at a time
+    int32_t capacity(Priority priority) const {
+        int32_t maxActive = limits_.maxActive();
+        return maxActive == 0 ? std::numeric_limits<int32_t>::max() : maxActive - reserve_[priority];
+    }
+
+    // Whether a get() of @priority would find an idle connection or some
+    // active budget.
+    bool canBorrow(Priority priority) const {
+        int32_t cap = capacity(priority);
+        return (numIdle_.load() > 0 && (reserve_[priority] == 0 || borrowed() < cap)) || active_.load() < cap;
+    }
+
+    // Wake up a get() waiting for a connection or for some active budget,
+    // of the highest priority waiting.
+    void notifyWaiter() {
+        if (waiting_.load() > 0) {
+            std::unique_lock<std::mutex> lck(mtx_);
+            for (int p = 0; p < kNumPriorities; p++) {
+                if (waiters_[p] > 0) {
+                    lck.unlock();
+                    cv_[p].notify_one();
+                    return;
+                }
+            }
+        }
+    }
+
     void empty() {
-        std::unique_lock<std::mutex> lck(mtx_);
-
-        while (!idle_.empty()) {
-            std::shared_ptr<T> c = idle_.front();
-            idle_.pop_front();
-            active_--;
-            stats_.numClose++;
-            lck.unlock();
-            cv_.notify_one();
-            lck.lock();
-            //lck.unlock();
-            //connFactory_.close(c);
-            //lck.lock();
+        for (unsigned i = 0; i < stripes_.size(); i++) {
+            Stripe& stripe = stripes_[i];
+            std::unique_lock<std::mutex> lck(stripe.mtx);
+            while (!stripe.idle.empty()) {
+                std::shared_ptr<T> c = stripe.idle.front();
+                stripe.idle.pop_front();
+                stripe.size.store(stripe.idle.size(), std::memory_order_relaxed);
+                numIdle_.fetch_sub(1);
+                active_--;
+                stripe.stats.onClose();
+                releaseGate();
+                //lck.unlock();
+                //connFactory_.close(c);
+                //lck.lock();
+            }
         }
+        notifyWaiter();
     }
 
   private:
-    // Maximum number of idle connections in the pool.
-    const int kMaxIdle_;
+    static const unsigned kMaxStripes = 64;
+
+    // Stack of idle Poolable with most recently used at the front, aligned so
+    // that the locks of two stripes do not share a cache line.
+    struct DPOOL_CACHE_ALIGNED Stripe {
+        Stripe() : size(0) {}
+
+        std::mutex mtx;
+        std::list<std::shared_ptr<T>> idle;
+        // idle.size(), readable without the lock
+        std::atomic<int32_t> size;
+        // Counters of the gets served and the puts parked by the stripe,
+        // written under mtx
+        typename Stats::template Shard<true> stats;
+    };
 
-    // Maximum number of connections allocated by the pool at a given time.
-    // When zero, there is no limit on the number of connections in the pool.
-    const int32_t kMaxActive_;
+  private:
+    // Read mostly: configuration, set at construction.
 
-    // Current number of active connections
-    int32_t active_;
+    // Server address, e.g. "127.0.0.1:8080"
+    const InetSocketAddress server_;
+
+    const uint16_t index_;
+
+    // Owned by the pool, nullptr if none
+    Listener* const listener_;
+
+    // Limits shared with other pools, nullptr if none
+    DialGate* gate_;
+
+    // NUMA node connections are allocated on, -1 for any
+    const int node_;
+
+    // The idea of "fails" & "maxFails" is borrowed from Nginx.
+    const uint32_t kMaxFails_;
 
     // Close connections after remaining idle for this duration. If the value
     // is zero, then idle connections are not closed. Applications should set
@@ -208,10 +591,10 @@ class PoolShard {
     // XXX: current not used
     const int kIdleTimeout_ = 500;
 
-    // If wait is true and the pool is at the maxIdle limit, then Get() waits
-    // for a connection to be returned to the pool before returning.
-    // XXX: current not used
-    const bool kWait_ = false;
+    // If wait is true and the pool is at the maxActive limit, then Get() waits
+    // for a connection to be returned to the pool before returning. Set by
+    // PoolConfig::withMaxWait().
+    const bool kWait_;
 
     // The maximum number of milliseconds that the pool will wait (when there
     // are no available connections and the maxActive has been reached) for a
@@ -219,41 +602,68 @@ class PoolShard {
     // (3 milliseconds)
     const int kMaxWait_;
 
-    // @atomic
-    std::atomic<bool> closed_;
+    // Connections of maxActive off limits to every priority
+    int32_t reserve_[kNumPriorities];
+
+    const int connTimeoutMs_;
 
-    // Stack of idle Poolable with most recently used at the front.
-    std::list<std::shared_ptr<T>> idle_;
+    const int dataTimeoutMs_;
 
-    // Server address, e.g. "127.0.0.1:8080"
-    const InetSocketAddress server_;
+    typename Traits::Logger logger_;
+
+    AlignedArray<Stripe> stripes_;
+
+    // Rarely written: read by every get() and by the health checker, written
+    // on state changes only.
 
     // If marked as unavailable, then the checking goroutine will check it availability periodically.
     // A server is "available" if we can connnect to it, and respond to Ping() request of client.
     // Since no atomic boolean provided in Golang, we use uint32 instead.
-    std::atomic<bool> available_;
+    DPOOL_CACHE_ALIGNED std::atomic<bool> available_;
+
+    // @atomic
+    std::atomic<bool> closed_;
 
     // The failure count in succession. If the fails reached the threshold of "unavailable",
     // then this server should be marked as "unavailable", and we will not get connection
     // from it until recovered.
     // The idea of "fails" & "maxFails" is borrowed from Nginx.
-    // @atomic
+    // @atomic, only stored when it changes
     std::atomic<unsigned> fails_;
 
-    // The idea of "fails" & "maxFails" is borrowed from Nginx.
-    const uint32_t kMaxFails_;
+    // Hot: written by borrowers.
 
-    const int connTimeoutMs_;
+    // Current number of active connections, across stripes
+    DPOOL_CACHE_ALIGNED std::atomic<int32_t> active_;
 
-    const int dataTimeoutMs_;
+    // Current number of idle connections, across stripes
+    std::atomic<int32_t> numIdle_;
+
+    // Number of get() waiting on cv_
+    std::atomic<int32_t> waiting_;
+
+    // Maximum number of idle connections, and of connections allocated by
+    // the shard at a given time, zero for no limit; with the demand of the
+    // current window if adaptive.
+    AdaptiveLimits limits_;
+
+    // Cumulative statistics of the slow paths, dials, waits and broken
+    // connections, written concurrently; the stripes count the rest.
+    DPOOL_CACHE_ALIGNED typename Stats::template Shard<false> stats_;
+
+    // Cold: waiting get() and the legacy monitor.
+
+    // Mutex & conditions of get() waiting for a connection, per priority
+    DPOOL_CACHE_ALIGNED std::mutex mtx_;
 
-    // Mutex to protect idle connections & active
-    std::mutex mtx_;
+    std::condition_variable cv_[kNumPriorities];
 
-    std::condition_variable cv_;
+    // Number of get() waiting on every cv_, guarded by mtx_
+    int32_t waiters_[kNumPriorities];
 
-    // stats PoolStats
-    PoolStats stats_;
+    // Counters at the previous getShardStats(), to report deltas
+    std::mutex reportedMtx_;
+    ShardSnapshot reported_;
 };
 
 } // namespace dpool
@@ -3,12 +3,19 @@
 
 #include <mutex>          // std::mutex
 #include <memory>         // std::shared_ptr
+#include <cstdint>
+#include <string>
+
+#include "dpool-exception.h"
 
 namespace dpool {
 
 struct InetSocketAddress {
     InetSocketAddress(const char* host, uint16_t port) : host(host), port(port) {}
     InetSocketAddress(const std::string& host, uint16_t port) : host(host), port(port) {}
+    // A server in availability zone @zone, see PoolConfig::withLocalZone().
+    InetSocketAddress(const std::string& host, uint16_t port, const std::string& zone)
+        : host(host), port(port), zone(zone) {}
 
     const std::string to_string() const {
         return host + ":" + std::to_string(port);
@@ -16,13 +23,16 @@ struct InetSocketAddress {
 
     const std::string host;
     const uint16_t port;
+    // Zone or locality label, "" if none
+    const std::string zone;
 };
 
 // Poolable represents a connection to a server.
 class PooledObject {
   public:
     PooledObject(const InetSocketAddress& addr, const int connTimeout, const int dataTimeout)
-      : serverAddr_(addr), connTimeout_(connTimeout), dataTimeout_(dataTimeout) {
+      : pool_(nullptr), borrowTimeNs_(-1), node_(-1), currentDataTimeout_(dataTimeout), serverAddr_(addr),
+        connTimeout_(connTimeout), dataTimeout_(dataTimeout) {
     }
 
     virtual ~PooledObject() {}
@@ -43,6 +53,16 @@ class PooledObject {
         dataSource_ = shard;
     }
 
+    // DPool the object was last borrowed from, for the callers routing over
+    // several pools to put it back, e.g. ClusterPool.
+    void* getPool() const {
+        return pool_;
+    }
+
+    void setPool(void* pool) {
+        pool_ = pool;
+    }
+
     bool isBorrowed() {
         return borrowed_;
     }
@@ -51,16 +71,96 @@ class PooledObject {
         borrowed_ = v;
     }
 
+    // Time the object was borrowed at, in nanoseconds of the pool clock, -1 if
+    // it never was.
+    int64_t getBorrowTime() const {
+        return borrowTimeNs_;
+    }
+
+    void setBorrowTime(int64_t ns) {
+        borrowTimeNs_ = ns;
+    }
+
+    // NUMA node of the sub-pool the object belongs to, -1 if none.
+    int getNode() const {
+        return node_;
+    }
+
+    void setNode(int node) {
+        node_ = node;
+    }
+
+    // Connect to the server, throwing a DPoolException, or calling
+    // failOpen(), if it failed.
     virtual void open() throw (DPoolException) = 0;
 
+    // open() without exceptions escaping, for the shards.
+    // @return - nullptr if the connection is open, else why it is not.
+    const DPoolException* tryOpen() {
+#if DPOOL_EXCEPTIONS
+        try {
+            open();
+        } catch (DPoolException& ex) {
+            openError_.reset(new DPoolException(ex));
+        }
+#else
+        open();
+#endif
+        return openError_.get();
+    }
+
+    // Read/write timeout of the current borrow, in milliseconds
+    int getDataTimeout() const {
+        return currentDataTimeout_;
+    }
+
+    // Bound the read/write timeout of the current borrow by @ms, e.g. the
+    // time left before the deadline of the request, -1 for the configured
+    // timeout. applyDataTimeout() is only called when the timeout changes.
+    void limitDataTimeout(int ms) {
+        int timeout = ms >= 0 && ms < dataTimeout_ ? ms : dataTimeout_;
+        if (timeout != currentDataTimeout_) {
+            currentDataTimeout_ = timeout;
+            applyDataTimeout(timeout);
+        }
+    }
+
+    // Socket of the open connection, for a ConnectionBroker to lend it, -1
+    // if it has none.
+    virtual int getFd() const {
+        return -1;
+    }
+
     const InetSocketAddress& getServerAddr() const {
         return serverAddr_;
     }
 
+  protected:
+    // Set the read/write timeout of the open connection to the given
+    // milliseconds, without reconnecting, e.g. with redisSetTimeout(). The
+    // default keeps the timeout set by open().
+    virtual void applyDataTimeout(int) {}
+
+    // Fail open() with @errmsg: throws if the library is built with
+    // exceptions, else open() must return right after.
+    void failOpen(const std::string& errmsg, const char* file, int line) {
+#if DPOOL_EXCEPTIONS
+        throw DPoolException(errmsg, file, line);
+#else
+        openError_.reset(new DPoolException(errmsg, file, line));
+#endif
+    }
+
   private:
     void* dataSource_;
+    void* pool_;
     bool borrowed_;
+    int64_t borrowTimeNs_;
+    int node_;
+    int currentDataTimeout_;
     std::mutex mtx_;
+    // Set by a failed open()
+    std::unique_ptr<DPoolException> openError_;
 
   protected:
     const dpool::InetSocketAddress serverAddr_;
@@ -68,18 +168,95 @@ class PooledObject {
     const int dataTimeout_;
 };
 
+// Priority of a borrow: the connections a shard reserves for the higher
+// priorities are off limits to the lower ones, and the waiters of the higher
+// priorities are woken up first, see PoolConfig::withReserve().
+enum Priority {
+    kPriorityCritical = 0,
+    kPriorityNormal,
+    kPriorityBulk,
+    kNumPriorities,
+};
+
 struct PoolConfig {
-    PoolConfig() : connTimeoutMs(100), dataTimeoutMs(100), maxIdle(10), maxActive(100), maxFails(5) {}
+    PoolConfig() : connTimeoutMs(100), dataTimeoutMs(100), maxIdle(10), maxActive(100), maxFails(5),
+                   adaptive(false), minIdle(0), minActive(1), reserveCritical(0), reserveNormal(0),
+                   maxWaitMs(0), minLocalHealthyPercent(0), minLocalHeadroomPercent(0) {}
 
     PoolConfig(int connTimeoutMs, int dataTimeoutMs, int maxIdle, int maxActive = 100, int maxFails = 5)
-        : connTimeoutMs(100), dataTimeoutMs(100), maxIdle(maxIdle),
-          maxActive(maxActive), maxFails(maxFails) {
+        : connTimeoutMs(connTimeoutMs), dataTimeoutMs(dataTimeoutMs), maxIdle(maxIdle),
+          maxActive(maxActive), maxFails(maxFails), adaptive(false), minIdle(0), minActive(1),
+          reserveCritical(0), reserveNormal(0), maxWaitMs(0), minLocalHealthyPercent(0),
+          minLocalHeadroomPercent(0) {
+    }
+
+    // The same configuration with adaptive sizing, see adaptive-limits.h:
+    // maxIdle and maxActive become upper bounds, and the effective limits of
+    // every shard follow its demand down to @minIdle and @minActive.
+    PoolConfig withAdaptiveLimits(int minIdle, int minActive = 1) const {
+        return PoolConfig(*this, true, minIdle, minActive, reserveCritical, reserveNormal, maxWaitMs);
+    }
+
+    // The same configuration with @critical connections of maxActive per
+    // shard reserved to kPriorityCritical borrows, and @normal more that
+    // kPriorityBulk borrows may not use either.
+    PoolConfig withReserve(int critical, int normal) const {
+        return PoolConfig(*this, adaptive, minIdle, minActive, critical, normal, maxWaitMs);
     }
+
+    // The same configuration where a shard get() at maxActive waits up to
+    // @ms for a connection to come back, instead of failing right away.
+    PoolConfig withMaxWait(int ms) const {
+        return PoolConfig(*this, adaptive, minIdle, minActive, reserveCritical, reserveNormal, ms);
+    }
+
+    // The same configuration where get() prefers the servers of zone @zone,
+    // see InetSocketAddress::zone, and spills over to the other zones when
+    // less than @minHealthyPercent of the local servers are available, or
+    // the borrowed connections leave less than @minHeadroomPercent of their
+    // maxActive, or none of them lends a connection. Set on the first
+    // bulkhead, for the whole pool.
+    PoolConfig withLocalZone(const std::string& zone, int minHealthyPercent = 50,
+                             int minHeadroomPercent = 10) const {
+        return PoolConfig(*this, zone, minHealthyPercent, minHeadroomPercent);
+    }
+
     const int maxIdle;
     const int maxActive;
     const int maxFails;
     const int connTimeoutMs;
     const int dataTimeoutMs;
+    const bool adaptive;
+    const int minIdle;
+    const int minActive;
+    const int reserveCritical;
+    const int reserveNormal;
+    const int maxWaitMs;
+    // Zone get() prefers, "" for none
+    const std::string localZone;
+    const int minLocalHealthyPercent;
+    const int minLocalHeadroomPercent;
+
+  private:
+    PoolConfig(const PoolConfig& other, bool adaptive, int minIdle, int minActive,
+               int reserveCritical, int reserveNormal, int maxWaitMs)
+        : maxIdle(other.maxIdle), maxActive(other.maxActive), maxFails(other.maxFails),
+          connTimeoutMs(other.connTimeoutMs), dataTimeoutMs(other.dataTimeoutMs),
+          adaptive(adaptive), minIdle(minIdle), minActive(minActive),
+          reserveCritical(reserveCritical), reserveNormal(reserveNormal), maxWaitMs(maxWaitMs),
+          localZone(other.localZone), minLocalHealthyPercent(other.minLocalHealthyPercent),
+          minLocalHeadroomPercent(other.minLocalHeadroomPercent) {
+    }
+
+    PoolConfig(const PoolConfig& other, const std::string& localZone, int minLocalHealthyPercent,
+               int minLocalHeadroomPercent)
+        : maxIdle(other.maxIdle), maxActive(other.maxActive), maxFails(other.maxFails),
+          connTimeoutMs(other.connTimeoutMs), dataTimeoutMs(other.dataTimeoutMs),
+          adaptive(other.adaptive), minIdle(other.minIdle), minActive(other.minActive),
+          reserveCritical(other.reserveCritical), reserveNormal(other.reserveNormal),
+          maxWaitMs(other.maxWaitMs), localZone(localZone), minLocalHealthyPercent(minLocalHealthyPercent),
+          minLocalHeadroomPercent(minLocalHeadroomPercent) {
+    }
 };
 
 struct PoolStats {
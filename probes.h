@@ -0,0 +1,49 @@
+#ifndef DPOOL_PROBES_H_
+#define DPOOL_PROBES_H_
+
+// USDT (systemtap style) static tracepoints of the pool, under the "dpool"
+// provider. Build with -DDPOOL_ENABLE_USDT (needs <sys/sdt.h>, e.g. from
+// systemtap-sdt-dev) to compile them in: an untraced probe is a single nop,
+// and tools like bpftrace can attach to a running process, e.g.
+//
+//   bpftrace -e 'usdt:./app:dpool:shard__get__start { @s[tid] = nsecs; }
+//                usdt:./app:dpool:shard__get__return /@s[tid]/ {
+//                    @borrow_ns = hist(nsecs - @s[tid]); delete(@s[tid]); }'
+//
+// Probes and their arguments:
+//
+//   shard__get__start      (shard)
+//   shard__lock__acquired  (shard)                 - lock wait since get start
+//   shard__get__return     (shard, result)         - result: 0 idle, 1 dialed, -1 failed
+//   shard__dial__start     (shard, active)
+//   shard__dial__done      (shard, ok)
+//   shard__wait__timeout   (shard, active)
+//   shard__put             (shard, broken)
+//   shard__evict           (shard, idle)
+//   pool__get__return      (shard, tries)          - shard -1 if no connection
+//   pool__health__check    (shard, ok)
+//   pool__shard__state     (shard, available, numAvailable)
+
+#ifdef DPOOL_ENABLE_USDT
+
+#if defined(__has_include)
+#if !__has_include(<sys/sdt.h>)
+#error "DPOOL_ENABLE_USDT needs <sys/sdt.h>, install systemtap-sdt-dev"
+#endif
+#endif
+
+#include <sys/sdt.h>
+
+#define DPOOL_PROBE1(name, a)       DTRACE_PROBE1(dpool, name, a)
+#define DPOOL_PROBE2(name, a, b)    DTRACE_PROBE2(dpool, name, a, b)
+#define DPOOL_PROBE3(name, a, b, c) DTRACE_PROBE3(dpool, name, a, b, c)
+
+#else
+
+#define DPOOL_PROBE1(name, a)       do {} while (0)
+#define DPOOL_PROBE2(name, a, b)    do {} while (0)
+#define DPOOL_PROBE3(name, a, b, c) do {} while (0)
+
+#endif // DPOOL_ENABLE_USDT
+
+#endif // DPOOL_PROBES_H_
@@ -0,0 +1,146 @@
+#ifndef DPOOL_REPLICATED_POOL_H_
+#define DPOOL_REPLICATED_POOL_H_
+
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <vector>
+
+#include "dpool.h"
+
+namespace dpool {
+
+// A logical shard: a primary and its replicas.
+struct ReplicaSet {
+    ReplicaSet(const InetSocketAddress& primary, const std::vector<InetSocketAddress>& replicas)
+        : primary(primary), replicas(replicas) {}
+
+    InetSocketAddress primary;
+    std::vector<InetSocketAddress> replicas;
+};
+
+// What a borrow from a ReplicatedPool is for.
+enum Access {
+    kRead,
+    kWrite,
+};
+
+// ReplicatedPool routes the borrows of logical shards, each a primary and
+// its replicas, over one DPool of all their servers, which one health
+// checker watches: writes go to the primary, and reads round robin over the
+// available replicas, and the primary too with @readFromPrimary. Reads fail
+// over to the primary when no replica lends a connection. Replicas whose
+// recent dials failed are passed over too, as the DPool keeps up to 2/3 of
+// its servers available whatever their health, see DPool::isSuspect().
+template <typename T, typename Pool = DPool<T>>
+class ReplicatedPool {
+  public:
+    typedef typename Pool::Clock Clock;
+
+    // Keeps the alignment of its pool and of rr_ when allocated with new.
+    DPOOL_ALIGNED_NEW(ReplicatedPool)
+
+    ReplicatedPool(const std::vector<ReplicaSet>& shards, PoolConfig config, bool readFromPrimary = false)
+        : pool_(servers(shards), config), readFromPrimary_(readFromPrimary), rr_(0) {
+        // The servers of every shard follow those of the previous one,
+        // primary first.
+        size_t first = 0;
+        for (auto it = shards.begin(); it != shards.end(); it++) {
+            first_.push_back(first);
+            first += 1 + it->replicas.size();
+        }
+        first_.push_back(first);
+    }
+
+    ReplicatedPool(const ReplicatedPool&) = delete;
+    ReplicatedPool& operator=(const ReplicatedPool&) = delete;    // noncopyable
+
+    // Borrow a connection of logical shard @shard for @access.
+    std::shared_ptr<T> get(size_t shard, Access access, Priority priority = kPriorityNormal)
+            throw (DPoolException) {
+        return get(shard, access, Clock::time_point::max(), priority);
+    }
+
+    std::shared_ptr<T> get(size_t shard, Access access, typename Clock::time_point deadline,
+                           Priority priority = kPriorityNormal) throw (DPoolException) {
+        std::shared_ptr<T> pc;
+        GetStatus status = tryGet(pc, shard, access, deadline, priority);
+        if (status == kGetTimedOut) {
+            DPOOL_THROW("deadline exceeded before getting a connection");
+        } else if (status != kGetOk) {
+            DPOOL_THROW("failed to get connection of shard " + std::to_string(shard));
+        }
+        return pc;
+    }
+
+    // The get() above, failing with a status, see DPool::tryGet().
+    GetStatus tryGet(std::shared_ptr<T>& pc, size_t shard, Access access,
+                     typename Clock::time_point deadline = Clock::time_point::max(),
+                     Priority priority = kPriorityNormal) {
+        assert(shard < numShards());
+        size_t primary = first_[shard];
+        if (access == kWrite) {
+            return pool_.tryGetFrom(pc, primary, Bulkhead(), deadline, priority);
+        }
+        size_t begin = readFromPrimary_ ? primary : primary + 1;
+        size_t n = first_[shard + 1] - begin;
+        GetStatus status = kGetUnavailable;
+        if (n > 0) {
+            size_t start = rr_.fetch_add(1, std::memory_order_relaxed);
+            for (size_t i = 0; i < n; i++) {
+                size_t server = begin + (start + i) % n;
+                if (!pool_.isAvailable(server) || pool_.isSuspect(server)) {
+                    continue;
+                }
+                status = pool_.tryGetFrom(pc, server, Bulkhead(), deadline, priority);
+                if (status == kGetOk || status == kGetTimedOut || status == kGetClosed) {
+                    return status;
+                }
+            }
+        }
+        if (readFromPrimary_) {
+            return status;
+        }
+        // No replica lent a connection: fail over to the primary.
+        return pool_.tryGetFrom(pc, primary, Bulkhead(), deadline, priority);
+    }
+
+    void put(std::shared_ptr<T> pc, bool broken = false) {
+        pool_.put(pc, broken);
+    }
+
+    size_t numShards() const {
+        return first_.size() - 1;
+    }
+
+    // The pool of every server, for its statistics and settings: the
+    // servers of a shard follow those of the previous one, primary first.
+    Pool& pool() {
+        return pool_;
+    }
+
+  private:
+    static std::vector<InetSocketAddress> servers(const std::vector<ReplicaSet>& shards) {
+        std::vector<InetSocketAddress> list;
+        for (auto it = shards.begin(); it != shards.end(); it++) {
+            list.push_back(it->primary);
+            for (auto r = it->replicas.begin(); r != it->replicas.end(); r++) {
+                list.push_back(*r);
+            }
+        }
+        return list;
+    }
+
+    Pool pool_;
+    const bool readFromPrimary_;
+    // Index of the primary of every shard in the pool, and the number of
+    // servers last
+    std::vector<size_t> first_;
+
+    // Hot: picks the replica to read from, updated by every read
+    DPOOL_CACHE_ALIGNED std::atomic<size_t> rr_;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_REPLICATED_POOL_H_
@@ -0,0 +1,240 @@
+#ifndef DPOOL_SHARD_SET_H_
+#define DPOOL_SHARD_SET_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cache-line.h"
+
+namespace dpool {
+
+// ShardSet keeps the state DPool::get() selects shards by out of the shard
+// objects: dense availability and suspect bitmaps, and the number of
+// connections borrowed from every shard, each on a cache line of its own.
+// Scans of the bitmaps go 64 shards per word, so that picking the next
+// available shard of a large fleet costs a few instructions however many
+// shards are down.
+class ShardSet {
+  public:
+    static const int kNone = -1;
+
+    // Shards a scan goes over, see setLocal().
+    enum Zone {
+        kAnyZone,
+        kLocalZone,
+        kRemoteZone,
+    };
+
+    explicit ShardSet(size_t size)
+        : size_(size), numWords_((size + 63) / 64), numAvailable_(size), local_(numWords_, 0),
+          words_(numWords_ * 2), inflight_(size) {
+        for (size_t i = 0; i < numWords_; i++) {
+            // Every shard starts available, bits past the end stay clear.
+            words_.emplace_back(validBits(i));
+        }
+        for (size_t i = 0; i < numWords_; i++) {
+            words_.emplace_back(0);
+        }
+        for (size_t i = 0; i < size; i++) {
+            inflight_.emplace_back();
+        }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool isAvailable(size_t i) const {
+        return (available(i / 64).load(std::memory_order_relaxed) >> (i % 64)) & 1;
+    }
+
+    void setAvailable(size_t i, bool avail) {
+        if (setBit(available(i / 64), i % 64, avail)) {
+            numAvailable_.fetch_add(avail ? 1 : -1, std::memory_order_relaxed);
+        }
+    }
+
+    size_t numAvailable() const {
+        return numAvailable_.load(std::memory_order_relaxed);
+    }
+
+    // Available shards of @zone
+    size_t numAvailable(Zone zone) const {
+        if (zone == kAnyZone) {
+            return numAvailable();
+        }
+        size_t count = 0;
+        for (size_t w = 0; w < numWords_; w++) {
+            count += __builtin_popcountll(available(w).load(std::memory_order_relaxed) & zoneBits(w, zone));
+        }
+        return count;
+    }
+
+    // Put shard @i in the local zone, before the set is shared.
+    void setLocal(size_t i) {
+        local_[i / 64] |= 1ULL << (i % 64);
+    }
+
+    bool isLocal(size_t i) const {
+        return (local_[i / 64] >> (i % 64)) & 1;
+    }
+
+    // The @n-th available shard of @zone, counting from 0, so that a round
+    // robin over the available shards spreads the load of the unavailable
+    // ones evenly. kNone if there are not that many.
+    int nthAvailable(size_t n, Zone zone = kAnyZone) const {
+        for (size_t w = 0; w < numWords_; w++) {
+            uint64_t bits = available(w).load(std::memory_order_relaxed) & zoneBits(w, zone);
+            size_t count = __builtin_popcountll(bits);
+            if (n >= count) {
+                n -= count;
+                continue;
+            }
+            for (; n > 0; n--) {
+                bits &= bits - 1;
+            }
+            return w * 64 + __builtin_ctzll(bits);
+        }
+        return kNone;
+    }
+
+    bool isSuspect(size_t i) const {
+        return (suspect(i / 64).load(std::memory_order_relaxed) >> (i % 64)) & 1;
+    }
+
+    // Flag shard @i for the next health check round.
+    void setSuspect(size_t i, bool suspectable) {
+        if (isSuspect(i) != suspectable) {
+            setBit(suspect(i / 64), i % 64, suspectable);
+        }
+    }
+
+    // First available shard of @zone at or after @from, wrapping around,
+    // kNone if every shard of @zone is unavailable.
+    int nextAvailable(size_t from, Zone zone = kAnyZone) const {
+        size_t w = from / 64;
+        uint64_t bits = available(w).load(std::memory_order_relaxed) & zoneBits(w, zone) & (~0ULL << (from % 64));
+        // One more word than there are, to see the bits before @from last.
+        for (size_t n = 0; n <= numWords_; n++) {
+            if (bits != 0) {
+                return w * 64 + __builtin_ctzll(bits);
+            }
+            w = (w + 1) % numWords_;
+            bits = available(w).load(std::memory_order_relaxed) & zoneBits(w, zone);
+        }
+        return kNone;
+    }
+
+    // First shard at or after @from that is suspect or unavailable, without
+    // wrapping around, kNone if there is none.
+    int nextToCheck(size_t from) const {
+        for (size_t w = from / 64; w < numWords_; w++) {
+            uint64_t bits = suspect(w).load(std::memory_order_relaxed)
+                          | (~available(w).load(std::memory_order_relaxed) & validBits(w));
+            if (w == from / 64) {
+                bits &= ~0ULL << (from % 64);
+            }
+            if (bits != 0) {
+                return w * 64 + __builtin_ctzll(bits);
+            }
+        }
+        return kNone;
+    }
+
+    // The least loaded of the first @window available shards of @zone at or
+    // after @from, kNone if every shard of @zone is unavailable.
+    int leastLoaded(size_t from, int window, Zone zone = kAnyZone) const {
+        int best = nextAvailable(from, zone);
+        if (best == kNone) {
+            return kNone;
+        }
+        int32_t bestLoad = inflight_[best].n.load(std::memory_order_relaxed);
+        int idx = best;
+        for (int i = 1; i < window && bestLoad > 0; i++) {
+            idx = nextAvailable((idx + 1) % size_, zone);
+            if (idx == best) {
+                break;
+            }
+            int32_t load = inflight_[idx].n.load(std::memory_order_relaxed);
+            if (load < bestLoad) {
+                best = idx;
+                bestLoad = load;
+            }
+        }
+        return best;
+    }
+
+    // Count the borrowed connections of shard @i.
+    void onBorrow(size_t i) {
+        inflight_[i].n.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void onReturn(size_t i) {
+        inflight_[i].n.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    int32_t inflight(size_t i) const {
+        return inflight_[i].n.load(std::memory_order_relaxed);
+    }
+
+  private:
+    // Borrowed connections of a shard, alone on its cache line: every borrow
+    // and return writes it.
+    struct DPOOL_CACHE_ALIGNED Inflight {
+        Inflight() : n(0) {}
+
+        std::atomic<int32_t> n;
+    };
+
+    std::atomic<uint64_t>& available(size_t w) {
+        return words_[w];
+    }
+
+    const std::atomic<uint64_t>& available(size_t w) const {
+        return words_[w];
+    }
+
+    std::atomic<uint64_t>& suspect(size_t w) {
+        return words_[numWords_ + w];
+    }
+
+    const std::atomic<uint64_t>& suspect(size_t w) const {
+        return words_[numWords_ + w];
+    }
+
+    uint64_t zoneBits(size_t w, Zone zone) const {
+        return zone == kAnyZone ? ~0ULL : zone == kLocalZone ? local_[w] : ~local_[w];
+    }
+
+    uint64_t validBits(size_t w) const {
+        return (w + 1) * 64 <= size_ ? ~0ULL : (1ULL << (size_ % 64)) - 1;
+    }
+
+    // @return - true if the bit changed.
+    static bool setBit(std::atomic<uint64_t>& word, unsigned bit, bool value) {
+        uint64_t mask = 1ULL << bit;
+        uint64_t old = value ? word.fetch_or(mask, std::memory_order_relaxed)
+                             : word.fetch_and(~mask, std::memory_order_relaxed);
+        return ((old & mask) != 0) != value;
+    }
+
+    const size_t size_;
+    const size_t numWords_;
+
+    std::atomic<size_t> numAvailable_;
+
+    // Local zone words, set before the set is shared
+    std::vector<uint64_t> local_;
+
+    // Availability words, then suspect words
+    AlignedArray<std::atomic<uint64_t>> words_;
+
+    // Connections borrowed from every shard
+    AlignedArray<Inflight> inflight_;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_SHARD_SET_H_
@@ -0,0 +1,334 @@
+#ifndef DPOOL_SHM_COORDINATOR_H_
+#define DPOOL_SHM_COORDINATOR_H_
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dpool-exception.h"
+#include "pooled-object.h"
+
+namespace dpool {
+
+// Layout of the coordination segment: the header, @maxServers
+// ShmServerSlot, @maxProcesses ShmProcessSlot, then the connections every
+// process holds to every server, as int32_t[maxProcesses][maxServers].
+struct ShmCoordinatorHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t maxServers;
+    uint32_t maxProcesses;
+    // Connections to a server allowed across processes
+    int32_t quota;
+    // Process running the health checks, 0 if none, and the end of its
+    // lease in milliseconds of the monotonic clock, shared by the host.
+    std::atomic<int32_t> leaderPid;
+    std::atomic<int64_t> leaseUntilMs;
+};
+
+struct ShmServerSlot {
+    // kFree, kClaiming, then kReady once server is written
+    std::atomic<uint32_t> state;
+    char server[64];
+    // Connections open across processes
+    std::atomic<int32_t> active;
+    // Published by the leader
+    std::atomic<uint32_t> available;
+    // Set by the followers, for the leader to check the server
+    std::atomic<uint32_t> suspect;
+};
+
+struct ShmProcessSlot {
+    // 0 if free, -1 while the connections of a dead process are released
+    std::atomic<int32_t> pid;
+};
+
+static const char kShmCoordinatorMagic[8] = {'D', 'P', 'C', 'O', 'O', 'R', 'D', '1'};
+
+// ShmCoordinator lets the pools of processes on one host, e.g. pre-forked
+// workers, share a POSIX shared memory segment, so that the connections and
+// health checks a server gets scale with hosts rather than processes:
+//
+// - Every server has a quota of connections across processes, taken by the
+//   dials of the pools and given back when connections close. The
+//   connections of a process that died without closing them are given back
+//   by the next sweep().
+// - One process at a time, the leader, runs the health checks of the pools
+//   and publishes the availability of servers, which the other processes
+//   apply without probing, see DPool::runHealthCheck(). The leader holds a
+//   lease renewed every round, taken over when it expires or the leader
+//   dies.
+//
+// Every process opens the segment with the same parameters, after fork():
+// the handle belongs to the process that created it. The pools attached to
+// it must be destroyed before it is. The segment outlives the processes, see
+// unlink().
+class ShmCoordinator {
+  public:
+    static const int64_t kLeaseMs = 3000;
+
+    ShmCoordinator(const std::string& name, int32_t quota, uint32_t maxServers = 256,
+                   uint32_t maxProcesses = 256)
+        : name_(name), pid_(::getpid()), kMaxServers_(maxServers), kMaxProcesses_(maxProcesses),
+          header_(nullptr), size_(0) {
+        size_ = sizeof(ShmCoordinatorHeader) + maxServers * sizeof(ShmServerSlot)
+              + maxProcesses * sizeof(ShmProcessSlot) + maxProcesses * maxServers * sizeof(std::atomic<int32_t>);
+        bool created = true;
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0 && errno == EEXIST) {
+            created = false;
+            fd = ::shm_open(name.c_str(), O_RDWR, 0);
+        }
+        if (fd < 0) {
+            DPOOL_THROW("failed to open shared memory " + name);
+        }
+        bool sized = created ? ::ftruncate(fd, size_) == 0 : waitForSize(fd);
+        void* addr = sized ? ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            if (created) {
+                ::shm_unlink(name.c_str());
+            }
+            DPOOL_THROW("failed to map shared memory " + name);
+        }
+        header_ = static_cast<ShmCoordinatorHeader*>(addr);
+        servers_ = reinterpret_cast<ShmServerSlot*>(header_ + 1);
+        processes_ = reinterpret_cast<ShmProcessSlot*>(servers_ + maxServers);
+        counts_ = reinterpret_cast<std::atomic<int32_t>*>(processes_ + maxProcesses);
+
+        if (created) {
+            // ftruncate() zeroed the slots: free, and no connection.
+            header_->version = 1;
+            header_->maxServers = maxServers;
+            header_->maxProcesses = maxProcesses;
+            header_->quota = quota;
+            header_->leaderPid.store(0, std::memory_order_relaxed);
+            header_->leaseUntilMs.store(0, std::memory_order_relaxed);
+            // The magic goes last, the other processes wait for it.
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(header_->magic, kShmCoordinatorMagic, sizeof(kShmCoordinatorMagic));
+        } else if (!waitForMagic() || header_->maxServers != maxServers
+                || header_->maxProcesses != maxProcesses) {
+            ::munmap(header_, size_);
+            DPOOL_THROW("incompatible shared memory " + name);
+        }
+        process_ = claimProcess();
+        if (process_ < 0) {
+            sweep();
+            process_ = claimProcess();
+        }
+        if (process_ < 0) {
+            ::munmap(header_, size_);
+            DPOOL_THROW("no process slot left in shared memory " + name);
+        }
+    }
+
+    ShmCoordinator(const ShmCoordinator&) = delete;
+    ShmCoordinator& operator=(const ShmCoordinator&) = delete;    // noncopyable
+
+    ~ShmCoordinator() {
+        int32_t self = pid_;
+        header_->leaderPid.compare_exchange_strong(self, 0);
+        releaseProcess(process_);
+        ::munmap(header_, size_);
+    }
+
+    // Remove the segment, for the processes to come. Those attached keep it.
+    static void unlink(const std::string& name) {
+        ::shm_unlink(name.c_str());
+    }
+
+    // Slot of @addr, shared by every process, -1 if there is none left.
+    int server(const InetSocketAddress& addr) {
+        std::string name = addr.to_string();
+        if (name.size() >= sizeof(servers_[0].server)) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < kMaxServers_; i++) {
+            ShmServerSlot& slot = servers_[i];
+            uint32_t state = slot.state.load(std::memory_order_acquire);
+            if (state == kFree && slot.state.compare_exchange_strong(state, kClaiming)) {
+                strncpy(slot.server, name.c_str(), sizeof(slot.server) - 1);
+                slot.available.store(1, std::memory_order_relaxed);
+                slot.state.store(kReady, std::memory_order_release);
+                return i;
+            }
+            while (state == kClaiming) {
+                std::this_thread::yield();
+                state = slot.state.load(std::memory_order_acquire);
+            }
+            if (strncmp(slot.server, name.c_str(), sizeof(slot.server)) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Take a connection of the quota of server @slot.
+    // @return - false if the processes hold the whole quota
+    bool acquire(int slot) {
+        std::atomic<int32_t>& active = servers_[slot].active;
+        int32_t n = active.load(std::memory_order_relaxed);
+        do {
+            if (n >= header_->quota) {
+                return false;
+            }
+        } while (!active.compare_exchange_weak(n, n + 1, std::memory_order_relaxed));
+        count(process_, slot).fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void release(int slot) {
+        count(process_, slot).fetch_sub(1, std::memory_order_relaxed);
+        servers_[slot].active.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Connections to server @slot open across processes
+    int32_t active(int slot) const {
+        return servers_[slot].active.load(std::memory_order_relaxed);
+    }
+
+    // Take or renew the lease of the health checker, once per round.
+    // @return - true if this process is the leader until the next round
+    bool lead() {
+        int64_t now = nowMs();
+        int32_t leader = header_->leaderPid.load(std::memory_order_acquire);
+        if (leader != pid_) {
+            if (leader != 0 && now < header_->leaseUntilMs.load(std::memory_order_relaxed) && isAlive(leader)) {
+                return false;
+            }
+            if (!header_->leaderPid.compare_exchange_strong(leader, pid_)) {
+                return false;
+            }
+        }
+        header_->leaseUntilMs.store(now + kLeaseMs, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool isLeader() const {
+        return header_->leaderPid.load(std::memory_order_relaxed) == pid_;
+    }
+
+    // Availability of server @slot as last published, true until then.
+    bool isAvailable(int slot) const {
+        return servers_[slot].available.load(std::memory_order_relaxed) != 0;
+    }
+
+    // Publish the result of a health check of server @slot, by the leader.
+    void publish(int slot, bool available) {
+        servers_[slot].available.store(available, std::memory_order_relaxed);
+        servers_[slot].suspect.store(0, std::memory_order_relaxed);
+    }
+
+    // Ask the leader to check server @slot in its next round.
+    void reportSuspect(int slot) {
+        if (servers_[slot].suspect.load(std::memory_order_relaxed) == 0) {
+            servers_[slot].suspect.store(1, std::memory_order_relaxed);
+        }
+    }
+
+    bool isSuspect(int slot) const {
+        return servers_[slot].suspect.load(std::memory_order_relaxed) != 0;
+    }
+
+    // Give back the quota held by the processes that died.
+    void sweep() {
+        for (uint32_t p = 0; p < kMaxProcesses_; p++) {
+            int32_t pid = processes_[p].pid.load(std::memory_order_relaxed);
+            if (pid > 0 && !isAlive(pid) && processes_[p].pid.compare_exchange_strong(pid, -1)) {
+                releaseProcess(p);
+            }
+        }
+    }
+
+  private:
+    static const uint32_t kFree = 0;
+    static const uint32_t kClaiming = 1;
+    static const uint32_t kReady = 2;
+
+    static int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool isAlive(int32_t pid) {
+        return ::kill(pid, 0) == 0 || errno == EPERM;
+    }
+
+    std::atomic<int32_t>& count(int process, int slot) {
+        return counts_[process * kMaxServers_ + slot];
+    }
+
+    int claimProcess() {
+        for (uint32_t p = 0; p < kMaxProcesses_; p++) {
+            int32_t free = 0;
+            if (processes_[p].pid.compare_exchange_strong(free, pid_)) {
+                return p;
+            }
+        }
+        return -1;
+    }
+
+    // Give back what process slot @p holds, and free it.
+    void releaseProcess(int p) {
+        for (uint32_t s = 0; s < kMaxServers_; s++) {
+            int32_t n = count(p, s).exchange(0, std::memory_order_relaxed);
+            if (n != 0) {
+                servers_[s].active.fetch_sub(n, std::memory_order_relaxed);
+            }
+        }
+        processes_[p].pid.store(0, std::memory_order_release);
+    }
+
+    // The creator of the segment may not have sized it yet.
+    bool waitForSize(int fd) {
+        struct stat st;
+        for (int tries = 0; tries < 1000; tries++) {
+            if (::fstat(fd, &st) != 0) {
+                return false;
+            }
+            if (st.st_size >= (off_t)size_) {
+                return st.st_size == (off_t)size_;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return false;
+    }
+
+    bool waitForMagic() {
+        for (int tries = 0; tries < 1000; tries++) {
+            if (memcmp(header_->magic, kShmCoordinatorMagic, sizeof(kShmCoordinatorMagic)) == 0) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return false;
+    }
+
+    const std::string name_;
+    const int32_t pid_;
+    const uint32_t kMaxServers_;
+    const uint32_t kMaxProcesses_;
+    ShmCoordinatorHeader* header_;
+    size_t size_;
+    ShmServerSlot* servers_;
+    ShmProcessSlot* processes_;
+    std::atomic<int32_t>* counts_;
+    // Slot of this process
+    int process_;
+};
+
+} // namespace dpool
+
+#endif // DPOOL_SHM_COORDINATOR_H_
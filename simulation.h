@@ -0,0 +1,599 @@
+#ifndef DPOOL_SIMULATION_H_
+#define DPOOL_SIMULATION_H_
+
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include <ostream>
+
+#include "dpool-exception.h"
+#include "pooled-object.h"
+#include "clock.h"
+#include "trace.h"
+#include "cluster.h"
+
+namespace dpool {
+
+// Deterministic PRNG (splitmix64), so that a simulation run is reproducible
+// from its seed.
+class SimRandom {
+  public:
+    explicit SimRandom(uint64_t seed = 0) : state_(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state_ += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform double in (0, 1]
+    double uniform() {
+        return ((next() >> 11) + 1) * (1.0 / 9007199254740992.0);
+    }
+
+    // Exponentially distributed sample with the given mean
+    double exponential(double mean) {
+        return -std::log(uniform()) * mean;
+    }
+
+  private:
+    uint64_t state_;
+};
+
+// Simulated state of one backend server.
+struct SimServer {
+    SimServer() : up(true), dialLatencyUs(500), dialFailRate(0.0), callFailRate(0.0),
+                  numDial(0), numDialFail(0), numCall(0), numCallFail(0), numOpen(0), maxOpen(0) {
+    }
+
+    bool up;
+    int dialLatencyUs;
+    double dialFailRate;
+    double callFailRate;
+
+    long numDial;
+    long numDialFail;
+    long numCall;
+    long numCallFail;
+    int  numOpen;
+    int  maxOpen;
+};
+
+// SimBackend is the process wide registry of simulated servers, consulted by
+// SimPooledObject. It is locked, so that a pool on SystemClock can dial from
+// its health checker thread; the counters of server() are to be read once the
+// pools are idle, and random() is for the single threaded driver.
+class SimBackend {
+  public:
+    static SimBackend& instance() {
+        static SimBackend backend;
+        return backend;
+    }
+
+    void reset(uint64_t seed) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        servers_.clear();
+        random_ = SimRandom(seed);
+        realTime_ = false;
+    }
+
+    // Make a dial take its time on the wall clock, for pools on SystemClock,
+    // rather than on SimClock. Until the next reset().
+    void setRealTime(bool realTime) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        realTime_ = realTime;
+    }
+
+    SimServer& server(const InetSocketAddress& addr) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        return servers_[addr.to_string()];
+    }
+
+    void setUp(const InetSocketAddress& addr, bool up) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        servers_[addr.to_string()].up = up;
+    }
+
+    // @return - true if a connection was established
+    bool dial(const InetSocketAddress& addr, int connTimeoutMs) {
+        std::unique_lock<std::mutex> lck(mtx_);
+        SimServer& s = servers_[addr.to_string()];
+        const bool realTime = realTime_;
+        s.numDial++;
+        if (!s.up) {
+            // A dead server makes the dialer wait for the whole connect timeout.
+            s.numDialFail++;
+            lck.unlock();
+            sleepFor(realTime, std::chrono::milliseconds(connTimeoutMs));
+            return false;
+        }
+        std::chrono::microseconds latency(s.dialLatencyUs);
+        bool ok = s.dialFailRate <= 0 || random_.uniform() > s.dialFailRate;
+        if (!ok) {
+            s.numDialFail++;
+        } else if (++s.numOpen > s.maxOpen) {
+            s.maxOpen = s.numOpen;
+        }
+        lck.unlock();
+        sleepFor(realTime, latency);
+        return ok;
+    }
+
+    // @return - true if a request over an established connection succeeded
+    bool call(const InetSocketAddress& addr) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        SimServer& s = servers_[addr.to_string()];
+        s.numCall++;
+        if (!s.up || (s.callFailRate > 0 && random_.uniform() <= s.callFailRate)) {
+            s.numCallFail++;
+            return false;
+        }
+        return true;
+    }
+
+    void close(const InetSocketAddress& addr) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        servers_[addr.to_string()].numOpen--;
+    }
+
+    SimRandom& random() {
+        return random_;
+    }
+
+  private:
+    SimBackend() : realTime_(false) {}
+
+    template <typename Duration>
+    static void sleepFor(bool realTime, Duration d) {
+        if (realTime) {
+            std::this_thread::sleep_for(d);
+        } else {
+            SimClock::sleepFor(d);
+        }
+    }
+
+    std::mutex mtx_;
+    std::map<std::string, SimServer> servers_;
+    SimRandom random_;
+    bool realTime_;
+};
+
+// PooledObject talking to a SimBackend server instead of the network.
+class SimPooledObject : public PooledObject {
+  public:
+    SimPooledObject(const InetSocketAddress& addr, const int connTimeout, const int dataTimeout)
+      : PooledObject(addr, connTimeout, dataTimeout), opened_(false) {
+    }
+
+    virtual ~SimPooledObject() {
+        if (opened_) {
+            SimBackend::instance().close(serverAddr_);
+        }
+    }
+
+    virtual void open() throw (DPoolException) override {
+        if (!SimBackend::instance().dial(serverAddr_, connTimeout_)) {
+            failOpen("failed to connect simulated server " + serverAddr_.to_string(), __FILE__, __LINE__);
+            return;
+        }
+        opened_ = true;
+    }
+
+    // Simulate one request on this connection.
+    // @return - false if the connection should be returned as broken
+    bool call() {
+        return SimBackend::instance().call(serverAddr_);
+    }
+
+  private:
+    bool opened_;
+};
+
+// SimCluster stands in for the nodes of a Redis Cluster: reply() answers a
+// command on a key as the node it is sent to would, with a MOVED or an ASK
+// error unless the node serves the slot of the key. A slot moves with
+// migrate(), during which its owner answers ASK, then assign().
+class SimCluster {
+  public:
+    SimCluster() : owners_(kClusterSlots, -1), importing_(kClusterSlots, -1) {}
+
+    // Serve slots @first to @last from @node, ending their migration.
+    void assign(int first, int last, const InetSocketAddress& node) {
+        int n = index(node);
+        for (int slot = first; slot <= last; slot++) {
+            owners_[slot] = n;
+            importing_[slot] = -1;
+        }
+    }
+
+    // Start moving @slot to @node.
+    void migrate(int slot, const InetSocketAddress& node) {
+        importing_[slot] = index(node);
+    }
+
+    // Reply of @node to a command on @key, "" if it serves it. @asking if
+    // the command follows ASKING.
+    std::string reply(const InetSocketAddress& node, const std::string& key, bool asking = false) const {
+        int slot = keyHashSlot(key);
+        int owner = owners_[slot];
+        int target = importing_[slot];
+        std::string self = node.to_string();
+        if (owner < 0) {
+            return "CLUSTERDOWN Hash slot not served";
+        }
+        if (target >= 0 && asking && nodes_[target].to_string() == self) {
+            return "";
+        }
+        if (nodes_[owner].to_string() == self) {
+            return target >= 0 ? "ASK " + std::to_string(slot) + " " + nodes_[target].to_string() : "";
+        }
+        return "MOVED " + std::to_string(slot) + " " + nodes_[owner].to_string();
+    }
+
+    // The slot map, as listed by CLUSTER SLOTS
+    std::vector<ClusterSlotRange> slots() const {
+        std::vector<ClusterSlotRange> ranges;
+        for (int first = 0; first < kClusterSlots; ) {
+            int last = first;
+            while (last + 1 < kClusterSlots && owners_[last + 1] == owners_[first]) {
+                last++;
+            }
+            if (owners_[first] >= 0) {
+                ranges.push_back(ClusterSlotRange(first, last, nodes_[owners_[first]]));
+            }
+            first = last + 1;
+        }
+        return ranges;
+    }
+
+  private:
+    int index(const InetSocketAddress& node) {
+        for (size_t i = 0; i < nodes_.size(); i++) {
+            if (nodes_[i].to_string() == node.to_string()) {
+                return i;
+            }
+        }
+        nodes_.push_back(node);
+        return nodes_.size() - 1;
+    }
+
+    std::vector<InetSocketAddress> nodes_;
+    std::vector<int> owners_;
+    std::vector<int> importing_;
+};
+
+// Scripted change of a server's state during a simulation.
+struct SimEvent {
+    SimEvent(long atMs, const InetSocketAddress& server, bool up)
+        : atMs(atMs), server(server), up(up) {
+    }
+
+    long atMs;
+    InetSocketAddress server;
+    bool up;
+};
+
+struct SimScenario {
+    SimScenario() : seed(1), durationMs(3600 * 1000L), requestsPerSec(1000),
+                    meanHoldUs(2000), healthCheckIntervalMs(1000), tracer(nullptr) {
+    }
+
+    std::vector<InetSocketAddress> servers;
+    std::vector<SimEvent> events;
+    uint64_t seed;
+    long durationMs;
+    double requestsPerSec;
+    double meanHoldUs;
+    int healthCheckIntervalMs;
+    // Optional recorder of the simulated traffic
+    TraceRecorder* tracer;
+};
+
+struct SimResult {
+    SimResult() : numRequest(0), numBorrow(0), numGetFail(0), numBroken(0), totalGetUs(0) {}
+
+    bool operator==(const SimResult& other) const {
+        return numRequest == other.numRequest && numBorrow == other.numBorrow
+            && numGetFail == other.numGetFail && numBroken == other.numBroken
+            && totalGetUs == other.totalGetUs
+            && borrows == other.borrows && dials == other.dials && maxOpen == other.maxOpen;
+    }
+
+    bool operator!=(const SimResult& other) const {
+        return !(*this == other);
+    }
+
+    void dump(std::ostream& out) const {
+        out << "requests: " << numRequest << ", borrowed: " << numBorrow
+            << ", get failed: " << numGetFail << ", broken: " << numBroken
+            << ", avg get: " << (numRequest > 0 ? totalGetUs / numRequest : 0) << "us" << std::endl;
+        for (auto it = borrows.begin(); it != borrows.end(); it++) {
+            out << "  " << it->first << " borrows: " << it->second
+                << ", dials: " << dials.at(it->first)
+                << ", max open: " << maxOpen.at(it->first) << std::endl;
+        }
+    }
+
+    long numRequest;
+    long numBorrow;
+    long numGetFail;
+    long numBroken;
+    // Virtual time spent in DPool::get(), successful or not
+    long totalGetUs;
+    std::map<std::string, long> borrows;
+    std::map<std::string, long> dials;
+    std::map<std::string, int> maxOpen;
+};
+
+// Charge the time spent in a blocking call to the caller only, see simulate().
+// Nothing to do when time flows by itself.
+inline void simRewind(SimClock*, SimClock::time_point t) {
+    SimClock::set(t);
+}
+
+inline void simRewind(SystemClock*, SystemClock::time_point) {
+}
+
+// Fill the per server figures of @result from the backend.
+inline void simCollect(const std::vector<InetSocketAddress>& servers, SimResult& result) {
+    SimBackend& backend = SimBackend::instance();
+    for (auto it = servers.begin(); it != servers.end(); it++) {
+        const SimServer& s = backend.server(*it);
+        result.borrows[it->to_string()] += 0;
+        result.dials[it->to_string()] = s.numDial;
+        result.maxOpen[it->to_string()] = s.maxOpen;
+    }
+}
+
+// Drive a pool of SimPooledObject on SimClock through a scenario: Poisson
+// arrivals with exponential hold times, scripted server failures & recoveries
+// and periodic health checks. Each request behaves as if it ran on a thread of
+// its own: the time it spends blocked in DPool::get() (e.g. dialing a dead
+// server) delays its own release, but not the other arrivals. Two runs of the
+// same scenario yield the same SimResult, so pool policies can be compared
+// against each other.
+template <typename Pool>
+SimResult simulate(const SimScenario& scenario, const PoolConfig& config) {
+    typedef std::chrono::microseconds us;
+    typedef std::shared_ptr<SimPooledObject> Conn;
+
+    struct Release {
+        SimClock::time_point at;
+        long seq;
+        Conn conn;
+        bool broken;
+
+        bool operator>(const Release& other) const {
+            return at != other.at ? at > other.at : seq > other.seq;
+        }
+    };
+
+    SimClock::reset();
+    SimBackend& backend = SimBackend::instance();
+    backend.reset(scenario.seed);
+    for (auto it = scenario.servers.begin(); it != scenario.servers.end(); it++) {
+        backend.server(*it);
+    }
+
+    SimResult result;
+    {
+        Pool pool(scenario.servers, config);
+        pool.setTraceRecorder(scenario.tracer);
+        std::priority_queue<Release, std::vector<Release>, std::greater<Release> > releases;
+        long seq = 0;
+        size_t nextEvent = 0;
+
+        const SimClock::time_point end = SimClock::time_point(std::chrono::milliseconds(scenario.durationMs));
+        const us meanInterArrival(static_cast<long>(1e6 / scenario.requestsPerSec));
+        SimClock::time_point nextArrival = SimClock::now();
+        SimClock::time_point nextHealthCheck = SimClock::now()
+                + std::chrono::milliseconds(scenario.healthCheckIntervalMs);
+
+        while (true) {
+            // Pick the earliest pending action; ties are broken in a fixed order.
+            SimClock::time_point t = nextArrival;
+            int action = 0;
+            if (nextHealthCheck < t) {
+                t = nextHealthCheck;
+                action = 1;
+            }
+            if (nextEvent < scenario.events.size()) {
+                SimClock::time_point at(std::chrono::milliseconds(scenario.events[nextEvent].atMs));
+                if (at < t) {
+                    t = at;
+                    action = 2;
+                }
+            }
+            if (!releases.empty() && releases.top().at < t) {
+                t = releases.top().at;
+                action = 3;
+            }
+            if (t >= end) {
+                break;
+            }
+            SimClock::advanceTo(t);
+
+            if (action == 0) {
+                result.numRequest++;
+                nextArrival = t + us(static_cast<long>(
+                        backend.random().exponential(static_cast<double>(meanInterArrival.count()))));
+                Conn c;
+                if (pool.tryGet(c) != kGetOk) {
+                    result.numGetFail++;
+                    result.totalGetUs += std::chrono::duration_cast<us>(SimClock::now() - t).count();
+                    SimClock::set(t);
+                    continue;
+                }
+                result.numBorrow++;
+                result.totalGetUs += std::chrono::duration_cast<us>(SimClock::now() - t).count();
+                result.borrows[c->getServerAddr().to_string()]++;
+                bool broken = !c->call();
+                SimClock::time_point at = SimClock::now()
+                        + us(static_cast<long>(backend.random().exponential(scenario.meanHoldUs)));
+                SimClock::set(t);
+                releases.push(Release{at, seq++, c, broken});
+            } else if (action == 1) {
+                pool.runHealthCheck();
+                SimClock::set(t);
+                nextHealthCheck = t + std::chrono::milliseconds(scenario.healthCheckIntervalMs);
+            } else if (action == 2) {
+                const SimEvent& ev = scenario.events[nextEvent++];
+                backend.setUp(ev.server, ev.up);
+            } else {
+                Release r = releases.top();
+                releases.pop();
+                if (r.broken) {
+                    result.numBroken++;
+                }
+                pool.put(r.conn, r.broken);
+            }
+        }
+
+        while (!releases.empty()) {
+            Release r = releases.top();
+            releases.pop();
+            pool.put(r.conn, r.broken);
+        }
+        pool.setTraceRecorder(nullptr);
+    }
+
+    simCollect(scenario.servers, result);
+    return result;
+}
+
+// A borrow to replay: when, for how long, and how it ended.
+struct ReplayRequest {
+    uint64_t atNs;
+    uint32_t holdUs;
+    bool broken;
+};
+
+// Turn trace records into borrows: every get of the trace, failed or not,
+// becomes a borrow, held for the duration recorded by the put of the same
+// object.
+inline void toReplayRequests(const std::vector<TraceRecord>& records, std::vector<ReplayRequest>& requests) {
+    std::map<uint32_t, size_t> pending;   // borrowed object -> its get
+    requests.clear();
+    for (auto it = records.begin(); it != records.end(); it++) {
+        if (it->op == TraceRecord::kGet) {
+            requests.push_back(ReplayRequest{it->timestampNs, 0, false});
+            if (!(it->flags & TraceRecord::kFailed)) {
+                pending[it->conn] = requests.size() - 1;
+            }
+        } else if (it->op == TraceRecord::kPut) {
+            auto p = pending.find(it->conn);
+            if (p != pending.end()) {
+                requests[p->second].holdUs = it->durationUs;
+                requests[p->second].broken = (it->flags & TraceRecord::kBroken) != 0;
+                pending.erase(p);
+            }
+        }
+    }
+}
+
+// Replay a recorded workload against a pool of SimPooledObject. The trace is
+// played @speed times faster than recorded. With a pool on SimClock the replay
+// takes no wall time at all and is deterministic; with a pool on SystemClock
+// the borrows are paced in real time, dials take their time on the wall clock
+// and the pool runs its own health checker, dialing from its thread.
+template <typename Pool>
+SimResult replayTrace(const std::vector<TraceRecord>& records, const std::vector<InetSocketAddress>& servers,
+                      const PoolConfig& config, double speed = 1.0, uint64_t seed = 1) {
+    typedef typename Pool::clock_type Clock;
+    typedef std::chrono::microseconds us;
+    typedef std::shared_ptr<SimPooledObject> Conn;
+
+    struct Release {
+        typename Clock::time_point at;
+        size_t seq;
+        Conn conn;
+        bool broken;
+
+        bool operator>(const Release& other) const {
+            return at != other.at ? at > other.at : seq > other.seq;
+        }
+    };
+
+    assert(speed > 0);
+    std::vector<ReplayRequest> requests;
+    toReplayRequests(records, requests);
+
+    SimClock::reset();
+    SimBackend& backend = SimBackend::instance();
+    backend.reset(seed);
+    backend.setRealTime(Clock::kRealTime);
+    for (auto it = servers.begin(); it != servers.end(); it++) {
+        backend.server(*it);
+    }
+
+    SimResult result;
+    {
+        Pool pool(servers, config);
+        std::priority_queue<Release, std::vector<Release>, std::greater<Release> > releases;
+
+        const typename Clock::time_point origin = Clock::now();
+        const uint64_t firstNs = requests.empty() ? 0 : requests.front().atNs;
+        auto scaled = [speed](double ns) {
+            return std::chrono::duration_cast<typename Clock::duration>(std::chrono::nanoseconds(
+                    static_cast<int64_t>(ns / speed)));
+        };
+        typename Clock::time_point nextHealthCheck = origin + std::chrono::seconds(1);
+
+        size_t next = 0;
+        while (next < requests.size() || !releases.empty()) {
+            typename Clock::time_point at = next < requests.size()
+                    ? origin + scaled(requests[next].atNs - firstNs) : Clock::time_point::max();
+
+            // Run the health check of a virtual clock pool at the simulated interval.
+            if (!Clock::kRealTime && nextHealthCheck <= at
+                    && (releases.empty() || nextHealthCheck <= releases.top().at)) {
+                Clock::sleepUntil(nextHealthCheck);
+                pool.runHealthCheck();
+                simRewind(static_cast<Clock*>(nullptr), nextHealthCheck);
+                nextHealthCheck += std::chrono::seconds(1);
+                continue;
+            }
+
+            if (!releases.empty() && releases.top().at <= at) {
+                Release r = releases.top();
+                releases.pop();
+                Clock::sleepUntil(r.at);
+                if (r.broken) {
+                    result.numBroken++;
+                }
+                pool.put(r.conn, r.broken);
+                continue;
+            }
+
+            const ReplayRequest& req = requests[next++];
+            Clock::sleepUntil(at);
+            typename Clock::time_point t = Clock::now();
+            result.numRequest++;
+            Conn c;
+            if (pool.tryGet(c) != kGetOk) {
+                result.numGetFail++;
+                result.totalGetUs += std::chrono::duration_cast<us>(Clock::now() - t).count();
+                simRewind(static_cast<Clock*>(nullptr), t);
+                continue;
+            }
+            result.numBorrow++;
+            result.totalGetUs += std::chrono::duration_cast<us>(Clock::now() - t).count();
+            result.borrows[c->getServerAddr().to_string()]++;
+            releases.push(Release{Clock::now() + scaled(req.holdUs * 1000.0), next, c, req.broken});
+            simRewind(static_cast<Clock*>(nullptr), t);
+        }
+    }
+
+    simCollect(servers, result);
+    return result;
+}
+
+} // namespace dpool
+
+#endif // DPOOL_SIMULATION_H_
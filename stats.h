@@ -0,0 +1,266 @@
+#ifndef DPOOL_STATS_H_
+#define DPOOL_STATS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace dpool {
+
+// Bump a counter whose writers are serialized by a lock, while readers load
+// it lock free: a plain load/store pair, no locked instruction.
+inline void bump(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct HistogramSnapshot {
+    // Bucket i counts observations <= 2^i us, the last one the overflow.
+    static const int kNumBuckets = 23;
+
+    HistogramSnapshot() : sumUs(0) {
+        memset(counts, 0, sizeof(counts));
+    }
+
+    static uint64_t upperBoundUs(int bucket) {
+        return 1ULL << bucket;
+    }
+
+    uint64_t count() const {
+        uint64_t n = 0;
+        for (int i = 0; i < kNumBuckets; i++) {
+            n += counts[i];
+        }
+        return n;
+    }
+
+    void merge(const HistogramSnapshot& other) {
+        for (int i = 0; i < kNumBuckets; i++) {
+            counts[i] += other.counts[i];
+        }
+        sumUs += other.sumUs;
+    }
+
+    uint64_t counts[kNumBuckets];
+    uint64_t sumUs;
+};
+
+// Lock free latency histogram with power of 2 microsecond buckets, from 1us
+// to ~2s.
+class LatencyHistogram {
+  public:
+    static const int kNumBuckets = HistogramSnapshot::kNumBuckets;
+
+    LatencyHistogram() : sumUs_(0) {
+        for (int i = 0; i < kNumBuckets; i++) {
+            counts_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void observe(uint64_t us) {
+        int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+        if (bucket >= kNumBuckets) {
+            bucket = kNumBuckets - 1;
+        }
+        counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+        sumUs_.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    void snapshot(HistogramSnapshot& s) const {
+        for (int i = 0; i < kNumBuckets; i++) {
+            s.counts[i] = counts_[i].load(std::memory_order_relaxed);
+        }
+        s.sumUs = sumUs_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> counts_[kNumBuckets];
+    std::atomic<uint64_t> sumUs_;
+};
+
+// Cumulative counters of a shard, never reset. Written under the shard lock,
+// read lock free.
+struct ShardCounters {
+    ShardCounters() : numGet(0), numPut(0), numBroken(0), numDial(0), numDialFail(0),
+                      numEvict(0), numClose(0), numWaitTimeout(0) {
+    }
+
+    std::atomic<uint64_t> numGet;
+    std::atomic<uint64_t> numPut;
+    std::atomic<uint64_t> numBroken;
+    std::atomic<uint64_t> numDial;
+    std::atomic<uint64_t> numDialFail;
+    std::atomic<uint64_t> numEvict;
+    std::atomic<uint64_t> numClose;
+    std::atomic<uint64_t> numWaitTimeout;
+};
+
+// Point in time copy of the cumulative statistics of a shard.
+struct ShardSnapshot {
+    ShardSnapshot() : index(0), node(-1), available(true), numActive(0), numIdle(0), numWaiters(0),
+                      limitActive(0), limitIdle(0), concurrencyLimit(0), numGet(0), numPut(0),
+                      numBroken(0), numDial(0), numDialFail(0), numEvict(0), numClose(0),
+                      numWaitTimeout(0), numRemoteBorrow(0), numSpillover(0) {
+    }
+
+    // Add the gauges, counters and histograms of @other.
+    void merge(const ShardSnapshot& other) {
+        numActive += other.numActive;
+        numIdle += other.numIdle;
+        numWaiters += other.numWaiters;
+        limitActive += other.limitActive;
+        limitIdle += other.limitIdle;
+        concurrencyLimit += other.concurrencyLimit;
+        numGet += other.numGet;
+        numPut += other.numPut;
+        numBroken += other.numBroken;
+        numDial += other.numDial;
+        numDialFail += other.numDialFail;
+        numEvict += other.numEvict;
+        numClose += other.numClose;
+        numWaitTimeout += other.numWaitTimeout;
+        numRemoteBorrow += other.numRemoteBorrow;
+        numSpillover += other.numSpillover;
+        borrowWait.merge(other.borrowWait);
+        hold.merge(other.hold);
+    }
+
+    std::string server;
+    uint16_t index;
+    // Bulkhead of the shard, "" if the pool has none
+    std::string bulkhead;
+    // Zone of the server, "" if none
+    std::string zone;
+    // NUMA node of a per node snapshot, -1 for a whole shard
+    int node;
+
+    // Gauges
+    bool available;
+    int32_t numActive;
+    int32_t numIdle;
+    int32_t numWaiters;
+    // Effective maxActive and maxIdle, see adaptive-limits.h
+    int32_t limitActive;
+    int32_t limitIdle;
+    // Borrows admitted at a time by the limiter policy, zero for no limit
+    int32_t concurrencyLimit;
+
+    // Counters
+    uint64_t numGet;
+    uint64_t numPut;
+    uint64_t numBroken;
+    uint64_t numDial;
+    uint64_t numDialFail;
+    uint64_t numEvict;
+    uint64_t numClose;
+    uint64_t numWaitTimeout;
+    // Borrows served by the sub-pool of another NUMA node
+    uint64_t numRemoteBorrow;
+    // Borrows served out of the local zone of the pool, see
+    // PoolConfig::withLocalZone()
+    uint64_t numSpillover;
+
+    // Time spent in get(), and time borrowed until put()
+    HistogramSnapshot borrowWait;
+    HistogramSnapshot hold;
+};
+
+// Stats policies, selecting what a shard accounts. A policy provides
+// Shard<kSerialized>, the per shard state: kSerialized is true when every
+// writer holds the shard lock, so that counters can be bumped without locked
+// instructions.
+
+// The default stats policy: cumulative counters, gauges and histograms.
+struct CountingStats {
+    static const bool kEnabled = true;
+
+    template <bool kSerialized>
+    class Shard {
+      public:
+        Shard() : numIdle_(0), waiters_(0) {}
+
+        void onGet()         { inc(counters_.numGet); }
+        void onPut()         { inc(counters_.numPut); }
+        void onBroken()      { inc(counters_.numBroken); }
+        void onDial()        { inc(counters_.numDial); }
+        void onDialFail()    { inc(counters_.numDialFail); }
+        void onEvict()       { inc(counters_.numEvict); }
+        void onClose()       { inc(counters_.numClose); }
+        void onWaitTimeout() { inc(counters_.numWaitTimeout); }
+
+        void setIdle(int32_t n) {
+            numIdle_.store(n, std::memory_order_relaxed);
+        }
+
+        void addWaiter(int32_t n) {
+            waiters_.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        void observeBorrowWait(uint64_t us) {
+            borrowWait_.observe(us);
+        }
+
+        void observeHold(uint64_t us) {
+            hold_.observe(us);
+        }
+
+        // Fill the counters, idle/waiters gauges and histograms of @st.
+        void snapshot(ShardSnapshot& st) const {
+            st.numIdle = numIdle_.load(std::memory_order_relaxed);
+            st.numWaiters = waiters_.load(std::memory_order_relaxed);
+            st.numGet = counters_.numGet.load(std::memory_order_relaxed);
+            st.numPut = counters_.numPut.load(std::memory_order_relaxed);
+            st.numBroken = counters_.numBroken.load(std::memory_order_relaxed);
+            st.numDial = counters_.numDial.load(std::memory_order_relaxed);
+            st.numDialFail = counters_.numDialFail.load(std::memory_order_relaxed);
+            st.numEvict = counters_.numEvict.load(std::memory_order_relaxed);
+            st.numClose = counters_.numClose.load(std::memory_order_relaxed);
+            st.numWaitTimeout = counters_.numWaitTimeout.load(std::memory_order_relaxed);
+            borrowWait_.snapshot(st.borrowWait);
+            hold_.snapshot(st.hold);
+        }
+
+      private:
+        static void inc(std::atomic<uint64_t>& counter) {
+            if (kSerialized) {
+                bump(counter);
+            } else {
+                counter.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        ShardCounters counters_;
+        std::atomic<int32_t> numIdle_;
+        std::atomic<int32_t> waiters_;
+        LatencyHistogram borrowWait_;
+        LatencyHistogram hold_;
+    };
+};
+
+// Account nothing: every hook is an empty inline function, and the shard
+// skips the clock reads only needed by the histograms.
+struct NoStats {
+    static const bool kEnabled = false;
+
+    template <bool kSerialized>
+    class Shard {
+      public:
+        void onGet() {}
+        void onPut() {}
+        void onBroken() {}
+        void onDial() {}
+        void onDialFail() {}
+        void onEvict() {}
+        void onClose() {}
+        void onWaitTimeout() {}
+        void setIdle(int32_t) {}
+        void addWaiter(int32_t) {}
+        void observeBorrowWait(uint64_t) {}
+        void observeHold(uint64_t) {}
+        void snapshot(ShardSnapshot&) const {}
+    };
+};
+
+} // namespace dpool
+
+#endif // DPOOL_STATS_H_
@@ -0,0 +1,64 @@
+#include <iostream>
+#include <cstdlib>
+
+#include "dpool.h"
+#include "simulation.h"
+
+// Built with -fno-exceptions: borrows go through tryGet(), and the simulated
+// dials fail through PooledObject::failOpen().
+typedef dpool::DPool<dpool::SimPooledObject, dpool::LockedShard, dpool::RoundRobinBalancer,
+                     dpool::CountingStats, dpool::SimClock, dpool::NullLogger> SimPool;
+
+static bool expect(const char* what, dpool::GetStatus status, dpool::GetStatus expected) {
+    if (status != expected) {
+        std::cout << what << ": " << dpool::getStatusName(status) << ", expected "
+                  << dpool::getStatusName(expected) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    std::vector<dpool::InetSocketAddress> servers;
+    servers.push_back(dpool::InetSocketAddress("10.0.0.1", 6379));
+    servers.push_back(dpool::InetSocketAddress("10.0.0.2", 6379));
+    servers.push_back(dpool::InetSocketAddress("10.0.0.3", 6379));
+    const dpool::PoolConfig config(100, 100, 1, 1, 100);
+    std::shared_ptr<dpool::SimPooledObject> c;
+
+    SimPool pool(servers, config);
+    std::vector<std::shared_ptr<dpool::SimPooledObject>> held(servers.size());
+    for (size_t i = 0; i < held.size(); i++) {
+        if (!expect("get", pool.tryGet(held[i]), dpool::kGetOk)) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (!expect("get at maxActive", pool.tryGet(c), dpool::kGetExhausted) || c != nullptr) {
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < held.size(); i++) {
+        pool.put(held[i]);
+    }
+    if (!expect("get past the deadline", pool.tryGet(c, dpool::SimClock::now()), dpool::kGetTimedOut)) {
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < servers.size(); i++) {
+        dpool::SimBackend::instance().setUp(servers[i], false);
+    }
+    {
+        SimPool down(servers, config);
+        if (!expect("get from dead servers", down.tryGet(c), dpool::kGetDialFailed)) {
+            return EXIT_FAILURE;
+        }
+    }
+    for (size_t i = 0; i < servers.size(); i++) {
+        dpool::SimBackend::instance().setUp(servers[i], true);
+    }
+
+    pool.shutdown();
+    if (!expect("get after shutdown", pool.tryGet(c), dpool::kGetClosed)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1182 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <deque>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "dpool.h"
+#include "simulation.h"
+#include "broker.h"
+#include "replicated-pool.h"
+#include "cluster.h"
+
+typedef dpool::DPool<dpool::SimPooledObject, dpool::LockedShard, dpool::RoundRobinBalancer,
+                     dpool::CountingStats, dpool::SimClock> SimPool;
+// Lock free shards, no statistics and no logging
+typedef dpool::DPool<dpool::SimPooledObject, dpool::LockFreeShard, dpool::RoundRobinBalancer,
+                     dpool::NoStats, dpool::SimClock, dpool::NullLogger> LeanSimPool;
+
+// One sub-pool per NUMA node and server
+typedef dpool::DPool<dpool::SimPooledObject, dpool::NumaShard, dpool::RoundRobinBalancer,
+                     dpool::CountingStats, dpool::SimClock> NumaSimPool;
+
+// Least loaded of two consecutive shards
+typedef dpool::DPool<dpool::SimPooledObject, dpool::LockedShard, dpool::LeastLoadedBalancer<2>,
+                     dpool::CountingStats, dpool::SimClock> FleetSimPool;
+
+// No shared write to pick shards
+typedef dpool::DPool<dpool::SimPooledObject, dpool::LockedShard, dpool::ThreadLocalBalancer,
+                     dpool::CountingStats, dpool::SimClock> CursorSimPool;
+typedef dpool::DPool<dpool::SimPooledObject, dpool::LockedShard, dpool::RandomBalancer<>,
+                     dpool::CountingStats, dpool::SimClock> RandomSimPool;
+
+// Counts the events of a pool without statistics
+struct CountingListener : public dpool::NoListener {
+    static const bool kEnabled = true;
+
+    CountingListener() : dials(0), borrows(0), returns(0) {}
+
+    void onDial(uint16_t shard, const dpool::InetSocketAddress& server, dpool::PooledObject* c) {
+        dials++;
+    }
+
+    void onBorrow(uint16_t shard, dpool::PooledObject* c, int64_t waitUs) {
+        borrows++;
+    }
+
+    void onReturn(uint16_t shard, dpool::PooledObject* c, bool broken, int64_t holdUs) {
+        returns++;
+    }
+
+    int dials;
+    int borrows;
+    int returns;
+};
+
+typedef dpool::DPool<dpool::SimPooledObject, dpool::LockedShard, dpool::RoundRobinBalancer,
+                     dpool::NoStats, dpool::SimClock, dpool::NullLogger, CountingListener> ListenedSimPool;
+
+// Concurrency limited pools
+typedef dpool::DPool<dpool::SimPooledObject, dpool::LockedShard, dpool::RoundRobinBalancer,
+                     dpool::NoStats, dpool::SimClock, dpool::NullLogger, dpool::NoListener,
+                     dpool::AimdLimiter<10> > AimdSimPool;
+typedef dpool::DPool<dpool::SimPooledObject, dpool::LockedShard, dpool::RoundRobinBalancer,
+                     dpool::NoStats, dpool::SimClock, dpool::NullLogger, dpool::NoListener,
+                     dpool::GradientLimiter<> > GradientSimPool;
+
+// A connection on one end of a socket pair, the test holding the other
+class SocketPairObject : public dpool::PooledObject {
+  public:
+    SocketPairObject(const dpool::InetSocketAddress& addr, const int connTimeout, const int dataTimeout)
+      : PooledObject(addr, connTimeout, dataTimeout) {
+        fds_[0] = fds_[1] = -1;
+    }
+
+    virtual ~SocketPairObject() {
+        if (fds_[0] >= 0) {
+            ::close(fds_[0]);
+            ::close(fds_[1]);
+        }
+    }
+
+    virtual void open() throw (dpool::DPoolException) override {
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds_) != 0) {
+            failOpen("socketpair failed", __FILE__, __LINE__);
+        }
+    }
+
+    virtual int getFd() const override {
+        return fds_[0];
+    }
+
+    int peer() const {
+        return fds_[1];
+    }
+
+  private:
+    int fds_[2];
+};
+
+typedef dpool::DPool<SocketPairObject, dpool::LockedShard, dpool::RoundRobinBalancer,
+                     dpool::CountingStats, dpool::SimClock, dpool::NullLogger> SocketPairPool;
+
+typedef dpool::ClusterPool<dpool::SimPooledObject, SimPool> SimClusterPool;
+
+static const dpool::InetSocketAddress server1("10.0.0.1", 6379);
+static const dpool::InetSocketAddress server2("10.0.0.2", 6379);
+static const dpool::InetSocketAddress server3("10.0.0.3", 6379);
+
+static std::vector<dpool::InetSocketAddress> servers() {
+    std::vector<dpool::InetSocketAddress> list;
+    list.push_back(server1);
+    list.push_back(server2);
+    list.push_back(server3);
+    return list;
+}
+
+// 10 minutes of traffic, server2 down from the 1st to the 3rd minute
+static dpool::SimScenario outageScenario() {
+    dpool::SimScenario scenario;
+    scenario.servers = servers();
+    scenario.durationMs = 600 * 1000L;
+    scenario.requestsPerSec = 2000;
+    scenario.events.push_back(dpool::SimEvent(60 * 1000L, server2, false));
+    scenario.events.push_back(dpool::SimEvent(180 * 1000L, server2, true));
+    return scenario;
+}
+
+// Start a test at time zero, with every simulated server up.
+static void resetSimulation() {
+    dpool::SimClock::reset();
+    dpool::SimBackend::instance().reset(1);
+}
+
+// Run a command on @key against @cluster, following its redirections.
+// @return - the redirections followed, -1 if the command failed
+int clusterCommand(SimClusterPool& pool, const dpool::SimCluster& cluster, const std::string& key) {
+    std::shared_ptr<dpool::SimPooledObject> c = pool.get(key);
+    std::string reply = cluster.reply(c->getServerAddr(), key);
+    int hops = 0;
+    for (; !reply.empty() && hops < 3; hops++) {
+        pool.put(c);
+        bool asking = false;
+        if (pool.tryGetRedirected(c, reply, &asking) != dpool::kGetOk) {
+            return -1;
+        }
+        reply = cluster.reply(c->getServerAddr(), key, asking);
+    }
+    pool.put(c);
+    return reply.empty() ? hops : -1;
+}
+
+// Borrow 8 connections every millisecond for a second, held for 1ms, except
+// that the second server takes 50ms from 100ms on.
+// @return - true if the limit of the slow server shrank, and no get() failed.
+template <typename Pool>
+bool shedSlowServer(const std::vector<dpool::InetSocketAddress>& servers) {
+    typedef std::shared_ptr<dpool::SimPooledObject> Conn;
+    resetSimulation();
+    int failed = 0;
+    std::vector<dpool::ShardSnapshot> snapshots;
+    {
+        Pool pool(servers, dpool::PoolConfig(100, 100, 64, 64));
+        std::deque<std::pair<int, Conn> > slow;
+        std::vector<Conn> fast;
+        for (int ms = 0; ms < 1000; ms++) {
+            for (int i = 0; i < 8; i++) {
+                try {
+                    Conn c = pool.get();
+                    if (ms >= 100 && c->getServerAddr().to_string() == servers[1].to_string()) {
+                        slow.push_back(std::make_pair(ms + 50, c));
+                    } else {
+                        fast.push_back(c);
+                    }
+                } catch (dpool::DPoolException& ex) {
+                    failed++;
+                }
+            }
+            dpool::SimClock::advance(std::chrono::milliseconds(1));
+            for (auto it = fast.begin(); it != fast.end(); it++) {
+                pool.put(*it);
+            }
+            fast.clear();
+            while (!slow.empty() && slow.front().first <= ms + 1) {
+                pool.put(slow.front().second);
+                slow.pop_front();
+            }
+        }
+        pool.getSnapshots(snapshots);
+        for (; !slow.empty(); slow.pop_front()) {
+            pool.put(slow.front().second);
+        }
+    }
+    if (failed != 0 || snapshots[1].concurrencyLimit * 2 > snapshots[0].concurrencyLimit) {
+        std::cout << "slow server not shed: limits " << snapshots[0].concurrencyLimit << " and "
+                  << snapshots[1].concurrencyLimit << ", failed: " << failed << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// The simulation is deterministic, its outage shows up in the flight
+// recorder, and its recorded traffic replays, 10 times faster.
+static bool testSimulation() {
+    resetSimulation();
+    dpool::SimScenario scenario = outageScenario();
+    const dpool::PoolConfig config;
+    const std::string tracePath = "/tmp/dpool-sim.trace";
+    dpool::SimResult r1;
+    {
+        dpool::TraceRecorder tracer(tracePath, 4 << 20);
+        scenario.tracer = &tracer;
+        r1 = dpool::simulate<SimPool>(scenario, config);
+        scenario.tracer = nullptr;
+    }
+    dpool::SimResult r2 = dpool::simulate<SimPool>(scenario, config);
+
+    r1.dump(std::cout);
+    if (r1 != r2) {
+        std::cout << "simulation is not deterministic" << std::endl;
+        r2.dump(std::cout);
+        return false;
+    }
+    if (r1.numBorrow == 0 || r1.numBroken * 100 > r1.numBorrow) {
+        std::cout << "unexpected simulation result" << std::endl;
+        return false;
+    }
+
+    const char* dumpPath = "/tmp/dpool-sim.flight";
+    int fd = ::open(dumpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dpool::FlightRecorder::dump(fd);
+    ::close(fd);
+    std::ifstream dumpFile(dumpPath);
+    std::stringstream dump;
+    dump << dumpFile.rdbuf();
+    if (dump.str().find("shard=1 mark-available") == std::string::npos) {
+        std::cout << "missing flight recorder events" << std::endl;
+        return false;
+    }
+
+    std::vector<dpool::TraceRecord> records;
+    dpool::loadTrace(tracePath, records);
+    dpool::SimResult replayed = dpool::replayTrace<SimPool>(records, scenario.servers, config, 10.0);
+    std::cout << "replayed " << records.size() << " trace records" << std::endl;
+    replayed.dump(std::cout);
+    if (replayed.numRequest != r1.numRequest
+            || replayed != dpool::replayTrace<SimPool>(records, scenario.servers, config, 10.0)) {
+        std::cout << "unexpected replay result" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// The lean and NUMA configurations serve the same traffic, the latter with
+// statistics per node.
+static bool testShardPolicies() {
+    resetSimulation();
+    const dpool::SimScenario scenario = outageScenario();
+    const dpool::PoolConfig config;
+    const long numRequest = dpool::simulate<SimPool>(scenario, config).numRequest;
+    dpool::SimResult lean = dpool::simulate<LeanSimPool>(scenario, config);
+    if (lean.numRequest != numRequest || lean.numBorrow == 0
+            || lean != dpool::simulate<LeanSimPool>(scenario, config)) {
+        std::cout << "unexpected lean pool result" << std::endl;
+        lean.dump(std::cout);
+        return false;
+    }
+
+    dpool::SimResult numa = dpool::simulate<NumaSimPool>(scenario, config);
+    if (numa.numRequest != numRequest || numa.numBorrow == 0) {
+        std::cout << "unexpected NUMA pool result" << std::endl;
+        numa.dump(std::cout);
+        return false;
+    }
+    resetSimulation();
+    NumaSimPool pool(scenario.servers, config);
+    for (int i = 0; i < 100; i++) {
+        pool.put(pool.get());
+    }
+    std::vector<dpool::ShardSnapshot> shards, nodes;
+    pool.getSnapshots(shards);
+    pool.getNodeSnapshots(nodes);
+    uint64_t nodeGets = 0;
+    for (auto it = nodes.begin(); it != nodes.end(); it++) {
+        nodeGets += it->numGet - it->numRemoteBorrow;
+    }
+    if (shards[0].numGet != 34 || nodes.size() % 3 != 0 || nodes[0].node != 0 || nodeGets < 100) {
+        std::cout << "unexpected NUMA stats" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Statistics exported in Prometheus format, and through shared memory
+static bool testExporter() {
+    resetSimulation();
+    SimPool pool(servers(), dpool::PoolConfig());
+    for (int i = 0; i < 100; i++) {
+        pool.put(pool.get());
+    }
+    std::vector<dpool::ShardSnapshot> snapshots;
+    pool.getSnapshots(snapshots);
+    std::ostringstream metrics;
+    dpool::renderPrometheus(snapshots, metrics, "sim");
+    if (metrics.str().find("dpool_get_total{pool=\"sim\",server=\"10.0.0.1:6379\"} 34") == std::string::npos
+            || metrics.str().find("dpool_hold_seconds_count{pool=\"sim\",server=\"10.0.0.3:6379\"} 33")
+                    == std::string::npos) {
+        std::cout << "unexpected metrics:" << std::endl << metrics.str();
+        return false;
+    }
+
+    dpool::ShmStatsPublisher publisher("/dpool-sim-stats", 16);
+    publisher.publish(snapshots);
+    dpool::ShmStatsReader reader("/dpool-sim-stats");
+    std::vector<dpool::ShardSnapshot> scraped;
+    if (!reader.read(scraped) || scraped.size() != 3 || scraped[0].numGet != 34
+            || scraped[2].hold.count() != 33 || scraped[1].server != "10.0.0.2:6379") {
+        std::cout << "unexpected shared memory stats" << std::endl;
+        return false;
+    }
+
+    // Label values are escaped.
+    snapshots.resize(1);
+    snapshots[0].bulkhead = "a\"b\\c\nd";
+    std::ostringstream escaped;
+    dpool::renderPrometheus(snapshots, escaped, "sim");
+    if (escaped.str().find(",bulkhead=\"a\\\"b\\\\c\\nd\"}") == std::string::npos) {
+        std::cout << "unescaped labels:" << std::endl << escaped.str();
+        return false;
+    }
+    return true;
+}
+
+// A large fleet with a third of the servers down: once the health check
+// took them out, every get() succeeds.
+static bool testLargeFleet() {
+    resetSimulation();
+    std::vector<dpool::InetSocketAddress> fleet;
+    for (int i = 0; i < 300; i++) {
+        fleet.push_back(dpool::InetSocketAddress("10.1." + std::to_string(i / 256) + "."
+                                                 + std::to_string(i % 256), 6379));
+    }
+    for (int i = 0; i < 99; i++) {
+        dpool::SimBackend::instance().setUp(fleet[i], false);
+    }
+    FleetSimPool pool(fleet, dpool::PoolConfig());
+    pool.setLogger(nullptr);
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < 3000; i++) {
+            try {
+                pool.put(pool.get());
+            } catch (dpool::DPoolException& ex) {
+            }
+        }
+        pool.runHealthCheck();
+    }
+    int failed = 0;
+    for (int i = 0; i < 3000; i++) {
+        try {
+            pool.put(pool.get());
+        } catch (dpool::DPoolException& ex) {
+            failed++;
+        }
+    }
+    if (failed != 0) {
+        std::cout << "fleet get failed " << failed << " times" << std::endl;
+        return false;
+    }
+
+    // Failed servers the health check has not seen yet still cost a try
+    // each, but get() goes on to the healthy ones.
+    resetSimulation();
+    std::vector<dpool::InetSocketAddress> unchecked;
+    for (int i = 0; i < 20; i++) {
+        unchecked.push_back(dpool::InetSocketAddress("10.2.0." + std::to_string(i + 1), 6379));
+        dpool::SimBackend::instance().setUp(unchecked.back(), i >= 12);
+    }
+    SimPool fresh(unchecked, dpool::PoolConfig());
+    fresh.setLogger(nullptr);
+    for (int i = 0; i < 100; i++) {
+        std::shared_ptr<dpool::SimPooledObject> pc;
+        failed += fresh.tryGet(pc) != dpool::kGetOk;
+        if (pc != nullptr) {
+            fresh.put(pc);
+        }
+    }
+    if (failed != 0) {
+        std::cout << "get failed " << failed << " times with failed servers still available" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Per thread cursors and random picks spread the load evenly
+static bool testThreadLocalBalancers() {
+    resetSimulation();
+    CursorSimPool cursorPool(servers(), dpool::PoolConfig());
+    RandomSimPool randomPool(servers(), dpool::PoolConfig());
+    for (int i = 0; i < 3000; i++) {
+        cursorPool.put(cursorPool.get());
+        randomPool.put(randomPool.get());
+    }
+    std::vector<dpool::ShardSnapshot> cursorShards, randomShards;
+    cursorPool.getSnapshots(cursorShards);
+    randomPool.getSnapshots(randomShards);
+    for (int i = 0; i < 3; i++) {
+        if (cursorShards[i].numGet != 1000
+                || randomShards[i].numGet < 850 || randomShards[i].numGet > 1150) {
+            std::cout << "uneven balancing on " << cursorShards[i].server << ": "
+                      << cursorShards[i].numGet << ", " << randomShards[i].numGet << std::endl;
+            return false;
+        }
+    }
+
+    // Two pools of the same type taking turns keep cursors of their own.
+    std::vector<dpool::InetSocketAddress> pair(1, server1);
+    pair.push_back(server2);
+    CursorSimPool first(pair, dpool::PoolConfig());
+    CursorSimPool second(pair, dpool::PoolConfig());
+    for (int i = 0; i < 1000; i++) {
+        first.put(first.get());
+        second.put(second.get());
+    }
+    std::vector<dpool::ShardSnapshot> firstShards, secondShards;
+    first.getSnapshots(firstShards);
+    second.getSnapshots(secondShards);
+    for (int i = 0; i < 2; i++) {
+        if (firstShards[i].numGet != 500 || secondShards[i].numGet != 500) {
+            std::cout << "uneven balancing of interleaved pools on " << firstShards[i].server << ": "
+                      << firstShards[i].numGet << ", " << secondShards[i].numGet << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Adaptive limits follow the demand down, and back up under a burst
+static bool testAdaptiveLimits() {
+    resetSimulation();
+    std::vector<dpool::InetSocketAddress> single(1, server1);
+    SimPool pool(single, dpool::PoolConfig(100, 100, 64, 64).withAdaptiveLimits(0));
+    pool.setLogger(nullptr);
+    for (int i = 0; i < 3000; i++) {
+        std::shared_ptr<dpool::SimPooledObject> c = pool.get();
+        dpool::SimClock::advance(std::chrono::microseconds(500));
+        pool.put(c);
+        dpool::SimClock::advance(std::chrono::microseconds(500));
+    }
+    std::vector<dpool::ShardSnapshot> quiet, busy;
+    pool.getSnapshots(quiet);
+
+    int failed = 0;
+    std::vector<std::shared_ptr<dpool::SimPooledObject>> burst;
+    for (int i = 0; i < 1000; i++) {
+        for (int j = 0; j < 30; j++) {
+            try {
+                burst.push_back(pool.get());
+            } catch (dpool::DPoolException& ex) {
+                failed += i >= 500;
+            }
+        }
+        dpool::SimClock::advance(std::chrono::milliseconds(1));
+        for (auto it = burst.begin(); it != burst.end(); it++) {
+            pool.put(*it);
+        }
+        burst.clear();
+    }
+    pool.getSnapshots(busy);
+    if (quiet[0].limitActive > 8 || quiet[0].limitIdle > 8 || quiet[0].numIdle > 8
+            || busy[0].limitActive < 30 || failed != 0) {
+        std::cout << "unexpected adaptive limits: " << quiet[0].limitActive << "/" << quiet[0].limitIdle
+                  << " then " << busy[0].limitActive << "/" << busy[0].limitIdle
+                  << ", failed: " << failed << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A server slowing down gets a lower concurrency limit, its load going
+// to the other one
+static bool testConcurrencyLimits() {
+    resetSimulation();
+    std::vector<dpool::InetSocketAddress> pair(1, server1);
+    pair.push_back(server2);
+    if (!shedSlowServer<AimdSimPool>(pair) || !shedSlowServer<GradientSimPool>(pair)) {
+        return false;
+    }
+
+    // A bulkhead at its limit leaves the limit of the other one alone.
+    resetSimulation();
+    std::vector<dpool::BulkheadConfig> bulkheads;
+    bulkheads.push_back(dpool::BulkheadConfig("user", dpool::PoolConfig(100, 100, 50, 50, 1)));
+    bulkheads.push_back(dpool::BulkheadConfig("batch", dpool::PoolConfig(100, 100, 50, 50, 1)));
+    AimdSimPool pool(std::vector<dpool::InetSocketAddress>(1, server1), bulkheads);
+    pool.setLogger(nullptr);
+    std::vector<std::shared_ptr<dpool::SimPooledObject>> held;
+    int granted[2] = {0, 0};
+    dpool::Bulkhead order[2] = {pool.bulkhead("batch"), pool.bulkhead("user")};
+    for (int b = 0; b < 2; b++) {
+        std::shared_ptr<dpool::SimPooledObject> pc;
+        while (pool.tryGet(pc, order[b]) == dpool::kGetOk) {
+            held.push_back(pc);
+            granted[b]++;
+        }
+    }
+    for (auto it = held.begin(); it != held.end(); it++) {
+        pool.put(*it);
+    }
+    if (granted[0] != 20 || granted[1] != 20) {
+        std::cout << "unexpected bulkhead limits: " << granted[0] << ", " << granted[1] << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Bulk borrows leave the reserved connections to the higher priorities
+static bool testReserves() {
+    resetSimulation();
+    std::vector<dpool::InetSocketAddress> single(1, server1);
+    SimPool pool(single, dpool::PoolConfig(100, 100, 10, 10).withReserve(2, 3));
+    pool.setLogger(nullptr);
+    std::vector<std::shared_ptr<dpool::SimPooledObject>> held;
+    int granted[dpool::kNumPriorities];
+    for (int p = dpool::kNumPriorities - 1; p >= 0; p--) {
+        granted[p] = 0;
+        try {
+            while (true) {
+                held.push_back(pool.get(static_cast<dpool::Priority>(p)));
+                granted[p]++;
+            }
+        } catch (dpool::DPoolException& ex) {
+        }
+    }
+    if (granted[dpool::kPriorityBulk] != 5 || granted[dpool::kPriorityNormal] != 3
+            || granted[dpool::kPriorityCritical] != 2) {
+        std::cout << "unexpected reserves: " << granted[dpool::kPriorityBulk] << ", "
+                  << granted[dpool::kPriorityNormal] << ", " << granted[dpool::kPriorityCritical] << std::endl;
+        return false;
+    }
+    for (auto it = held.begin(); it != held.end(); it++) {
+        pool.put(*it);
+    }
+    return true;
+}
+
+// A returned connection goes to the critical waiter, even if a bulk one
+// waits longer
+static bool testPriorityWaiters() {
+    resetSimulation();
+    typedef dpool::DPool<dpool::SimPooledObject> RealTimeSimPool;
+    std::vector<dpool::InetSocketAddress> single(1, server1);
+    RealTimeSimPool pool(single, dpool::PoolConfig(100, 100, 2, 2).withMaxWait(5000));
+    pool.setLogger(nullptr);
+    std::shared_ptr<dpool::SimPooledObject> c1 = pool.get(), c2 = pool.get();
+    std::atomic<int> order(0);
+    int bulkRank = 0, criticalRank = 0;
+    auto waitFor = [&pool](int32_t waiters) {
+        std::vector<dpool::ShardSnapshot> snapshots;
+        do {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            pool.getSnapshots(snapshots);
+        } while (snapshots[0].numWaiters != waiters);
+    };
+    std::thread bulk([&pool, &order, &bulkRank]() {
+        std::shared_ptr<dpool::SimPooledObject> c = pool.get(dpool::kPriorityBulk);
+        bulkRank = ++order;
+        pool.put(c);
+    });
+    waitFor(1);
+    std::thread critical([&pool, &order, &criticalRank]() {
+        std::shared_ptr<dpool::SimPooledObject> c = pool.get(dpool::kPriorityCritical);
+        criticalRank = ++order;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        pool.put(c);
+    });
+    waitFor(2);
+    pool.put(c1);
+    bulk.join();
+    critical.join();
+    pool.put(c2);
+    if (criticalRank != 1 || bulkRank != 2) {
+        std::cout << "waiters not woken by priority: " << criticalRank << ", " << bulkRank << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Bulkheads have budgets of their own, but share the health checker
+static bool testBulkheads() {
+    resetSimulation();
+    dpool::SimBackend::instance().setUp(server2, false);
+    std::vector<dpool::BulkheadConfig> bulkheads;
+    bulkheads.push_back(dpool::BulkheadConfig("user", dpool::PoolConfig(100, 100, 4, 4, 1)));
+    bulkheads.push_back(dpool::BulkheadConfig("batch", dpool::PoolConfig(100, 100, 2, 2, 1)));
+    SimPool pool(servers(), bulkheads);
+    pool.setLogger(nullptr);
+    std::vector<std::shared_ptr<dpool::SimPooledObject>> held;
+    int granted[2] = {0, 0};
+    dpool::Bulkhead order[2] = {pool.bulkhead("batch"), pool.bulkhead("user")};
+    long dials = 0;
+    for (int b = 0; b < 2; b++) {
+        try {
+            while (granted[b] < 100) {
+                held.push_back(pool.get(order[b]));
+                granted[b]++;
+            }
+        } catch (dpool::DPoolException& ex) {
+        }
+        if (b == 0) {
+            // The failed dials of the batch bulkhead take server2 out of both.
+            pool.runHealthCheck();
+            dials = dpool::SimBackend::instance().server(server2).numDial;
+        }
+    }
+    dials = dpool::SimBackend::instance().server(server2).numDial - dials;
+    std::vector<dpool::ShardSnapshot> snapshots;
+    pool.getSnapshots(snapshots);
+    if (granted[0] != 4 || granted[1] != 8 || snapshots.size() != 6 || snapshots[1].available
+            || snapshots[4].available || snapshots[4].bulkhead != "batch" || dials != 0) {
+        std::cout << "unexpected bulkheads: " << granted[0] << ", " << granted[1] << ", dials: "
+                  << dials << std::endl;
+        return false;
+    }
+
+    dpool::ShmStatsPublisher publisher("/dpool-sim-bulkheads", 16);
+    publisher.publish(snapshots);
+    dpool::ShmStatsReader reader("/dpool-sim-bulkheads");
+    std::vector<dpool::ShardSnapshot> scraped;
+    if (!reader.read(scraped) || scraped.size() != 6 || scraped[0].bulkhead != "user"
+            || scraped[4].bulkhead != "batch") {
+        std::cout << "unexpected shared memory bulkheads" << std::endl;
+        return false;
+    }
+    for (auto it = held.begin(); it != held.end(); it++) {
+        pool.put(*it);
+    }
+    return true;
+}
+
+// A deadline bounds the dials of get(), and the data timeout of the borrow
+static bool testDeadline() {
+    resetSimulation();
+    const std::vector<dpool::InetSocketAddress> all = servers();
+    SimPool pool(all, dpool::PoolConfig(100, 100, 4, 4, 100));
+    pool.setLogger(nullptr);
+    for (auto it = all.begin(); it != all.end(); it++) {
+        dpool::SimBackend::instance().setUp(*it, false);
+    }
+    dpool::SimClock::time_point start = dpool::SimClock::now();
+    bool failed = false;
+    try {
+        pool.get(start + std::chrono::milliseconds(30));
+    } catch (dpool::DPoolException& ex) {
+        failed = true;
+    }
+    long elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            dpool::SimClock::now() - start).count();
+    for (auto it = all.begin(); it != all.end(); it++) {
+        dpool::SimBackend::instance().setUp(*it, true);
+    }
+    std::shared_ptr<dpool::SimPooledObject> c = pool.get(dpool::SimClock::now()
+                                                          + std::chrono::milliseconds(20));
+    int bounded = c->getDataTimeout();
+    pool.put(c);
+    // One of these reuses the connection borrowed with a deadline.
+    std::vector<std::shared_ptr<dpool::SimPooledObject>> held;
+    int unbounded = 100;
+    for (size_t i = 0; i < all.size(); i++) {
+        held.push_back(pool.get());
+        if (held.back()->getDataTimeout() != 100) {
+            unbounded = held.back()->getDataTimeout();
+        }
+    }
+    for (auto it = held.begin(); it != held.end(); it++) {
+        pool.put(*it);
+    }
+    if (!failed || elapsedMs > 30 || bounded < 1 || bounded > 20 || unbounded != 100) {
+        std::cout << "deadline not honored, failed: " << failed << ", elapsed: " << elapsedMs
+                  << "ms, data timeouts: " << bounded << ", " << unbounded << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Pools sharing a connection budget take the idle connections of others
+static bool testBudget() {
+    resetSimulation();
+    dpool::ConnectionBudget budget(4);
+    std::vector<dpool::InetSocketAddress> one(1, server1);
+    SimPool idle(one, dpool::PoolConfig(), &budget);
+    SimPool busy(one, dpool::PoolConfig(), &budget);
+    std::vector<std::shared_ptr<dpool::SimPooledObject>> held;
+    for (int i = 0; i < 4; i++) {
+        held.push_back(idle.get());
+    }
+    for (auto it = held.begin(); it != held.end(); it++) {
+        idle.put(*it);
+    }
+    held.clear();
+    std::shared_ptr<dpool::SimPooledObject> c;
+    for (int i = 0; i < 4; i++) {
+        if (busy.tryGet(c) == dpool::kGetOk) {
+            held.push_back(c);
+        }
+    }
+    dpool::GetStatus over = busy.tryGet(c);
+    if (held.size() != 4 || over != dpool::kGetExhausted || budget.open() != 4
+            || budget.numReclaimed() != 4 || idle.tryGet(c) != dpool::kGetExhausted) {
+        std::cout << "unexpected budget: " << held.size() << " borrowed, " << budget.open() << " open, "
+                  << budget.numReclaimed() << " reclaimed" << std::endl;
+        return false;
+    }
+    for (auto it = held.begin(); it != held.end(); it++) {
+        busy.put(*it);
+    }
+    held.clear();
+
+    // A pool over budget leaves the idle connections of its other shards
+    // and bulkheads alone: they count against the same budget.
+    dpool::ConnectionBudget own(4);
+    std::vector<dpool::BulkheadConfig> bulkheads;
+    bulkheads.push_back(dpool::BulkheadConfig("user", dpool::PoolConfig()));
+    bulkheads.push_back(dpool::BulkheadConfig("batch", dpool::PoolConfig()));
+    std::vector<dpool::InetSocketAddress> pair(1, server1);
+    pair.push_back(server2);
+    SimPool split(pair, bulkheads, &own);
+    for (int i = 0; i < 2; i++) {
+        held.push_back(split.get(split.bulkhead("batch")));
+    }
+    for (int i = 0; i < 2; i++) {
+        held.push_back(split.get(split.bulkhead("user")));
+    }
+    split.put(held[0]);
+    split.put(held[1]);
+    over = split.tryGet(c, split.bulkhead("user"));
+    std::vector<dpool::ShardSnapshot> snapshots;
+    split.getSnapshots(snapshots);
+    if (over != dpool::kGetExhausted || own.numReclaimed() != 0
+            || snapshots[2].numIdle + snapshots[3].numIdle != 2) {
+        std::cout << "unexpected budget of bulkheads: " << own.numReclaimed() << " reclaimed, "
+                  << snapshots[2].numIdle + snapshots[3].numIdle << " idle" << std::endl;
+        return false;
+    }
+    split.put(held[2]);
+    split.put(held[3]);
+    return true;
+}
+
+// Processes sharing a coordinator share quotas and health checks
+static bool testCoordinator() {
+    resetSimulation();
+    const std::string name = "/dpool-sim-coordinator-" + std::to_string(::getpid());
+    dpool::ShmCoordinator::unlink(name);
+    dpool::SimBackend::instance().setUp(server2, false);
+    dpool::PoolConfig shared(100, 100, 4, 4, 1);
+    dpool::ShmCoordinator coordinator(name, 2, 16, 4);
+    LeanSimPool pool(servers(), shared, nullptr, &coordinator);
+    std::vector<std::shared_ptr<dpool::SimPooledObject>> held;
+    // server1 and server3, after a failed dial to server2
+    held.push_back(pool.get());
+    held.push_back(pool.get());
+    pool.runHealthCheck();
+    int slot1 = coordinator.server(server1);
+
+    pid_t child = ::fork();
+    if (child == 0) {
+        // A worker: follows the leader and takes the rest of the quota,
+        // then dies holding it.
+        dpool::ShmCoordinator worker(name, 2, 16, 4);
+        LeanSimPool workerPool(servers(), shared, nullptr, &worker);
+        long probes = dpool::SimBackend::instance().server(server2).numDial;
+        workerPool.runHealthCheck();
+        probes = dpool::SimBackend::instance().server(server2).numDial - probes;
+        std::shared_ptr<dpool::SimPooledObject> c;
+        int granted = 0;
+        while (granted < 10 && workerPool.tryGet(c) == dpool::kGetOk) {
+            held.push_back(c);
+            granted++;
+        }
+        ::_exit(granted == 2 && probes == 0 && !worker.isLeader() && coordinator.active(slot1) == 2
+                ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int status = -1;
+    ::waitpid(child, &status, 0);
+    int32_t leaked = coordinator.active(slot1);
+    pool.runHealthCheck();
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS || !coordinator.isLeader()
+            || coordinator.isAvailable(coordinator.server(server2)) || leaked != 2
+            || coordinator.active(slot1) != 1) {
+        std::cout << "unexpected coordination, worker status: " << status << ", active: " << leaked
+                  << " then " << coordinator.active(slot1) << std::endl;
+        return false;
+    }
+    for (auto it = held.begin(); it != held.end(); it++) {
+        pool.put(*it);
+    }
+    dpool::ShmCoordinator::unlink(name);
+    return true;
+}
+
+// get() keeps to the local zone, until it runs short of headroom or of
+// healthy servers
+static bool testZoneRouting() {
+    resetSimulation();
+    std::vector<dpool::InetSocketAddress> zoned;
+    zoned.push_back(dpool::InetSocketAddress("10.0.1.1", 6379, "a"));
+    zoned.push_back(dpool::InetSocketAddress("10.0.1.2", 6379, "a"));
+    zoned.push_back(dpool::InetSocketAddress("10.0.2.1", 6379, "b"));
+    zoned.push_back(dpool::InetSocketAddress("10.0.2.2", 6379, "b"));
+    const dpool::PoolConfig local = dpool::PoolConfig(100, 100, 4, 4, 1).withLocalZone("a", 60, 25);
+    auto spilled = [](const SimPool& pool) {
+        std::vector<dpool::ShardSnapshot> snapshots;
+        pool.getSnapshots(snapshots);
+        uint64_t n = 0;
+        for (auto it = snapshots.begin(); it != snapshots.end(); it++) {
+            n += it->numSpillover;
+        }
+        return n;
+    };
+    SimPool pool(zoned, local);
+    std::vector<std::shared_ptr<dpool::SimPooledObject>> held;
+    // 8 local connections, the 8th borrow past the headroom spills over
+    size_t firstRemote = 0, numRemote = 0;
+    for (int i = 0; i < 10; i++) {
+        held.push_back(pool.get());
+        if (held.back()->getServerAddr().zone != "a" && numRemote++ == 0) {
+            firstRemote = i;
+        }
+    }
+    uint64_t busy = spilled(pool);
+    for (auto it = held.begin(); it != held.end(); it++) {
+        pool.put(*it);
+    }
+    held.clear();
+
+    // Half of the local servers is below 60%.
+    dpool::SimBackend::instance().setUp(zoned[1], false);
+    SimPool degraded(zoned, local);
+    for (int i = 0; i < 4; i++) {
+        degraded.put(degraded.get());
+    }
+    degraded.runHealthCheck();
+    uint64_t before = spilled(degraded);
+    for (int i = 0; i < 30; i++) {
+        degraded.put(degraded.get());
+    }
+    uint64_t unhealthy = spilled(degraded) - before;
+    if (firstRemote != 7 || numRemote != 2 || busy != numRemote || unhealthy != 20) {
+        std::cout << "unexpected zone routing: first remote borrow " << firstRemote << ", " << busy
+                  << " spilled when busy, " << unhealthy << " when unhealthy" << std::endl;
+        return false;
+    }
+
+    // More local servers failing than tries: the spillover still gets its own.
+    std::vector<dpool::InetSocketAddress> wide;
+    for (int i = 0; i < 6; i++) {
+        wide.push_back(dpool::InetSocketAddress("10.0.5." + std::to_string(i + 1), 6379, "a"));
+        dpool::SimBackend::instance().setUp(wide.back(), false);
+    }
+    wide.push_back(dpool::InetSocketAddress("10.0.6.1", 6379, "b"));
+    SimPool spill(wide, local);
+    spill.setLogger(nullptr);
+    std::shared_ptr<dpool::SimPooledObject> pc;
+    if (spill.tryGet(pc) != dpool::kGetOk || pc->getServerAddr().zone != "b") {
+        std::cout << "unexpected zone routing: no spillover after the local tries" << std::endl;
+        return false;
+    }
+    spill.put(pc);
+
+    std::vector<dpool::ShardSnapshot> snapshots;
+    spill.getSnapshots(snapshots);
+    dpool::ShmStatsPublisher publisher("/dpool-sim-zones", 16);
+    publisher.publish(snapshots);
+    dpool::ShmStatsReader reader("/dpool-sim-zones");
+    std::vector<dpool::ShardSnapshot> scraped;
+    if (!reader.read(scraped) || scraped.size() != 7 || scraped[0].zone != "a" || scraped[6].zone != "b"
+            || scraped[6].numSpillover != 1) {
+        std::cout << "unexpected shared memory zones" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Writes go to the primary, reads to the replicas, or the primary when
+// the replicas are down
+static bool testReplicaRouting() {
+    resetSimulation();
+    std::vector<dpool::ReplicaSet> shards;
+    for (int k = 0; k < 2; k++) {
+        std::string prefix = "10.0." + std::to_string(k + 3) + ".";
+        std::vector<dpool::InetSocketAddress> replicas;
+        replicas.push_back(dpool::InetSocketAddress(prefix + "2", 6379));
+        replicas.push_back(dpool::InetSocketAddress(prefix + "3", 6379));
+        shards.push_back(dpool::ReplicaSet(dpool::InetSocketAddress(prefix + "1", 6379), replicas));
+    }
+    const dpool::PoolConfig replicated(100, 100, 4, 4, 1);
+    int writes = 0, reads = 0, failovers = 0;
+    {
+        dpool::ReplicatedPool<dpool::SimPooledObject, SimPool> pool(shards, replicated);
+        for (int i = 0; i < 6; i++) {
+            std::shared_ptr<dpool::SimPooledObject> w = pool.get(1, dpool::kWrite);
+            std::shared_ptr<dpool::SimPooledObject> r = pool.get(0, dpool::kRead);
+            writes += w->getServerAddr().to_string() == shards[1].primary.to_string();
+            reads += r->getServerAddr().to_string() != shards[0].primary.to_string();
+            pool.put(w);
+            pool.put(r);
+        }
+    }
+    dpool::SimBackend::instance().setUp(shards[0].replicas[0], false);
+    dpool::SimBackend::instance().setUp(shards[0].replicas[1], false);
+    long dials;
+    {
+        dpool::ReplicatedPool<dpool::SimPooledObject, SimPool> pool(shards, replicated);
+        pool.put(pool.get(0, dpool::kRead));
+        pool.pool().runHealthCheck();
+        dials = dpool::SimBackend::instance().server(shards[0].replicas[0]).numDial;
+        for (int i = 0; i < 6; i++) {
+            std::shared_ptr<dpool::SimPooledObject> r = pool.get(0, dpool::kRead);
+            failovers += r->getServerAddr().to_string() == shards[0].primary.to_string();
+            pool.put(r);
+        }
+        dials = dpool::SimBackend::instance().server(shards[0].replicas[0]).numDial - dials;
+    }
+    if (writes != 6 || reads != 6 || failovers != 6 || dials != 0) {
+        std::cout << "unexpected replica routing: " << writes << " writes and " << reads
+                  << " reads routed, " << failovers << " failovers, " << dials << " dials" << std::endl;
+        return false;
+    }
+
+    // Half of the servers down, past the 1/3 the pool marks unavailable: the
+    // failed replicas are still passed over, until they recover.
+    dpool::SimBackend::instance().setUp(shards[1].replicas[0], false);
+    failovers = 0, dials = 0;
+    int misrouted = 0, recovered = 0;
+    {
+        dpool::ReplicatedPool<dpool::SimPooledObject, SimPool> pool(shards, replicated);
+        pool.pool().setLogger(nullptr);
+        // Every replica is tried: the reads of a shard follow each other.
+        for (int k = 0; k < 2; k++) {
+            for (int i = 0; i < 4; i++) {
+                pool.put(pool.get(k, dpool::kRead));
+            }
+        }
+        pool.pool().runHealthCheck();
+        const dpool::InetSocketAddress* down[3] = {&shards[0].replicas[0], &shards[0].replicas[1],
+                                                   &shards[1].replicas[0]};
+        for (int k = 0; k < 3; k++) {
+            dials -= dpool::SimBackend::instance().server(*down[k]).numDial;
+        }
+        for (int i = 0; i < 6; i++) {
+            std::shared_ptr<dpool::SimPooledObject> r = pool.get(0, dpool::kRead);
+            failovers += r->getServerAddr().to_string() == shards[0].primary.to_string();
+            pool.put(r);
+        }
+        for (int i = 0; i < 6; i++) {
+            std::shared_ptr<dpool::SimPooledObject> r = pool.get(1, dpool::kRead);
+            misrouted += r->getServerAddr().to_string() != shards[1].replicas[1].to_string();
+            pool.put(r);
+        }
+        for (int k = 0; k < 3; k++) {
+            dials += dpool::SimBackend::instance().server(*down[k]).numDial;
+            dpool::SimBackend::instance().setUp(*down[k], true);
+        }
+        pool.pool().runHealthCheck();
+        for (int i = 0; i < 6; i++) {
+            std::shared_ptr<dpool::SimPooledObject> r = pool.get(0, dpool::kRead);
+            recovered += r->getServerAddr().to_string() != shards[0].primary.to_string();
+            pool.put(r);
+        }
+    }
+    if (failovers != 6 || misrouted != 0 || dials != 0 || recovered != 6) {
+        std::cout << "unexpected replica routing with half of the servers down: " << failovers
+                  << " failovers, " << misrouted << " reads of shard 1 off its replica, " << dials
+                  << " dials, " << recovered << " reads after recovery" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Keys go to the node serving their slot, following the redirections of
+// the cluster as it changes
+static bool testClusterRouting() {
+    resetSimulation();
+    std::string hashed = std::to_string(dpool::keyHashSlot("123456789")) + " "
+                       + std::to_string(dpool::keyHashSlot("{user1000}.following")) + " "
+                       + std::to_string(dpool::keyHashSlot("{user1000}.followers")) + " "
+                       + std::to_string(dpool::keyHashSlot("foo{}{bar}")) + " "
+                       + std::to_string(dpool::keyHashSlot("foo{{bar}}zap"));
+    std::string expected = "12739 " + std::to_string(dpool::keyHashSlot("user1000")) + " "
+                         + std::to_string(dpool::keyHashSlot("user1000")) + " "
+                         + std::to_string(dpool::crc16("foo{}{bar}", 10) & 16383) + " "
+                         + std::to_string(dpool::keyHashSlot("{bar"));
+    if (hashed != expected) {
+        std::cout << "unexpected key slots: " << hashed << ", expected " << expected << std::endl;
+        return false;
+    }
+
+    dpool::InetSocketAddress nodeA("10.0.5.1", 7000), nodeB("10.0.5.2", 7000), nodeC("10.0.5.3", 7000);
+    dpool::SimCluster cluster;
+    cluster.assign(0, 8191, nodeA);
+    cluster.assign(8192, 16383, nodeB);
+    SimClusterPool pool(std::vector<dpool::InetSocketAddress>(1, nodeA), dpool::PoolConfig(100, 100, 4, 4));
+    const std::string key = "user:{42}";
+    const int slot = dpool::keyHashSlot(key);
+    // Unmapped, the seed redirects the keys of nodeB.
+    std::string keyB = "b";
+    while (dpool::keyHashSlot(keyB) < 8192) {
+        keyB += "b";
+    }
+    int cold = clusterCommand(pool, cluster, keyB);
+    bool stale = pool.isStale();
+    pool.updateSlots(cluster.slots());
+    int warm = 0;
+    for (int i = 0; i < 100; i++) {
+        warm += clusterCommand(pool, cluster, "key:" + std::to_string(i));
+    }
+    std::string owner = pool.nodeOf(slot);
+    cluster.migrate(slot, nodeC);
+    int asked = clusterCommand(pool, cluster, key);
+    std::string during = pool.nodeOf(slot);
+    cluster.assign(slot, slot, nodeC);
+    int moved = clusterCommand(pool, cluster, key);
+    int after = clusterCommand(pool, cluster, key);
+    // nodeA leaves the cluster, with a connection borrowed.
+    std::shared_ptr<dpool::SimPooledObject> held = pool.get("key:0");
+    cluster.assign(0, 8191, nodeB);
+    cluster.assign(slot, slot, nodeC);
+    pool.updateSlots(cluster.slots());
+    pool.put(held);
+    held.reset();
+    // Its idle connections were closed, and so was the one put back.
+    int openA = dpool::SimBackend::instance().server(nodeA).numOpen;
+    if (cold != 1 || !stale || warm != 0 || asked != 1 || moved != 1 || after != 0
+            || during != owner || pool.nodeOf(slot) != nodeC.to_string() || pool.numMoved() != 2
+            || pool.numAsk() != 1 || pool.numNodes() != 2 || pool.nodeOf(0) != nodeB.to_string()
+            || openA != 0) {
+        std::cout << "unexpected cluster routing: " << cold << " " << warm << " " << asked << " " << moved
+                  << " " << after << " redirections, " << pool.numNodes() << " nodes, " << openA
+                  << " connections left open" << std::endl;
+        return false;
+    }
+
+    // The index of a retired node goes to the next new one, once nothing is
+    // borrowed from it.
+    dpool::InetSocketAddress nodeD("10.0.5.4", 7000);
+    SimClusterPool small(std::vector<dpool::InetSocketAddress>(1, nodeA), dpool::PoolConfig(100, 100, 4, 4), 2);
+    small.updateSlots(std::vector<dpool::ClusterSlotRange>(1, dpool::ClusterSlotRange(0, 16383, nodeB)));
+    held = small.get("key:0");
+    small.updateSlots(std::vector<dpool::ClusterSlotRange>(1, dpool::ClusterSlotRange(0, 16383, nodeC)));
+    bool reused = small.nodeOf(0) == nodeC.to_string();
+    std::vector<dpool::ClusterSlotRange> ranges(1, dpool::ClusterSlotRange(0, 8191, nodeC));
+    ranges.push_back(dpool::ClusterSlotRange(8192, 16383, nodeD));
+    small.updateSlots(ranges);
+    bool blocked = small.nodeOf(16383).empty();
+    small.put(held);
+    small.updateSlots(ranges);
+    if (!reused || !blocked || small.nodeOf(16383) != nodeD.to_string() || small.numNodes() != 2) {
+        std::cout << "unexpected cluster node reuse: reused " << reused << ", blocked " << blocked << ", "
+                  << small.numNodes() << " nodes" << std::endl;
+        return false;
+    }
+
+    // The node pools are allocated on their alignment, and so are the
+    // replicated pools.
+    typedef dpool::ReplicatedPool<dpool::SimPooledObject, SimPool> SimReplicatedPool;
+    std::unique_ptr<SimPool> node(new SimPool(std::vector<dpool::InetSocketAddress>(1, nodeD),
+                                              dpool::PoolConfig(100, 100, 4, 4)));
+    std::unique_ptr<SimReplicatedPool> replicated(new SimReplicatedPool(
+            std::vector<dpool::ReplicaSet>(1, dpool::ReplicaSet(nodeD, std::vector<dpool::InetSocketAddress>())),
+            dpool::PoolConfig(100, 100, 4, 4)));
+    if (reinterpret_cast<uintptr_t>(node.get()) % alignof(SimPool) != 0
+            || reinterpret_cast<uintptr_t>(replicated.get()) % alignof(SimReplicatedPool) != 0) {
+        std::cout << "unexpected pool alignment" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Clients borrow the sockets of a broker, and give them back
+static bool testBroker() {
+    resetSimulation();
+    const std::string path = "/tmp/dpool-sim-broker-" + std::to_string(::getpid());
+    SocketPairPool pool(std::vector<dpool::InetSocketAddress>(1, server1), dpool::PoolConfig(100, 100, 1, 1));
+    dpool::ConnectionBroker<SocketPairObject, SocketPairPool> broker(pool, path);
+    std::thread serving([&broker] { broker.serve(); });
+    const dpool::InetSocketAddress brokerAddr(path, 0);
+    auto returned = [&broker] {
+        for (int i = 0; i < 1000 && broker.numLent() != 0; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return broker.numLent() == 0;
+    };
+
+    dpool::BrokeredConnection a(brokerAddr, 1000, 1000);
+    dpool::BrokeredConnection b(brokerAddr, 1000, 1000);
+    bool lent = a.tryOpen() == nullptr && ::write(a.getFd(), "ping", 4) == 4
+             && a.getServer() == server1.to_string();
+    // One connection to lend
+    bool refused = b.tryOpen() != nullptr && b.getFd() == -1;
+    a.release();
+    bool back = returned();
+    char buf[4] = {0};
+    std::shared_ptr<SocketPairObject> c = pool.get();
+    bool written = ::read(c->peer(), buf, sizeof(buf)) == 4 && memcmp(buf, "ping", 4) == 0;
+    pool.put(c);
+
+    dpool::BrokeredConnection broken(brokerAddr, 1000, 1000);
+    broken.open();
+    broken.markBroken();
+    broken.release();
+    bool dropped = returned();
+    std::vector<dpool::PoolStats> stats;
+    pool.getPoolStats(stats);
+    broker.stop();
+    serving.join();
+    if (!lent || !refused || !back || !written || !dropped || stats[0].numBroken != 1) {
+        std::cout << "unexpected broker: lent " << lent << ", refused " << refused << ", back " << back
+                  << ", written " << written << ", broken " << stats[0].numBroken << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Events reach the listener
+static bool testListener() {
+    resetSimulation();
+    ListenedSimPool pool(servers(), dpool::PoolConfig());
+    for (int i = 0; i < 100; i++) {
+        pool.put(pool.get());
+    }
+    const CountingListener& listener = pool.listener();
+    if (listener.dials != 3 || listener.borrows != 100 || listener.returns != 100) {
+        std::cout << "unexpected listener events, dials: " << listener.dials << ", borrows: "
+                  << listener.borrows << ", returns: " << listener.returns << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    struct Test {
+        const char* name;
+        bool (*run)();
+    };
+    static const Test tests[] = {
+        {"testSimulation", testSimulation},
+        {"testShardPolicies", testShardPolicies},
+        {"testExporter", testExporter},
+        {"testLargeFleet", testLargeFleet},
+        {"testThreadLocalBalancers", testThreadLocalBalancers},
+        {"testAdaptiveLimits", testAdaptiveLimits},
+        {"testConcurrencyLimits", testConcurrencyLimits},
+        {"testReserves", testReserves},
+        {"testPriorityWaiters", testPriorityWaiters},
+        {"testBulkheads", testBulkheads},
+        {"testDeadline", testDeadline},
+        {"testBudget", testBudget},
+        {"testCoordinator", testCoordinator},
+        {"testZoneRouting", testZoneRouting},
+        {"testReplicaRouting", testReplicaRouting},
+        {"testClusterRouting", testClusterRouting},
+        {"testBroker", testBroker},
+        {"testListener", testListener},
+    };
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        bool ok = false;
+        try {
+            ok = tests[i].run();
+        } catch (dpool::DPoolException& ex) {
+            std::cout << ex.str() << std::endl;
+        }
+        if (!ok) {
+            std::cout << tests[i].name << " failed" << std::endl;
+            failed++;
+        }
+    }
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -40,6 +40,17 @@ class PooledRedisContext : public dpool::PooledObject {
         return;
     }
 
+    virtual int getFd() const override {
+        return ctx != nullptr ? ctx->fd : -1;
+    }
+
+  protected:
+    virtual void applyDataTimeout(int ms) override {
+        struct timeval tv;
+        tv.tv_sec = ms / 1000; tv.tv_usec = 1000 * (ms % 1000);
+        redisSetTimeout(ctx, tv);
+    }
+
   public: // FIXME
     redisContext *ctx;
 };
@@ -0,0 +1,157 @@
+// Run a ConnectionBroker: hold warm TCP connections to the servers, and lend
+// them to the processes of the host through a Unix socket, see broker.h.
+//
+// Usage: broker <socket-path> <host:port>... [-w warm] [-i maxIdle] [-a maxActive]
+//
+// warm - connections to dial per server on startup, default 0
+//
+// The broker lends plain TCP connections: a server that wants the clients to
+// authenticate needs a broker built on the connection type of its client
+// library, doing so in open().
+
+#include <iostream>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "dpool.h"
+#include "broker.h"
+
+class TcpConnection : public dpool::PooledObject {
+  public:
+    TcpConnection(const dpool::InetSocketAddress& addr, const int connTimeout, const int dataTimeout)
+      : PooledObject(addr, connTimeout, dataTimeout), fd_(-1) {
+    }
+
+    virtual ~TcpConnection() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    virtual void open() throw (dpool::DPoolException) override {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* res = nullptr;
+        if (::getaddrinfo(serverAddr_.host.c_str(), std::to_string(serverAddr_.port).c_str(), &hints, &res) != 0) {
+            throw dpool::DPoolException("can't resolve " + serverAddr_.host, __FILE__, __LINE__);
+        }
+        for (struct addrinfo* ai = res; ai != nullptr && fd_ < 0; ai = ai->ai_next) {
+            fd_ = connect(ai);
+        }
+        ::freeaddrinfo(res);
+        if (fd_ < 0) {
+            throw dpool::DPoolException("can't connect to " + serverAddr_.to_string(), __FILE__, __LINE__);
+        }
+    }
+
+    virtual int getFd() const override {
+        return fd_;
+    }
+
+  private:
+    // Connect within connTimeout_, -1 if it failed.
+    int connect(const struct addrinfo* ai) {
+        int fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+        if (fd < 0) {
+            return -1;
+        }
+        if (::connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS) {
+            ::close(fd);
+            return -1;
+        }
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (::poll(&pfd, 1, connTimeout_) != 1 || ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0
+                || err != 0) {
+            ::close(fd);
+            return -1;
+        }
+        // The clients get a blocking socket, with the data timeout.
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        struct timeval tv;
+        tv.tv_sec = dataTimeout_ / 1000; tv.tv_usec = 1000 * (dataTimeout_ % 1000);
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return fd;
+    }
+
+    int fd_;
+};
+
+typedef dpool::DPool<TcpConnection> TcpPool;
+
+static dpool::ConnectionBroker<TcpConnection>* broker = nullptr;
+
+static void onSignal(int) {
+    broker->stop();
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<dpool::InetSocketAddress> servers;
+    int warm = 0;
+    int maxIdle = 10;
+    int maxActive = 100;
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-w") == 0) {
+            warm = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-i") == 0) {
+            maxIdle = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-a") == 0) {
+            maxActive = atoi(argv[++i]);
+        } else {
+            const char* colon = strrchr(argv[i], ':');
+            if (colon == nullptr) {
+                servers.clear();
+                break;
+            }
+            servers.push_back(dpool::InetSocketAddress(std::string(argv[i], colon - argv[i]), atoi(colon + 1)));
+        }
+    }
+    if (argc < 3 || servers.empty()) {
+        std::cerr << "usage: " << argv[0] << " <socket-path> <host:port>... [-w warm] [-i maxIdle] [-a maxActive]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        TcpPool pool(servers, dpool::PoolConfig(100, 1000, maxIdle, maxActive));
+        // Dial the warm connections, then keep them idle.
+        std::vector<std::shared_ptr<TcpConnection>> held;
+        std::shared_ptr<TcpConnection> c;
+        for (size_t i = 0; i < warm * servers.size(); i++) {
+            if (pool.tryGet(c) == dpool::kGetOk) {
+                held.push_back(c);
+            }
+        }
+        for (auto it = held.begin(); it != held.end(); it++) {
+            pool.put(*it);
+        }
+        held.clear();
+
+        dpool::ConnectionBroker<TcpConnection> server(pool, argv[1]);
+        broker = &server;
+        signal(SIGINT, onSignal);
+        signal(SIGTERM, onSignal);
+        std::cout << "lending connections to " << servers.size() << " servers on " << argv[1] << std::endl;
+        server.serve();
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        broker = nullptr;
+    } catch (dpool::DPoolException& ex) {
+        std::cerr << ex.str() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+// Measure get/put throughput of a default DPool under contention: worker
+// threads borrow and return in-memory connections as fast as they can, while
+// an optional checker thread keeps running health check rounds, reading the
+// state of every shard like the health checker does.
+//
+// Usage: contention-bench [threads] [seconds] [servers] [checker]
+//
+// threads - borrowing threads, default is the number of CPUs
+// servers - shards of the pool, default 1 for a single hot shard
+// checker - 1 to run health check rounds continuously, default 1
+//
+// The tool only uses the stable DPool API, so that it can be built against
+// older revisions to compare memory layouts. Worker threads are pinned to
+// distinct CPUs, as false sharing only shows across cores: the results of a
+// single CPU host say nothing about it.
+
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "dpool.h"
+
+class BenchObject : public dpool::PooledObject {
+  public:
+    BenchObject(const dpool::InetSocketAddress& addr, const int connTimeout, const int dataTimeout)
+      : PooledObject(addr, connTimeout, dataTimeout) {
+    }
+
+    virtual void open() throw (dpool::DPoolException) override {}
+};
+
+typedef dpool::DPool<BenchObject> BenchPool;
+
+// CPUs the process may run on
+static std::vector<int> allowedCpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i, &set)) {
+                cpus.push_back(i);
+            }
+        }
+    }
+    return cpus;
+}
+
+// Pin the calling thread to CPU @cpu.
+static void pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+int main(int argc, char* argv[]) {
+    int numThreads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+    int numServers = argc > 3 ? atoi(argv[3]) : 1;
+    bool checker = argc > 4 ? atoi(argv[4]) != 0 : true;
+    if (numThreads <= 0 || seconds <= 0 || numServers <= 0) {
+        std::cerr << "usage: " << argv[0] << " [threads] [seconds] [servers] [checker]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::vector<int> cpus = allowedCpus();
+    if (cpus.size() < 2) {
+        std::cerr << "warning: single CPU, the results say nothing about false sharing" << std::endl;
+    }
+
+    std::vector<dpool::InetSocketAddress> servers;
+    for (int i = 0; i < numServers; i++) {
+        servers.push_back(dpool::InetSocketAddress("10.0.0." + std::to_string(i + 1), 6379));
+    }
+    // Enough connections for every thread, so that only the pool contends.
+    dpool::PoolConfig config(100, 100, numThreads, numThreads * 2);
+    BenchPool pool(servers, config);
+
+    std::atomic<bool> stop(false);
+    std::vector<uint64_t> ops(numThreads, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.push_back(std::thread([&pool, &stop, &ops, &cpus, t]() {
+            if (cpus.size() > 1) {
+                pin(cpus[t % cpus.size()]);
+            }
+            uint64_t n = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                try {
+                    pool.put(pool.get());
+                    n++;
+                } catch (dpool::DPoolException&) {
+                }
+            }
+            ops[t] = n;
+        }));
+    }
+
+    uint64_t rounds = 0;
+    std::thread checkerThread;
+    if (checker) {
+        checkerThread = std::thread([&pool, &stop, &rounds]() {
+            while (!stop.load(std::memory_order_relaxed)) {
+                pool.runHealthCheck();
+                rounds++;
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop.store(true);
+    for (auto it = threads.begin(); it != threads.end(); it++) {
+        it->join();
+    }
+    if (checkerThread.joinable()) {
+        checkerThread.join();
+    }
+
+    uint64_t total = 0;
+    for (auto it = ops.begin(); it != ops.end(); it++) {
+        total += *it;
+    }
+    std::cout << "threads: " << numThreads << ", servers: " << numServers
+              << ", checker rounds: " << rounds << std::endl;
+    std::cout << "get/put: " << total / seconds << " ops/s, "
+              << (total > 0 ? seconds * 1e9 * numThreads / total : 0) << " ns/op per thread" << std::endl;
+    return EXIT_SUCCESS;
+}
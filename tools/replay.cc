@@ -0,0 +1,55 @@
+// Replay a trace recorded by dpool::TraceRecorder against a pool of simulated
+// connections, to reproduce production borrow patterns off-line.
+//
+// Usage: replay <trace-file> [speed] [maxIdle] [maxActive]
+//
+// speed - how much faster than recorded to replay the trace, 0 to replay on a
+//         virtual clock, as fast as possible. Default is 0.
+
+#include <iostream>
+#include <cstdlib>
+
+#include "dpool.h"
+#include "simulation.h"
+
+typedef dpool::DPool<dpool::SimPooledObject, dpool::LockedShard, dpool::RoundRobinBalancer,
+                     dpool::CountingStats, dpool::SimClock> VirtualTimePool;
+typedef dpool::DPool<dpool::SimPooledObject> RealTimePool;
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <trace-file> [speed] [maxIdle] [maxActive]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    double speed = argc > 2 ? atof(argv[2]) : 0;
+    int maxIdle = argc > 3 ? atoi(argv[3]) : 10;
+    int maxActive = argc > 4 ? atoi(argv[4]) : 100;
+
+    std::vector<dpool::TraceRecord> records;
+    try {
+        dpool::loadTrace(argv[1], records);
+    } catch (dpool::DPoolException& ex) {
+        std::cerr << ex.str() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // One simulated server per shard seen in the trace
+    int numShards = 1;
+    for (auto it = records.begin(); it != records.end(); it++) {
+        if (it->shard != dpool::TraceRecord::kNoShard && it->shard + 1 > numShards) {
+            numShards = it->shard + 1;
+        }
+    }
+    std::vector<dpool::InetSocketAddress> servers;
+    for (int i = 0; i < numShards; i++) {
+        servers.push_back(dpool::InetSocketAddress("10.0.0." + std::to_string(i + 1), 6379));
+    }
+
+    const dpool::PoolConfig config(100, 100, maxIdle, maxActive);
+    std::cout << "replaying " << records.size() << " records over " << numShards << " shards" << std::endl;
+    dpool::SimResult result = speed > 0
+            ? dpool::replayTrace<RealTimePool>(records, servers, config, speed)
+            : dpool::replayTrace<VirtualTimePool>(records, servers, config);
+    result.dump(std::cout);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,184 @@
+#ifndef DPOOL_TRACE_H_
+#define DPOOL_TRACE_H_
+
+#include <atomic>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dpool-exception.h"
+
+namespace dpool {
+
+// Small sequential id of the calling thread, cheaper to log than std::thread::id.
+inline uint32_t traceThreadId() {
+    static std::atomic<uint32_t> nextId(0);
+    static thread_local uint32_t id = nextId.fetch_add(1, std::memory_order_relaxed);
+    return id;
+}
+
+// One get() or put() of a pool, as written in the trace file.
+struct TraceRecord {
+    enum Op : uint8_t { kGet = 1, kPut = 2 };
+
+    enum Flag : uint8_t {
+        kFailed = 1,    // get: no connection could be borrowed
+        kBroken = 2,    // put: returned as broken
+    };
+
+    // Nanoseconds since the epoch of the pool clock
+    uint64_t timestampNs;
+    // get: time spent in DPool::get(); put: time the connection was borrowed
+    uint32_t durationUs;
+    uint32_t thread;
+    // Index of the shard in the server list, kNoShard if the get failed
+    uint16_t shard;
+    uint8_t op;
+    uint8_t flags;
+    // Identifies the borrowed object, to pair a put with its get
+    uint32_t conn;
+
+    static const uint16_t kNoShard = 0xFFFF;
+};
+
+static_assert(sizeof(TraceRecord) == 24, "TraceRecord must stay compact");
+
+// Header of a trace file, followed by @capacity records.
+struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t capacity;
+    // Total number of records ever written; the ring wraps when it exceeds capacity.
+    std::atomic<uint64_t> head;
+};
+
+static const char kTraceMagic[8] = {'D', 'P', 'T', 'R', 'A', 'C', 'E', '1'};
+
+// TraceRecorder logs every get/put of a pool into a binary ring buffer backed
+// by a memory mapped file, so that the most recent @capacity operations
+// survive the process. Recording is lock free: a slot is claimed with one
+// fetch_add and filled with plain stores, nothing else is done on the
+// borrowing thread. Attach it with DPool::setTraceRecorder().
+class TraceRecorder {
+  public:
+    TraceRecorder(const std::string& path, uint64_t capacity = 1 << 20)
+        : fd_(-1), header_(nullptr), records_(nullptr), capacity_(capacity) {
+        assert(capacity > 0);
+        size_ = sizeof(TraceFileHeader) + capacity * sizeof(TraceRecord);
+
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0 || ::ftruncate(fd_, size_) != 0) {
+            cleanup();
+            DPOOL_THROW("failed to create trace file " + path);
+        }
+        void* addr = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (addr == MAP_FAILED) {
+            cleanup();
+            DPOOL_THROW("failed to map trace file " + path);
+        }
+
+        header_ = static_cast<TraceFileHeader*>(addr);
+        memcpy(header_->magic, kTraceMagic, sizeof(kTraceMagic));
+        header_->version = 1;
+        header_->recordSize = sizeof(TraceRecord);
+        header_->capacity = capacity;
+        header_->head.store(0, std::memory_order_relaxed);
+        records_ = reinterpret_cast<TraceRecord*>(header_ + 1);
+    }
+
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;    // noncopyable
+
+    ~TraceRecorder() {
+        cleanup();
+    }
+
+    void record(uint64_t timestampNs, TraceRecord::Op op, uint16_t shard,
+                uint64_t durationUs, uint8_t flags, const void* conn) {
+        uint64_t seq = header_->head.fetch_add(1, std::memory_order_relaxed);
+        TraceRecord& r = records_[seq % capacity_];
+        r.timestampNs = timestampNs;
+        r.durationUs = durationUs > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(durationUs);
+        r.thread = traceThreadId();
+        r.shard = shard;
+        r.op = op;
+        r.flags = flags;
+        r.conn = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(conn) >> 4);
+    }
+
+    // Flush the mapped records to disk.
+    void sync() {
+        ::msync(header_, size_, MS_SYNC);
+    }
+
+  private:
+    void cleanup() {
+        if (header_ != nullptr) {
+            ::munmap(header_, size_);
+            header_ = nullptr;
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    int fd_;
+    size_t size_;
+    TraceFileHeader* header_;
+    TraceRecord* records_;
+    const uint64_t capacity_;
+};
+
+// Load the records of a trace file in timestamp order.
+inline void loadTrace(const std::string& path, std::vector<TraceRecord>& records) {
+    records.clear();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(TraceFileHeader)) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        DPOOL_THROW("failed to open trace file " + path);
+    }
+    void* addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        DPOOL_THROW("failed to map trace file " + path);
+    }
+
+    const TraceFileHeader* header = static_cast<const TraceFileHeader*>(addr);
+    if (memcmp(header->magic, kTraceMagic, sizeof(kTraceMagic)) != 0
+            || header->recordSize != sizeof(TraceRecord)
+            || sizeof(TraceFileHeader) + header->capacity * sizeof(TraceRecord) > (uint64_t)st.st_size) {
+        ::munmap(addr, st.st_size);
+        DPOOL_THROW("invalid trace file " + path);
+    }
+
+    const TraceRecord* ring = reinterpret_cast<const TraceRecord*>(header + 1);
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    uint64_t first = head > header->capacity ? head - header->capacity : 0;
+    records.reserve(head - first);
+    for (uint64_t seq = first; seq < head; seq++) {
+        records.push_back(ring[seq % header->capacity]);
+    }
+    ::munmap(addr, st.st_size);
+
+    // Concurrent writers may have claimed slots slightly out of timestamp order.
+    std::stable_sort(records.begin(), records.end(),
+                     [](const TraceRecord& a, const TraceRecord& b) { return a.timestampNs < b.timestampNs; });
+}
+
+} // namespace dpool
+
+#endif // DPOOL_TRACE_H_